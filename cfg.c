@@ -0,0 +1,512 @@
+#include "program.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Control flow recovery works by recursive descent: starting from the entry
+ * point (and any labels the symbols say are instructions), follow every
+ * branch, subroutine call and fall-through, marking what we reach as code.
+ * Everything else in the image is data. Blocks end at anything that
+ * transfers control, and start at anything control transfers to.
+ *
+ * Subroutine calls (and traps) end a block, and the block carries on at the
+ * return point: to the graph a call is just a long-winded instruction, so
+ * dominators and loops are per-subroutine. Entry points (the program's and
+ * every JSR target's), and blocks nothing reaches, hang off a virtual
+ * root. */
+
+#define IS_LABEL(prog, addr)                                                  \
+  ((prog)->sym[addr] && *(prog)->sym[addr]->label != '_')
+
+/* does this instruction end a basic block? */
+static int
+is_terminator (uint16_t word)
+{
+  switch (word >> 12)
+    {
+    case OP_BR:
+      return (word & 0x0E00) != 0; // BR with no condition codes is a NOP
+    case OP_JMP:
+    case OP_JSR:
+    case OP_TRAP:
+    case OP_RTI:
+    case OP_RES:
+      return 1;
+    }
+  return 0;
+}
+
+static void
+discover (cfg *g, program *prog, uint16_t entry)
+{
+  uint16_t *work = malloc (MEMORY_MAX * sizeof (uint16_t));
+  uint8_t *kind = g->kind;
+  int n = 0;
+
+#define PUSH(a, flags)                                                        \
+  do                                                                          \
+    {                                                                         \
+      uint16_t a_ = (a);                                                      \
+      kind[a_] |= (flags);                                                    \
+      if (!(kind[a_] & W_LEADER))                                             \
+        {                                                                     \
+          kind[a_] |= W_LEADER;                                               \
+          work[n++] = a_;                                                     \
+        }                                                                     \
+    }                                                                         \
+  while (0)
+
+  PUSH (entry, W_ENTRY);
+  for (int addr = prog->orig; addr < prog->orig + prog->len; addr++)
+    if (IS_LABEL (prog, addr) && (prog->sym[addr]->flags >> 12) == HINT_INST)
+      PUSH (addr, 0);
+
+  while (n > 0)
+    {
+      uint16_t addr = work[--n];
+      for (;;)
+        {
+          if (kind[addr] & W_CODE)
+            break; // already walked from here
+          kind[addr] |= W_CODE;
+
+          uint16_t word = prog->mem[addr], next = addr + 1;
+          int falls = 1;
+          switch (word >> 12)
+            {
+            case OP_BR:
+              if (word & 0x0E00)
+                PUSH (next + SIGN_EXTEND (word & 0x1FF, 9), 0);
+              if ((word & 0x0E00) == 0x0E00)
+                falls = 0;
+              else if (word & 0x0E00)
+                PUSH (next, 0);
+              break;
+            case OP_JSR:
+              if (word & 0x0800)
+                PUSH (next + SIGN_EXTEND (word & 0x7FF, 11), W_ENTRY);
+              PUSH (next, 0); // where the subroutine returns to
+              break;
+            case OP_TRAP:
+              if ((word & 0xFF) == TRAP_HALT)
+                falls = 0;
+              else
+                PUSH (next, 0); // R7 points here, so it can be jumped to
+              break;
+            case OP_JMP:
+            case OP_RTI:
+            case OP_RES:
+              falls = 0;
+              break;
+            }
+
+          if (!falls)
+            break;
+          if (!next) // wrapped around
+            {
+              PUSH (next, 0);
+              break;
+            }
+          addr = next;
+        }
+    }
+
+#undef PUSH
+  free (work);
+
+  for (int addr = prog->orig; addr < prog->orig + prog->len; addr++)
+    if (!(kind[addr] & W_CODE))
+      kind[addr] |= W_DATA;
+}
+
+/* the target of a PC-relative transfer */
+#define TARGET(next, word, bits)                                              \
+  ((uint16_t)((next) + SIGN_EXTEND ((word) & ((1 << (bits)) - 1), (bits))))
+
+static void
+split_blocks (cfg *g, program *prog)
+{
+  int open = 0; // is there a block to extend?
+  for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+      if (!(g->kind[addr] & W_CODE))
+        {
+          open = 0;
+          continue;
+        }
+
+      if (!open || (g->kind[addr] & W_LEADER))
+        {
+          cfg_block *b = g->blocks + g->nblocks++;
+          b->start = addr;
+          b->succ[0] = b->succ[1] = b->call = CFG_NONE;
+          g->kind[addr] |= W_LEADER;
+        }
+      g->blocks[g->nblocks - 1].end = addr;
+      g->block_of[addr] = g->nblocks - 1;
+      open = !is_terminator (prog->mem[addr]);
+    }
+
+  for (uint32_t i = 0; i < g->nblocks; i++)
+    {
+      cfg_block *b = g->blocks + i;
+      uint16_t word = prog->mem[b->end], next = b->end + 1;
+      int falls = 1;
+      switch (word >> 12)
+        {
+        case OP_BR:
+          if (word & 0x0E00)
+            b->succ[1] = g->block_of[TARGET (next, word, 9)];
+          falls = (word & 0x0E00) != 0x0E00;
+          break;
+        case OP_JSR:
+          b->flags |= CB_CALL;
+          if (word & 0x0800)
+            b->call = g->block_of[TARGET (next, word, 11)];
+          else
+            b->flags |= CB_INDIRECT;
+          break;
+        case OP_TRAP:
+          falls = (word & 0xFF) != TRAP_HALT;
+          break;
+        case OP_JMP:
+          b->flags |= CB_INDIRECT;
+          if (((word >> 6) & 0x7) == R_R7)
+            b->flags |= CB_RETURN;
+          falls = 0;
+          break;
+        case OP_RTI:
+        case OP_RES:
+          falls = 0;
+          break;
+        }
+      if (falls && (g->kind[next] & W_CODE))
+        b->succ[0] = g->block_of[next];
+      if (b->succ[0] == b->succ[1])
+        b->succ[1] = CFG_NONE;
+    }
+}
+
+/* intersect() from Cooper, Harvey & Kennedy, "A Simple, Fast Dominance
+ * Algorithm", on reverse postorder numbers */
+static uint32_t
+intersect (const uint32_t idom[], const uint32_t rpo[], uint32_t a, uint32_t b)
+{
+  while (a != b)
+    {
+      while (rpo[a] > rpo[b])
+        a = idom[a];
+      while (rpo[b] > rpo[a])
+        b = idom[b];
+    }
+  return a;
+}
+
+static int
+dominators (cfg *g)
+{
+  uint32_t n = g->nblocks, root = n; // index n is the virtual root
+  uint32_t *npreds = calloc (n + 1, sizeof (uint32_t));
+  uint32_t *first = calloc (n + 2, sizeof (uint32_t));
+  uint32_t *preds = calloc (2 * n + 1, sizeof (uint32_t));
+  uint32_t *order = calloc (n + 1, sizeof (uint32_t));
+  uint32_t *rpo = calloc (n + 1, sizeof (uint32_t));
+  uint32_t *stack = calloc (2 * n + 2, sizeof (uint32_t));
+  uint8_t *seen = calloc (n + 1, 1);
+  if (!npreds || !first || !preds || !order || !rpo || !stack || !seen)
+    {
+      free (npreds), free (first), free (preds), free (order);
+      free (rpo), free (stack), free (seen);
+      return 1;
+    }
+
+  /* predecessor lists, flattened */
+  for (uint32_t i = 0; i < n; i++)
+    for (int s = 0; s < 2; s++)
+      if (g->blocks[i].succ[s] != CFG_NONE)
+        npreds[g->blocks[i].succ[s]]++;
+  for (uint32_t i = 0; i < n; i++)
+    first[i + 1] = first[i] + npreds[i];
+  memset (npreds, 0, n * sizeof (uint32_t));
+  for (uint32_t i = 0; i < n; i++)
+    for (int s = 0; s < 2; s++)
+      {
+        uint32_t t = g->blocks[i].succ[s];
+        if (t != CFG_NONE)
+          preds[first[t] + npreds[t]++] = i;
+      }
+
+  /* postorder from the virtual root, whose children are the entry points
+   * and the blocks nothing else reaches; anything left over (a cycle only
+   * reachable from itself) becomes a child too */
+  uint32_t count = 0;
+  seen[root] = 1;
+  for (int pass = 0; pass < 2; pass++)
+    for (uint32_t i = 0; i < n; i++)
+      {
+        if (seen[i]
+            || (pass == 0 && npreds[i]
+                && !(g->kind[g->blocks[i].start] & W_ENTRY)))
+          continue;
+
+        int sp = 0;
+        seen[i] = 1;
+        g->blocks[i].idom = root;
+        stack[sp++] = i;
+        stack[sp++] = 0;
+        while (sp)
+          {
+            uint32_t b = stack[sp - 2], s = stack[sp - 1]++;
+            if (s < 2)
+              {
+                uint32_t t = g->blocks[b].succ[s];
+                if (t != CFG_NONE && !seen[t])
+                  {
+                    seen[t] = 1;
+                    g->blocks[t].idom = CFG_NONE;
+                    stack[sp++] = t;
+                    stack[sp++] = 0;
+                  }
+                continue;
+              }
+            order[count++] = b;
+            sp -= 2;
+          }
+      }
+  order[count] = root;
+  for (uint32_t i = 0; i <= count; i++)
+    rpo[order[i]] = count - i;
+
+  /* iterate to a fixed point in reverse postorder */
+  uint32_t *idom = calloc (n + 1, sizeof (uint32_t));
+  if (!idom)
+    {
+      free (npreds), free (first), free (preds), free (order);
+      free (rpo), free (stack), free (seen);
+      return 1;
+    }
+  for (uint32_t i = 0; i < n; i++)
+    idom[i] = g->blocks[i].idom;
+  idom[root] = root;
+
+  int changed = 1;
+  while (changed)
+    {
+      changed = 0;
+      for (uint32_t k = count; k-- > 0;)
+        {
+          uint32_t b = order[k];
+          if (idom[b] == root)
+            continue; // a child of the root, by construction
+
+          uint32_t new = CFG_NONE;
+          for (uint32_t p = first[b]; p < first[b + 1]; p++)
+            {
+              uint32_t q = preds[p];
+              if (idom[q] == CFG_NONE)
+                continue;
+              new = (new == CFG_NONE) ? q : intersect (idom, rpo, q, new);
+            }
+          if (new != idom[b])
+            {
+              idom[b] = new;
+              changed = 1;
+            }
+        }
+    }
+
+  for (uint32_t i = 0; i < n; i++)
+    g->blocks[i].idom = (idom[i] == root) ? CFG_NONE : idom[i];
+
+  /* natural loops: a back edge b -> h where h dominates b. Headers are
+   * visited outermost first, so inner loops overwrite cfg_block.loop */
+  for (uint32_t k = count; k-- > 0;) // dominators come first in RPO
+    {
+      uint32_t h = order[k];
+      memset (seen, 0, n);
+      int sp = 0;
+      for (uint32_t p = first[h]; p < first[h + 1]; p++)
+        {
+          uint32_t b = preds[p], d = b;
+          while (d != h && d != CFG_NONE && idom[d] != root)
+            d = idom[d];
+          if (d != h || seen[b])
+            continue; // not a back edge
+          seen[b] = 1;
+          stack[sp++] = b;
+        }
+      if (!sp)
+        continue;
+
+      seen[h] = 1;
+      g->blocks[h].flags |= CB_HEADER;
+      g->blocks[h].loop = h;
+      g->blocks[h].depth++;
+      while (sp)
+        {
+          uint32_t b = stack[--sp];
+          if (b != h)
+            {
+              g->blocks[b].loop = h;
+              g->blocks[b].depth++;
+            }
+          for (uint32_t p = first[b]; p < first[b + 1]; p++)
+            if (!seen[preds[p]])
+              {
+                seen[preds[p]] = 1;
+                stack[sp++] = preds[p];
+              }
+        }
+    }
+
+  free (npreds), free (first), free (preds), free (order);
+  free (rpo), free (stack), free (seen), free (idom);
+  return 0;
+}
+
+cfg *
+build_cfg (program *prog, uint16_t entry)
+{
+  cfg *g = calloc (1, sizeof (cfg));
+  if (!g)
+    return 0;
+
+  discover (g, prog, entry);
+
+  // never more than one block per word; we'll trim this afterwards
+  g->blocks = calloc (MEMORY_MAX, sizeof (cfg_block));
+  if (!g->blocks)
+    {
+      free (g);
+      return 0;
+    }
+
+  split_blocks (g, prog);
+  cfg_block *blocks = realloc (g->blocks, g->nblocks * sizeof (cfg_block));
+  if (blocks || !g->nblocks)
+    g->blocks = blocks;
+  for (uint32_t i = 0; i < g->nblocks; i++)
+    g->blocks[i].loop = CFG_NONE;
+  if (dominators (g) != 0)
+    {
+      free_cfg (g);
+      return 0;
+    }
+
+  return g;
+}
+
+void
+free_cfg (cfg *g)
+{
+  if (g)
+    free (g->blocks);
+  free (g);
+}
+
+/* a block, by its start address */
+static const char *
+block_name (char *buf, cfg *g, uint32_t i)
+{
+  if (i == CFG_NONE)
+    return "-";
+  sprintf (buf, "x%04X", g->blocks[i].start);
+  return buf;
+}
+
+uint16_t
+dump_cfg (FILE *out, cfg *g, program *prog)
+{
+  char b1[16], b2[16], b3[16], b4[16], b5[16];
+  int code = 0, data = 0;
+  for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+      code += (g->kind[addr] & W_CODE) != 0;
+      data += (g->kind[addr] & W_DATA) != 0;
+    }
+  fprintf (out, "# %u blocks, %d code words, %d data words\n", g->nblocks,
+           code, data);
+
+  fprintf (out, "\n%-14s%-20s%-14s%-8s%-8s%-8s%s\n", "# block", "label",
+           "succ", "call", "idom", "loop", "depth");
+  for (uint32_t i = 0; i < g->nblocks; i++)
+    {
+      cfg_block *b = g->blocks + i;
+      char range[16], succ[32] = "";
+      const char *call = "-";
+      sprintf (range, "x%04X-x%04X", b->start, b->end);
+      for (int k = 0; k < 2; k++)
+        if (b->succ[k] != CFG_NONE)
+          sprintf (succ + strlen (succ), "%s%s", *succ ? "," : "",
+                   block_name (b1, g, b->succ[k]));
+      if (b->flags & CB_CALL)
+        call = (b->flags & CB_INDIRECT) ? "?" : block_name (b2, g, b->call);
+      else if (b->flags & CB_INDIRECT) // JMP goes who knows where
+        strcpy (succ, (b->flags & CB_RETURN) ? "ret" : "?");
+      if (!*succ)
+        strcpy (succ, "-");
+
+      fprintf (out, "%-14s%-20s%-14s%-8s%-8s%-8s%u\n", range,
+               IS_LABEL (prog, b->start) ? prog->sym[b->start]->label : "",
+               succ, call, block_name (b3, g, b->idom),
+               block_name (b4, g, b->loop), b->depth);
+    }
+
+  fprintf (out, "\n%-14s%s\n", "# data", "label");
+  for (int addr = 0; addr < MEMORY_MAX;)
+    {
+      if (!(g->kind[addr] & W_DATA))
+        {
+          addr++;
+          continue;
+        }
+      int start = addr;
+      do
+        addr++;
+      while (addr < MEMORY_MAX && (g->kind[addr] & W_DATA)
+             && !IS_LABEL (prog, addr));
+      sprintf (b5, "x%04X-x%04X", start, addr - 1);
+      fprintf (out, "%-14s%s\n", b5,
+               IS_LABEL (prog, start) ? prog->sym[start]->label : "");
+    }
+
+  return 0;
+}
+
+uint16_t
+dump_cfg_dot (FILE *out, cfg *g, program *prog)
+{
+  char buf[4096], b1[16], b2[16];
+
+  fprintf (out, "digraph cfg {\n"
+                "  node [shape=box, fontname=monospace];\n");
+  for (uint32_t i = 0; i < g->nblocks; i++)
+    {
+      cfg_block *b = g->blocks + i;
+      fprintf (out, "  \"%s\" [label=\"", block_name (b1, g, i));
+      if (IS_LABEL (prog, b->start))
+        fprintf (out, "%s:\\l", prog->sym[b->start]->label);
+      for (int addr = b->start; addr <= b->end; addr++)
+        {
+          *buf = 0;
+          disassemble_addr (buf, 0, addr, prog);
+          fprintf (out, "x%04X  ", addr);
+          for (char *c = buf; *c; c++) // escape for a dot string
+            fprintf (out, (*c == '"' || *c == '\\') ? "\\%c" : "%c", *c);
+          fprintf (out, "\\l");
+        }
+      fprintf (out, "\"%s];\n",
+               (b->flags & CB_HEADER) ? ", peripheries=2" : "");
+
+      for (int s = 0; s < 2; s++)
+        if (b->succ[s] != CFG_NONE)
+          fprintf (out, "  \"%s\" -> \"%s\";\n", block_name (b1, g, i),
+                   block_name (b2, g, b->succ[s]));
+      if (b->call != CFG_NONE)
+        fprintf (out, "  \"%s\" -> \"%s\" [style=dashed];\n",
+                 block_name (b1, g, i), block_name (b2, g, b->call));
+    }
+  fprintf (out, "}\n");
+
+  return 0;
+}
@@ -0,0 +1,807 @@
+#include "program.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // strncasecmp()
+/* unix only */
+#include <sys/time.h>
+
+/* The debugger holds a machine still between runs of the interpreter, and
+ * resumes it for as long as it's asked to go.
+ *
+ * Breakpoints are a bit per address, and the pages holding any are flagged
+ * PG_BREAK. The interpreter already tests a page's flags to fetch from it
+ * (for PG_DEVICE), and tests for both at once, so only instructions on a
+ * page with a breakpoint look the bit up. A program whose breakpoints
+ * aren't hit runs at full speed, uninstrumented. A breakpoint's condition
+ * is compiled once, when it's set, to a few words of postfix code over the
+ * registers and memory (see compile_cond()), so testing it each time it's
+ * reached is a short loop, not a parse.
+ *
+ * Watchpoints work the same way for loads and stores: pages with watched
+ * words in them are flagged PG_WATCH, which the interpreter tests along
+ * with PG_DEVICE, and only accesses to those pages check the ranges. One
+ * that's hit asks the machine to stop, as a signal would, once the
+ * instruction that hit it is done.
+ *
+ * Stepping sets the instruction limit. Finishing a subroutine has the
+ * (instrumented) interpreter count calls and returns until the one it's in
+ * returns, and stepping over a call is a step into it and then a finish,
+ * so recursion doesn't fool either.
+ *
+ * Running backwards is going back to a checkpoint and re-running forwards
+ * from there, quietly. While the debugger runs the machine, a timer on the
+ * CPU time it uses asks it to stop every so often (as a signal would) for
+ * a checkpoint. That's a captured image, costing only the pages written
+ * since the last one (see fork.c), and the uninstrumented interpreter runs
+ * in between. The keys the machine consumes are logged (see io.c) and
+ * handed back as it re-runs, and so are the times its timer expired (see
+ * device.c), each at the instruction it came at, so it does what it did
+ * before. Stepping back
+ * costs a checkpoint restore and at most one interval re-run; when the
+ * checkpoints fill up, every other one goes and the interval doubles.
+ * Continuing back re-runs the intervals from the latest back, noting the
+ * breakpoints and watchpoints it passes, until one has one; it then
+ * re-runs that interval up to the last of them.
+ *
+ * Something outside the machine (a ^C, a debugger on a socket) can stop it
+ * the same way, with interrupt_debug(). */
+
+#define MARK_MS 20 // CPU time between checkpoints, to start with
+
+static volatile sig_atomic_t mark_due, interrupted, going;
+static unsigned mark_ms = MARK_MS;
+
+/* stop the machine if the debugger's running it (safe in a signal
+ * handler); zero if it isn't */
+int
+interrupt_debug (void)
+{
+  if (!going)
+    return 0;
+  interrupted = 1;
+  stop_signal = 1;
+  device_signal = 1;
+  return 1;
+}
+
+static void
+mark_tick (int sig)
+{
+  mark_due = 1;
+  stop_signal = 1;
+  device_signal = 1;
+}
+
+/* checkpoint every ms of CPU time (0 to stop) */
+static void
+set_marks (unsigned ms)
+{
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = mark_tick;
+  sa.sa_flags = SA_RESTART;
+  sigaction (SIGVTALRM, &sa, 0);
+
+  struct itimerval it;
+  memset (&it, 0, sizeof (it));
+  it.it_interval.tv_sec = it.it_value.tv_sec = ms / 1000;
+  it.it_interval.tv_usec = it.it_value.tv_usec = ms % 1000 * 1000;
+  setitimer (ITIMER_VIRTUAL, &it, 0);
+}
+
+/* checkpoint the machine, thinning out the history if it's full */
+static void
+take_mark (program *prog)
+{
+  debug *dbg = prog->debug;
+  if (dbg->nmarks && dbg->marks[dbg->nmarks - 1]->icount == prog->icount)
+    return;
+
+  if (dbg->nmarks == MARKS_MAX) // keep the first and every other one
+    {
+      uint32_t kept = 1;
+      for (uint32_t i = 1; i < MARKS_MAX; i++)
+        if (i % 2 == 0)
+          dbg->marks[kept++] = dbg->marks[i];
+        else
+          free_image (dbg->marks[i]);
+      dbg->nmarks = kept;
+      set_marks (mark_ms *= 2);
+    }
+
+  vmimage *img = capture_image (prog);
+  if (!img)
+    {
+      fprintf (stderr, "warning: out of memory checkpointing\n");
+      return;
+    }
+  dbg->marks[dbg->nmarks++] = img;
+}
+
+/* drop the checkpoints after icount */
+static void
+drop_marks (debug *dbg, uint64_t icount)
+{
+  while (dbg->nmarks && dbg->marks[dbg->nmarks - 1]->icount > icount)
+    free_image (dbg->marks[--dbg->nmarks]);
+}
+
+/* forget the run's history, for a new run */
+static void
+forget (debug *dbg)
+{
+  while (dbg->nmarks)
+    free_image (dbg->marks[--dbg->nmarks]);
+  dbg->nkeys = dbg->nextkey = 0;
+  dbg->nexpiries = dbg->nextexpiry = 0;
+  mark_ms = MARK_MS;
+}
+
+void
+free_debug (debug *dbg)
+{
+  if (!dbg)
+    return;
+  forget (dbg);
+  for (uint32_t i = 0; i < dbg->nbps; i++)
+    free (dbg->bps[i].cond);
+  free (dbg->bps);
+  free (dbg->keys);
+  free (dbg->expiries);
+  free (dbg);
+}
+
+debug *
+attach_debug (program *prog)
+{
+  if (!prog->debug)
+    prog->debug = calloc (1, sizeof (debug));
+  return prog->debug;
+}
+
+int
+is_break (program *prog, uint16_t addr)
+{
+  return prog->debug && (prog->debug->breaks[addr >> 3] & (1 << (addr & 7)));
+}
+
+breakpoint *
+find_break (program *prog, uint16_t addr)
+{
+  if (!is_break (prog, addr))
+    return 0;
+  breakpoint *bp = prog->debug->bps;
+  while (bp->addr != addr)
+    bp++;
+  return bp;
+}
+
+/* set a breakpoint at addr (leaving one that's there already as it is), or
+ * clear it */
+uint16_t
+set_break (program *prog, uint16_t addr, int on)
+{
+  debug *dbg = attach_debug (prog);
+  if (!dbg)
+    {
+      fprintf (stderr, "error: out of memory setting a breakpoint\n");
+      return 1;
+    }
+
+  breakpoint *bp = find_break (prog, addr);
+  if (on && !bp)
+    {
+      if (dbg->nbps == dbg->maxbps)
+        {
+          uint32_t max = dbg->maxbps ? dbg->maxbps * 2 : 16;
+          breakpoint *bps = realloc (dbg->bps, max * sizeof (breakpoint));
+          if (!bps)
+            {
+              fprintf (stderr, "error: out of memory setting a "
+                               "breakpoint\n");
+              return 1;
+            }
+          dbg->bps = bps;
+          dbg->maxbps = max;
+        }
+      bp = dbg->bps + dbg->nbps++;
+      memset (bp, 0, sizeof (breakpoint));
+      bp->addr = addr;
+      dbg->breaks[addr >> 3] |= 1 << (addr & 7);
+    }
+  else if (!on && bp)
+    {
+      free (bp->cond);
+      *bp = dbg->bps[--dbg->nbps];
+      dbg->breaks[addr >> 3] &= ~(1 << (addr & 7));
+    }
+
+  // the page stays flagged while any word in it has one
+  const uint8_t *page = dbg->breaks + (addr >> 3 & ~(PAGE_WORDS / 8 - 1));
+  uint8_t any = 0;
+  for (int i = 0; i < PAGE_WORDS / 8; i++)
+    any |= page[i];
+  if (any)
+    prog->pages[addr >> PAGE_BITS] |= PG_BREAK;
+  else
+    prog->pages[addr >> PAGE_BITS] &= ~PG_BREAK;
+
+  return 0;
+}
+
+/* Conditions are comparisons of registers (R0-R7, PC, PSR), words of
+ * memory (mem[x4000], mem[R1], mem[LABEL]) and values (labels, x4000,
+ * #10, #-1), joined by and (or &&) and or (||), with and binding tighter,
+ * and parenthesized. Values are compared as signed. Labels are looked up
+ * as the condition's compiled, not as it's tested. */
+typedef struct cond_parser
+{
+  program *prog;
+  const char *s;   /* what's left */
+  const char *tok; /* the current token... */
+  size_t len;      /* ...and its length (0 at the end) */
+  uint16_t *code;
+  uint32_t n;
+  const char *err;
+} cond_parser;
+
+static void
+next_token (cond_parser *p)
+{
+  const char *s = p->s;
+  while (isspace ((unsigned char)*s))
+    s++;
+  p->tok = s;
+  if (*s == '#')
+    s += s[1] == '-' ? 2 : 1;
+  while (isalnum ((unsigned char)*s) || *s == '_')
+    s++;
+  if (s == p->tok && *s)
+    s += strchr ("=!<>", *s) && s[1] == '=' ? 2
+         : (*s == '&' || *s == '|') && s[1] == *s ? 2
+                                                   : 1;
+  p->len = s - p->tok;
+  p->s = s;
+}
+
+/* whether the current token is word, ignoring case (and if so, the next
+ * one's current) */
+static int
+accept (cond_parser *p, const char *word)
+{
+  if (p->len != strlen (word) || strncasecmp (p->tok, word, p->len))
+    return 0;
+  next_token (p);
+  return 1;
+}
+
+static void
+emit (cond_parser *p, uint16_t word)
+{
+  if (p->n == COND_MAX - 1) // room for the COND_END
+    p->err = "the condition's too long";
+  else
+    p->code[p->n++] = word;
+}
+
+static void
+fail (cond_parser *p, const char *what)
+{
+  static char msg[128];
+  if (p->err)
+    return;
+  if (p->len)
+    snprintf (msg, sizeof (msg), "expected %s, not %.*s", what,
+              (int)(p->len < 32 ? p->len : 32), p->tok);
+  else
+    snprintf (msg, sizeof (msg), "expected %s at the end", what);
+  p->err = msg;
+}
+
+/* a register, mem[...] or a value */
+static void
+compile_operand (cond_parser *p)
+{
+  static const char *regs[] = { "R0", "R1", "R2", "R3", "R4", "R5",
+                                "R6", "R7", "PC", "PSR" };
+  static const uint16_t reg_ids[] = { R_R0, R_R1, R_R2, R_R3, R_R4,
+                                      R_R5, R_R6, R_R7, R_PC, R_PSR };
+  for (int i = 0; i < 10; i++)
+    if (accept (p, regs[i]))
+      {
+        emit (p, COND_REG);
+        emit (p, reg_ids[i]);
+        return;
+      }
+
+  if (accept (p, "mem"))
+    {
+      if (!accept (p, "["))
+        {
+          fail (p, "[");
+          return;
+        }
+      compile_operand (p);
+      if (!p->err && !accept (p, "]"))
+        {
+          fail (p, "]");
+          return;
+        }
+      emit (p, COND_MEM);
+      return;
+    }
+
+  char word[64];
+  uint16_t val;
+  if (!p->len || p->len >= sizeof (word)
+      || !(isalnum ((unsigned char)*p->tok) || *p->tok == '_'
+           || *p->tok == '#'))
+    {
+      fail (p, "a register, mem[...] or a value");
+      return;
+    }
+  memcpy (word, p->tok, p->len);
+  word[p->len] = 0;
+  if (word[0] == '#' && word[1] == '-')
+    {
+      char *end;
+      long n = strtol (word + 1, &end, 10);
+      if (*end || n < -32768)
+        {
+          fail (p, "a value");
+          return;
+        }
+      val = n;
+    }
+  else if (lookup_addr (p->prog, word, &val) != 0)
+    {
+      fail (p, "a register, mem[...] or a value");
+      return;
+    }
+  next_token (p);
+  emit (p, COND_CONST);
+  emit (p, val);
+}
+
+static void compile_or (cond_parser *p);
+
+/* a comparison, or a parenthesized condition */
+static void
+compile_term (cond_parser *p)
+{
+  static const char *ops[] = { "==", "=", "!=", "<", "<=", ">", ">=" };
+  static const uint16_t op_codes[] = { COND_EQ, COND_EQ, COND_NE, COND_LT,
+                                       COND_LE, COND_GT, COND_GE };
+  if (accept (p, "("))
+    {
+      compile_or (p);
+      if (!p->err && !accept (p, ")"))
+        fail (p, ")");
+      return;
+    }
+
+  compile_operand (p);
+  if (p->err)
+    return;
+  for (int i = 0; i < 7; i++)
+    if (accept (p, ops[i]))
+      {
+        compile_operand (p);
+        emit (p, op_codes[i]);
+        return;
+      }
+  fail (p, "a comparison");
+}
+
+static void
+compile_and (cond_parser *p)
+{
+  compile_term (p);
+  while (!p->err && (accept (p, "and") || accept (p, "&&")))
+    {
+      compile_term (p);
+      emit (p, COND_AND);
+    }
+}
+
+static void
+compile_or (cond_parser *p)
+{
+  compile_and (p);
+  while (!p->err && (accept (p, "or") || accept (p, "||")))
+    {
+      compile_and (p);
+      emit (p, COND_OR);
+    }
+}
+
+/* compile a condition into code (COND_MAX words); what's wrong with it, or
+ * null */
+static const char *
+compile_cond (program *prog, const char *s, uint16_t *code)
+{
+  cond_parser p = { prog, s, 0, 0, code, 0, 0 };
+  next_token (&p);
+  compile_or (&p);
+  if (!p.err && p.len)
+    fail (&p, "and, or or the end");
+  code[p.n] = COND_END;
+  return p.err;
+}
+
+/* make the breakpoint at addr conditional on cond (or not, if it's null or
+ * empty); what's wrong with the condition, or null */
+const char *
+set_cond (program *prog, uint16_t addr, const char *cond)
+{
+  breakpoint *bp = find_break (prog, addr);
+  if (!bp)
+    return "there's no breakpoint there";
+
+  while (cond && isspace ((unsigned char)*cond))
+    cond++;
+  if (!cond || !*cond)
+    {
+      free (bp->cond);
+      bp->cond = 0;
+      bp->code[0] = COND_END;
+      return 0;
+    }
+
+  uint16_t code[COND_MAX];
+  const char *err = compile_cond (prog, cond, code);
+  if (err)
+    return err;
+  char *copy = strdup (cond);
+  if (!copy)
+    return "out of memory";
+  free (bp->cond);
+  bp->cond = copy;
+  memcpy (bp->code, code, sizeof (code));
+  return 0;
+}
+
+/* flag the pages any watchpoint covers */
+static void
+flag_watched (program *prog)
+{
+  debug *dbg = prog->debug;
+  for (int i = 0; i < PAGES; i++)
+    prog->pages[i] &= ~PG_WATCH;
+  for (uint32_t i = 0; i < dbg->nwatches; i++)
+    for (uint32_t page = dbg->watches[i].first >> PAGE_BITS;
+         page <= (uint32_t)dbg->watches[i].last >> PAGE_BITS; page++)
+      prog->pages[page] |= PG_WATCH;
+}
+
+uint16_t
+set_watch (program *prog, uint16_t first, uint16_t last, int kind)
+{
+  debug *dbg = attach_debug (prog);
+  if (!dbg)
+    {
+      fprintf (stderr, "error: out of memory setting a watchpoint\n");
+      return 1;
+    }
+  if (dbg->nwatches == WATCH_MAX)
+    {
+      fprintf (stderr, "error: no more than %d watchpoints\n", WATCH_MAX);
+      return 1;
+    }
+
+  watchpoint *w = dbg->watches + dbg->nwatches++;
+  w->first = first;
+  w->last = last;
+  w->kind = kind;
+  flag_watched (prog);
+  return 0;
+}
+
+/* drop the watchpoints within first-last */
+uint16_t
+clear_watch (program *prog, uint16_t first, uint16_t last)
+{
+  debug *dbg = prog->debug;
+  if (!dbg)
+    return 0;
+
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < dbg->nwatches; i++)
+    if (dbg->watches[i].first < first || dbg->watches[i].last > last)
+      dbg->watches[kept++] = dbg->watches[i];
+  dbg->nwatches = kept;
+  flag_watched (prog);
+  return 0;
+}
+
+/* an address as a label, x3000, 0x3000, 3000 (hex, as for lc3trace) or
+ * #12288 */
+uint16_t
+lookup_addr (program *prog, const char *s, uint16_t *addr)
+{
+  if (find_label (prog, s, addr) == 0)
+    return 0;
+
+  int base = 16;
+  if (*s == '#')
+    s++, base = 10;
+  else if (*s == 'x' || *s == 'X')
+    s++;
+  else if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    s += 2;
+
+  char *end;
+  long val = strtol (s, &end, base);
+  if (end == s || *end || val < 0 || val >= MEMORY_MAX)
+    return 1;
+
+  *addr = val;
+  return 0;
+}
+
+/* resume the machine (or start it over) with a breakpoint at from passed,
+ * until it's retired steps instructions (if non-zero) or returned depth
+ * times (likewise); returns why it stopped */
+static int
+go (program *prog, uint64_t from, uint64_t steps, uint32_t depth,
+    int restart)
+{
+  debug *dbg = attach_debug (prog);
+  if (!dbg)
+    {
+      fprintf (stderr, "error: out of memory debugging\n");
+      return STOP_ERROR;
+    }
+
+  if (restart)
+    {
+      forget (dbg);
+      start_program (prog);
+      take_mark (prog);
+    }
+  dbg->from = from;
+  dbg->depth = depth;
+  dbg->stop = STOP_NONE;
+  prog->limit = steps ? prog->icount + steps : 0;
+
+  // it stops for checkpoints, and goes on if that's all it stopped for
+  uint16_t rc;
+  mark_due = 0;
+  going = 1;
+  set_marks (mark_ms);
+  while ((rc = resume_program (prog)) == 0 && !dbg->stop && mark_due
+         && !stop_signal && !interrupted)
+    {
+      mark_due = 0;
+      take_mark (prog);
+    }
+  set_marks (0);
+  going = 0;
+  stop_signal = 0; // whatever asked, it stopped anyway
+  int running = prog->mem[MR_MCR] & (1 << 15);
+  if (!dbg->stop)
+    dbg->stop = rc                                      ? STOP_ERROR
+                : steps && prog->icount == prog->limit ? STOP_STEP
+                : running && interrupted               ? STOP_INTERRUPT
+                                                        : STOP_HALT;
+  interrupted = 0;
+  prog->limit = 0;
+  dbg->depth = 0;
+
+  return dbg->stop;
+}
+
+static int
+stopped (program *prog)
+{
+  if (!prog->debug)
+    return 0;
+  switch (prog->debug->stop)
+    {
+    case STOP_BREAK:
+    case STOP_STEP:
+    case STOP_FINISH:
+    case STOP_WATCH:
+    case STOP_START:
+    case STOP_INTERRUPT:
+      return 1;
+    }
+  return 0;
+}
+
+/* start the program from the top, stopped before its first instruction */
+int
+debug_start (program *prog)
+{
+  debug *dbg = attach_debug (prog);
+  if (!dbg)
+    {
+      fprintf (stderr, "error: out of memory debugging\n");
+      return STOP_ERROR;
+    }
+  forget (dbg);
+  start_program (prog);
+  take_mark (prog);
+  return dbg->stop = STOP_START;
+}
+
+/* run from the top, until a breakpoint or it halts */
+int
+debug_run (program *prog)
+{
+  return go (prog, (uint64_t)-1, 0, 0, 1);
+}
+
+/* pick up where it stopped, until another breakpoint or it halts (STOP_NONE
+ * if it isn't stopped somewhere it can be) */
+int
+debug_continue (program *prog)
+{
+  if (!stopped (prog))
+    return STOP_NONE;
+  return go (prog, prog->icount, 0, 0, 0);
+}
+
+/* run n instructions (starting the program if it isn't running), or with
+ * over, n instructions of this subroutine, counting each call as one */
+int
+debug_step (program *prog, uint64_t n, int over)
+{
+  int stop = STOP_STEP;
+  for (; n > 0 && stop == STOP_STEP; n--)
+    {
+      uint16_t word = prog->mem[prog->reg[R_PC]];
+      int call = (word >> 12) == OP_JSR
+                 || ((word >> 12) == OP_TRAP && prog->os
+                     && !native_trap (prog, word & 0xFF));
+      if (!stopped (prog))
+        call = 0; // it starts from the top, wherever PC was
+
+      stop = go (prog, prog->icount, 1, 0, !stopped (prog));
+      if (over && call && stop == STOP_STEP)
+        {
+          // it's in there now: a breakpoint at the entry point counts too
+          stop = go (prog, (uint64_t)-1, 0, 1, 0);
+          if (stop == STOP_FINISH)
+            stop = prog->debug->stop = STOP_STEP;
+        }
+    }
+  return stop;
+}
+
+/* resume until the subroutine it's in returns */
+int
+debug_finish (program *prog)
+{
+  if (!stopped (prog))
+    return STOP_NONE;
+  return go (prog, prog->icount, 0, 1, 0);
+}
+
+/* re-run the machine quietly from a checkpoint until it's retired icount
+ * instructions, noting the breakpoints and watchpoints it passes before
+ * before; non-zero if it couldn't get there */
+static uint16_t
+replay (program *prog, vmimage *mark, uint64_t icount, uint64_t before)
+{
+  static FILE *quiet;
+  debug *dbg = prog->debug;
+  if (load_image (prog, mark) != 0)
+    return 1;
+  for (dbg->nextkey = 0; dbg->nextkey < dbg->nkeys
+                         && dbg->keys[dbg->nextkey].icount <= mark->icount;
+       dbg->nextkey++)
+    ;
+  // a checkpoint's taken between instructions, before devices are seen to
+  for (dbg->nextexpiry = 0;
+       dbg->nextexpiry < dbg->nexpiries
+       && (dbg->expiries[dbg->nextexpiry].icount < mark->icount
+           || (dbg->expiries[dbg->nextexpiry].icount == mark->icount
+               && !dbg->expiries[dbg->nextexpiry].between));
+       dbg->nextexpiry++)
+    ;
+  if (icount == mark->icount)
+    return 0;
+  if (!quiet && !(quiet = fopen ("/dev/null", "w")))
+    {
+      fprintf (stderr, "error: couldn't open /dev/null\n");
+      return 1;
+    }
+
+  // it's been profiled and traced once already
+  profile *prof = prog->prof;
+  trace *tr = prog->trace;
+  prog->prof = 0;
+  prog->trace = 0;
+  set_output (quiet);
+  dbg->replaying = 1;
+  dbg->before = before;
+  dbg->from = (uint64_t)-1;
+  dbg->stop = STOP_NONE;
+  prog->limit = icount;
+
+  uint16_t rc = resume_program (prog);
+
+  prog->limit = 0;
+  dbg->replaying = 0;
+  stop_signal = 0;
+  set_output (0);
+  prog->prof = prof;
+  prog->trace = tr;
+  if (rc == 0 && prog->icount != icount)
+    {
+      fprintf (stderr, "error: the program didn't get as far as it did "
+                       "before\n");
+      return 1;
+    }
+  return rc;
+}
+
+/* the last checkpoint at or before icount */
+static vmimage *
+mark_before (debug *dbg, uint64_t icount)
+{
+  uint32_t m = dbg->nmarks;
+  while (m > 1 && dbg->marks[m - 1]->icount > icount)
+    m--;
+  return dbg->marks[m - 1];
+}
+
+/* go back n instructions, or as far as the history goes */
+int
+debug_reverse_step (program *prog, uint64_t n)
+{
+  debug *dbg = prog->debug;
+  if (!dbg || !dbg->nmarks)
+    return STOP_NONE;
+
+  uint64_t start = dbg->marks[0]->icount;
+  int all = prog->icount - start >= n;
+  uint64_t icount = all ? prog->icount - n : start;
+  if (replay (prog, mark_before (dbg, icount), icount, 0) != 0)
+    return dbg->stop = STOP_ERROR;
+  drop_marks (dbg, icount);
+  return dbg->stop = all ? STOP_STEP : STOP_START;
+}
+
+/* go back to the last breakpoint or watchpoint hit, or as far as the
+ * history goes */
+int
+debug_reverse_continue (program *prog)
+{
+  debug *dbg = prog->debug;
+  if (!dbg || !dbg->nmarks)
+    return STOP_NONE;
+
+  uint64_t now = prog->icount;
+  for (uint32_t m = dbg->nmarks; m > 0; m--)
+    {
+      vmimage *mark = dbg->marks[m - 1];
+      if (mark->icount >= now)
+        continue;
+      uint64_t end = m < dbg->nmarks && dbg->marks[m]->icount < now
+                         ? dbg->marks[m]->icount
+                         : now;
+
+      dbg->seen_stop = STOP_NONE;
+      if (replay (prog, mark, end, now) != 0)
+        return dbg->stop = STOP_ERROR;
+      if (!dbg->seen_stop)
+        continue;
+
+      // back to the last one (which for a watchpoint is just after it)
+      int stop = dbg->seen_stop;
+      uint64_t icount = dbg->seen;
+      if (replay (prog, mark, icount, 0) != 0)
+        return dbg->stop = STOP_ERROR;
+      drop_marks (dbg, icount);
+      return dbg->stop = stop;
+    }
+
+  if (replay (prog, dbg->marks[0], dbg->marks[0]->icount, 0) != 0)
+    return dbg->stop = STOP_ERROR;
+  drop_marks (dbg, dbg->marks[0]->icount);
+  return dbg->stop = STOP_START;
+}
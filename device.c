@@ -0,0 +1,516 @@
+#include "program.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* unix only */
+#include <sys/select.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Devices are attached to a program's bus, each claiming a range of
+ * registers between xFE00 and xFFFF. The pages they're in are flagged
+ * PG_DEVICE, so the interpreter's loads and stores only have to look at
+ * that to know whether to come through device_read/device_write; the rest
+ * of memory is a plain array. The standard set:
+ *
+ *   KBSR xFE00  bit 15: a key is waiting, bit 14: interrupt enable
+ *   KBDR xFE02  the key (reading it clears KBSR's ready bit)
+ *   DSR  xFE04  bit 15: ready for a character (always)
+ *   DDR  xFE06  a character to write (to the buffered output in io.c)
+ *   TMR  xFE08  bit 15: the timer expired (cleared by reading TMR),
+ *               bit 14: interrupt enable
+ *   TMI  xFE0A  timer interval in milliseconds; writing it (re)starts the
+ *               timer, 0 stops it
+ *   PSR  xFFFC  privilege, priority and condition codes
+ *   MCR  xFFFE  bit 15: clock enable (clearing it stops the machine)
+ *
+ * Nothing here is polled per instruction. While an interrupt could be
+ * raised, a host interval timer sets device_signal every TICK_MS, and the
+ * interpreter calls service_devices when it sees it set; so do writes to
+ * device registers, and RTI. A program with nothing to do but wait for an
+ * interrupt (branching to itself) blocks in wait_for_device rather than
+ * spinning.
+ *
+ * Replayed input isn't due at a time but at an instruction count: the
+ * (instrumented) interpreter services devices when it reaches prog->due,
+ * so a replayed key interrupts at the instruction it did when recorded.
+ * Under a debugger, the timer's expiries are logged the same way, and
+ * while it re-runs the past they come from the log rather than the clock.
+ *
+ * Setting stop_signal (and device_signal, so it's noticed), say from a
+ * signal handler, stops the machine at the next instruction boundary. It's
+ * cleared once it's stopped the machine, so a caller that finds it still
+ * set knows the machine stopped for some other reason first. */
+
+#define TICK_MS 10
+
+volatile sig_atomic_t device_signal;
+volatile sig_atomic_t stop_signal;
+
+static int between; /* seeing to devices between instructions, not in one */
+
+static void
+tick (int sig)
+{
+  device_signal = 1;
+}
+
+static uint64_t
+now_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+set_bits (program *prog, uint16_t address, uint16_t bits, int on)
+{
+  if (on)
+    prog->mem[address] |= bits;
+  else
+    prog->mem[address] &= ~bits;
+  prog->pages[address >> PAGE_BITS] |= PG_DIRTY;
+}
+
+/* keyboard */
+
+static void
+latch_key (program *prog)
+{
+  if (!(prog->mem[MR_KBSR] & DS_READY) && key_ready (prog))
+    {
+      set_bits (prog, MR_KBSR, DS_READY, 1);
+      mem_write (prog, MR_KBDR, read_key (prog));
+    }
+}
+
+static uint16_t
+keyboard_read (program *prog, device *dev, uint16_t address)
+{
+  if (address == MR_KBSR)
+    latch_key (prog);
+  else if (address == MR_KBDR && (prog->mem[MR_KBSR] & DS_READY))
+    {
+      set_bits (prog, MR_KBSR, DS_READY, 0);
+      device_signal = 1; // there may be another one waiting
+    }
+  return prog->mem[address];
+}
+
+static void
+keyboard_write (program *prog, device *dev, uint16_t address, uint16_t val)
+{
+  if (address == MR_KBSR) // only the enable bit is writable
+    val = (prog->mem[MR_KBSR] & ~DS_IE) | (val & DS_IE);
+  mem_write (prog, address, val);
+}
+
+static int
+keyboard_poll (program *prog, device *dev)
+{
+  if (!(prog->mem[MR_KBSR] & DS_IE))
+    return 0;
+  latch_key (prog);
+  return (prog->mem[MR_KBSR] & DS_READY) != 0;
+}
+
+static int
+keyboard_wait (program *prog, device *dev, int *fd, uint64_t *deadline)
+{
+  if (!(prog->mem[MR_KBSR] & DS_IE))
+    return DW_NEVER;
+  // replayed input arrives by instruction count: only time passing helps
+  if ((prog->mem[MR_KBSR] & DS_READY) || key_due (prog) != UINT64_MAX
+      || (prog->input && prog->input->from))
+    return DW_NOW;
+  *fd = STDIN_FILENO;
+  return DW_LATER;
+}
+
+/* display: output is buffered, so we're always ready for more */
+
+static uint16_t
+display_read (program *prog, device *dev, uint16_t address)
+{
+  return address == MR_DSR ? DS_READY : prog->mem[address];
+}
+
+static void
+display_write (program *prog, device *dev, uint16_t address, uint16_t val)
+{
+  if (address == MR_DSR)
+    return; // read only
+  mem_write (prog, address, val);
+  put_char (val);
+  flush_output (0);
+}
+
+/* timer */
+
+/* keep an expiry for the debugger to repeat when it re-runs the past */
+static void
+log_expiry (debug *dbg, uint64_t icount)
+{
+  if (dbg->nexpiries == dbg->maxexpiries)
+    {
+      uint32_t max = dbg->maxexpiries ? dbg->maxexpiries * 2 : 64;
+      expiry *e = realloc (dbg->expiries, max * sizeof (expiry));
+      if (!e)
+        {
+          fprintf (stderr, "warning: out of memory logging the timer\n");
+          return;
+        }
+      dbg->expiries = e;
+      dbg->maxexpiries = max;
+    }
+  dbg->expiries[dbg->nexpiries].icount = icount;
+  dbg->expiries[dbg->nexpiries++].between = between;
+  dbg->nextexpiry = dbg->nexpiries;
+}
+
+/* whether the debugger's re-running the past, so the timer expires when
+ * it did rather than by the clock */
+static int
+rerunning (program *prog)
+{
+  debug *dbg = prog->debug;
+  return dbg && (dbg->replaying || dbg->nextexpiry < dbg->nexpiries);
+}
+
+static void
+timer_update (program *prog, device *dev)
+{
+  debug *dbg = prog->debug;
+  if (rerunning (prog))
+    {
+      // one seen between instructions comes after one seen during them
+      expiry *e = dbg->expiries + dbg->nextexpiry;
+      if (dbg->nextexpiry < dbg->nexpiries
+          && (e->icount < prog->icount
+              || (e->icount == prog->icount && (between || !e->between))))
+        {
+          set_bits (prog, MR_TMR, DS_READY, 1);
+          dbg->nextexpiry++;
+        }
+      return;
+    }
+
+  uint64_t interval = prog->mem[MR_TMI] * 1000000ull, now = now_ns ();
+  if (!interval)
+    return;
+  if (!dev->due) // e.g. just restored from a snapshot
+    dev->due = now + interval;
+  if (now < dev->due)
+    return;
+
+  set_bits (prog, MR_TMR, DS_READY, 1);
+  if (dbg)
+    log_expiry (dbg, prog->icount);
+  dev->due += interval;
+  if (dev->due <= now) // fell behind; don't try to catch up
+    dev->due = now + interval;
+}
+
+static uint16_t
+timer_read (program *prog, device *dev, uint16_t address)
+{
+  if (address != MR_TMR)
+    return prog->mem[address];
+
+  timer_update (prog, dev);
+  uint16_t val = prog->mem[MR_TMR];
+  set_bits (prog, MR_TMR, DS_READY, 0);
+  return val;
+}
+
+static void
+timer_write (program *prog, device *dev, uint16_t address, uint16_t val)
+{
+  if (address == MR_TMR) // only the enable bit is writable
+    val = (prog->mem[MR_TMR] & ~DS_IE) | (val & DS_IE);
+  else if (address == MR_TMI)
+    dev->due = now_ns () + val * 1000000ull;
+  mem_write (prog, address, val);
+}
+
+static int
+timer_poll (program *prog, device *dev)
+{
+  timer_update (prog, dev);
+  return (prog->mem[MR_TMR] & (DS_READY | DS_IE)) == (DS_READY | DS_IE);
+}
+
+static int
+timer_wait (program *prog, device *dev, int *fd, uint64_t *deadline)
+{
+  if (!(prog->mem[MR_TMR] & DS_IE))
+    return DW_NEVER;
+  if (prog->mem[MR_TMR] & DS_READY)
+    return DW_NOW;
+  if (rerunning (prog)) // they're due by instruction count, not time
+    return prog->debug->nextexpiry < prog->debug->nexpiries ? DW_NOW
+                                                            : DW_NEVER;
+  if (!prog->mem[MR_TMI])
+    return DW_NEVER;
+  timer_update (prog, dev);
+  *deadline = dev->due;
+  return DW_LATER;
+}
+
+/* processor status */
+
+static uint16_t
+psr_read (program *prog, device *dev, uint16_t address)
+{
+  return prog->reg[R_PSR] | prog->reg[R_COND];
+}
+
+static void
+psr_write (program *prog, device *dev, uint16_t address, uint16_t val)
+{
+  if (prog->reg[R_PSR] & PSR_USER)
+    return; // supervisor only
+  prog->reg[R_PSR] = val & (PSR_USER | PSR_PRIORITY);
+  prog->reg[R_COND] = (val & 0x7) ? (val & 0x7) : FL_ZRO;
+}
+
+static const device standard_devices[] = {
+  { "keyboard", MR_KBSR, MR_KBDR, INT_KEYBOARD, PL_DEVICE, keyboard_read,
+    keyboard_write, keyboard_poll, keyboard_wait, 0 },
+  { "display", MR_DSR, MR_DDR, 0, 0, display_read, display_write, 0, 0, 0 },
+  { "timer", MR_TMR, MR_TMI, INT_TIMER, PL_DEVICE, timer_read, timer_write,
+    timer_poll, timer_wait, 0 },
+  { "psr", MR_PSR, MR_PSR, 0, 0, psr_read, psr_write, 0, 0, 0 },
+  { "mcr", MR_MCR, MR_MCR, 0, 0, 0, 0, 0, 0, 0 },
+};
+
+static uint16_t
+open_bus (program *prog)
+{
+  if (prog->bus)
+    return 0;
+  if (!(prog->bus = calloc (1, sizeof (bus))))
+    {
+      fprintf (stderr, "error: out of memory attaching devices\n");
+      return 1;
+    }
+  for (size_t i = 0; i < sizeof (standard_devices) / sizeof (device); i++)
+    if (attach_device (prog, standard_devices + i) != 0)
+      return 1;
+  return 0;
+}
+
+uint16_t
+attach_device (program *prog, const device *dev)
+{
+  if (open_bus (prog) != 0)
+    return 1;
+
+  bus *b = prog->bus;
+  if (dev->first < MR_DEVICES || dev->last < dev->first)
+    {
+      fprintf (stderr, "error: device %s isn't in xFE00-xFFFF\n", dev->name);
+      return 1;
+    }
+  for (uint32_t a = dev->first; a <= dev->last; a++)
+    if (b->at[a - MR_DEVICES])
+      {
+        fprintf (stderr, "error: device %s overlaps %s at x%04X\n", dev->name,
+                 b->devices[b->at[a - MR_DEVICES] - 1].name, a);
+        return 1;
+      }
+  if (b->ndevices == BUS_MAX)
+    {
+      fprintf (stderr, "error: no room on the bus for device %s\n",
+               dev->name);
+      return 1;
+    }
+
+  b->devices[b->ndevices++] = *dev;
+  for (uint32_t a = dev->first; a <= dev->last; a++)
+    {
+      b->at[a - MR_DEVICES] = b->ndevices;
+      prog->pages[a >> PAGE_BITS] |= PG_DEVICE;
+    }
+  return 0;
+}
+
+void
+free_devices (program *prog)
+{
+  free (prog->bus);
+  prog->bus = 0;
+  for (int i = MR_DEVICES >> PAGE_BITS; i < PAGES; i++)
+    prog->pages[i] &= ~PG_DEVICE;
+}
+
+static device *
+device_at (program *prog, uint16_t address)
+{
+  uint8_t i = prog->bus->at[address - MR_DEVICES];
+  return i ? prog->bus->devices + i - 1 : 0;
+}
+
+uint16_t
+device_read (program *prog, uint16_t address)
+{
+  device *dev = device_at (prog, address);
+  if (dev && dev->read)
+    return dev->read (prog, dev, address);
+  return prog->mem[address];
+}
+
+/* tick while any device could interrupt */
+static void
+set_ticks (program *prog)
+{
+  static int ticking;
+  int want = 0, fd;
+  uint64_t deadline;
+  for (uint32_t i = 0; i < prog->bus->ndevices && !want; i++)
+    {
+      device *dev = prog->bus->devices + i;
+      want = dev->wait && dev->wait (prog, dev, &fd, &deadline) != DW_NEVER;
+    }
+  if (want == ticking)
+    return;
+
+  if (want)
+    {
+      struct sigaction sa;
+      memset (&sa, 0, sizeof (sa));
+      sa.sa_handler = tick;
+      sa.sa_flags = SA_RESTART; // don't break reads in GETC and friends
+      sigaction (SIGALRM, &sa, 0);
+    }
+  struct itimerval it;
+  memset (&it, 0, sizeof (it));
+  it.it_interval.tv_usec = it.it_value.tv_usec = want ? TICK_MS * 1000 : 0;
+  setitimer (ITIMER_REAL, &it, 0);
+  ticking = want;
+}
+
+void
+device_write (program *prog, uint16_t address, uint16_t val)
+{
+  device *dev = device_at (prog, address);
+  if (dev && dev->write)
+    dev->write (prog, dev, address, val);
+  else
+    mem_write (prog, address, val);
+
+  set_ticks (prog);
+  device_signal = 1;
+}
+
+/* note when the next replayed event is due */
+static void
+schedule (program *prog)
+{
+  debug *dbg = prog->debug;
+  prog->due = key_due (prog);
+  if (dbg && dbg->nextexpiry < dbg->nexpiries
+      && dbg->expiries[dbg->nextexpiry].icount < prog->due)
+    prog->due = dbg->expiries[dbg->nextexpiry].icount;
+}
+
+/* attach the standard devices if need be, and pick up their state from
+ * memory (e.g. after a snapshot was restored) */
+uint16_t
+start_devices (program *prog)
+{
+  if (open_bus (prog) != 0)
+    return 1;
+  set_bits (prog, MR_MCR, 1 << 15, 1); // clock on
+  between = 1;
+  set_ticks (prog);
+  between = 0;
+  schedule (prog);
+  device_signal = 1;
+  return 0;
+}
+
+/* non-zero if the machine should stop */
+uint16_t
+service_devices (program *prog)
+{
+  device_signal = 0;
+  if (!(prog->mem[MR_MCR] & (1 << 15))) // (leaving any stop_signal be)
+    return 1;
+  if (stop_signal)
+    {
+      stop_signal = 0;
+      return 1;
+    }
+
+  uint16_t priority = (prog->reg[R_PSR] & PSR_PRIORITY) >> 8;
+  device *irq = 0;
+  between = 1;
+  for (uint32_t i = 0; i < prog->bus->ndevices; i++)
+    {
+      device *dev = prog->bus->devices + i;
+      if (dev->poll && dev->poll (prog, dev) && dev->priority > priority
+          && (!irq || dev->priority > irq->priority))
+        irq = dev;
+    }
+  between = 0;
+  if (irq)
+    enter_handler (prog, irq->vector, irq->priority);
+  schedule (prog);
+  return 0;
+}
+
+/* the program is spinning until an interrupt comes along: block until one
+ * could have, if one can */
+void
+wait_for_device (program *prog)
+{
+  uint16_t priority = (prog->reg[R_PSR] & PSR_PRIORITY) >> 8;
+  uint64_t until = 0;
+  int nfds = 0, waiting = 0;
+  fd_set readfds;
+  FD_ZERO (&readfds);
+
+  for (uint32_t i = 0; i < prog->bus->ndevices; i++)
+    {
+      device *dev = prog->bus->devices + i;
+      int fd = -1;
+      uint64_t deadline = 0;
+      if (!dev->wait || dev->priority <= priority)
+        continue;
+
+      switch (dev->wait (prog, dev, &fd, &deadline))
+        {
+        case DW_NOW:
+          device_signal = 1;
+          return;
+        case DW_LATER:
+          waiting = 1;
+          if (fd >= 0)
+            {
+              FD_SET (fd, &readfds);
+              if (fd >= nfds)
+                nfds = fd + 1;
+            }
+          if (deadline && (!until || deadline < until))
+            until = deadline;
+          break;
+        }
+    }
+  if (!waiting)
+    return; // nothing's coming; spin
+
+  flush_output (1);
+  struct timeval timeout, *tv = 0;
+  if (until)
+    {
+      uint64_t now = now_ns (), wait = until > now ? until - now : 0;
+      timeout.tv_sec = wait / 1000000000;
+      timeout.tv_usec = wait % 1000000000 / 1000;
+      tv = &timeout;
+    }
+  select (nfds, &readfds, NULL, NULL, tv);
+  device_signal = 1;
+}
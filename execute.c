@@ -3,90 +3,296 @@
 #include <stdint.h>
 #include <stdio.h>
 /* unix only */
-#include <stdlib.h>
-#include <sys/time.h>
-#include <sys/types.h>
+#include <errno.h>
+#include <sys/select.h>
 #include <unistd.h>
 
-static uint16_t
-check_key ()
+/* a load or store that a watchpoint covers stops the machine once the
+ * instruction's done (it asks to be stopped as a signal handler would) */
+static void
+watch (program *prog, uint16_t address, int kind, uint16_t val)
 {
-  fd_set readfds;
-  FD_ZERO (&readfds);
-  FD_SET (STDIN_FILENO, &readfds);
+  debug *dbg = prog->debug;
+  if (!dbg || dbg->stop == STOP_WATCH) // the first one it hit, it stops on
+    return;
+  for (uint32_t i = 0; i < dbg->nwatches; i++)
+    {
+      watchpoint *w = dbg->watches + i;
+      if (address < w->first || address > w->last || !(w->kind & kind))
+        continue;
 
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 0;
-  return select (1, &readfds, NULL, NULL, &timeout) != 0;
+      dbg->hit.addr = address;
+      dbg->hit.old = prog->mem[address];
+      dbg->hit.val = val;
+      dbg->hit.kind = kind;
+      if (dbg->replaying) // (instrumented, so icount is up to date)
+        {
+          if (prog->icount < dbg->before)
+            {
+              dbg->seen = prog->icount;
+              dbg->seen_stop = STOP_WATCH;
+            }
+          return;
+        }
+      dbg->stop = STOP_WATCH;
+      stop_signal = 1;
+      device_signal = 1;
+      return;
+    }
 }
 
-static void
-update_flags (uint16_t reg[], uint16_t r)
+/* loads and stores only look further on pages with devices or watched
+ * words in them; devices see the instruction count as of this one (even
+ * uninstrumented, so a debugger can log input against it) */
+static inline uint16_t
+mem_read (program *prog, uint16_t address, uint64_t icount)
 {
-  if (reg[r] == 0)
-    {
-      reg[R_COND] = FL_ZRO;
-    }
-  else if (reg[r] >> 15) /* a 1 in the left-most bit indicates negative */
+  uint8_t flags = prog->pages[address >> PAGE_BITS];
+  if (!(flags & (PG_DEVICE | PG_WATCH)))
+    return prog->mem[address];
+
+  if (flags & PG_DEVICE)
+    prog->icount = icount;
+  uint16_t val = (flags & PG_DEVICE) ? device_read (prog, address)
+                                     : prog->mem[address];
+  if (flags & PG_WATCH)
+    watch (prog, address, WATCH_READ, val);
+  return val;
+}
+
+static inline void
+mem_store (program *prog, uint16_t address, uint16_t val, uint64_t icount)
+{
+  uint8_t flags = prog->pages[address >> PAGE_BITS];
+  if (flags & PG_WATCH)
+    watch (prog, address, WATCH_WRITE, val);
+  if (flags & PG_DEVICE)
     {
-      reg[R_COND] = FL_NEG;
+      prog->icount = icount;
+      device_write (prog, address, val);
     }
   else
+    mem_write (prog, address, val);
+}
+
+/* save PSR and PC on the supervisor stack (switching to it if need be), and
+ * go to the handler for vector at the given priority; non-zero if there
+ * isn't one */
+uint16_t
+enter_handler (program *prog, uint16_t vector, uint16_t priority)
+{
+  uint16_t *reg = prog->reg;
+  uint16_t handler = prog->mem[IVT_BASE + vector];
+  if (!handler)
+    return 1;
+
+  if (reg[R_PSR] & PSR_USER)
     {
-      reg[R_COND] = FL_POS;
+      reg[R_SAVED_USP] = reg[R_R6];
+      reg[R_R6] = reg[R_SAVED_SSP];
     }
+  mem_write (prog, --reg[R_R6], reg[R_PSR] | reg[R_COND]);
+  mem_write (prog, --reg[R_R6], reg[R_PC]);
+  reg[R_PSR] = priority << 8;
+  reg[R_PC] = handler;
+  return 0;
 }
 
-static void
-mem_write (uint16_t memory[], uint16_t address, uint16_t val)
+/* whether a breakpoint's compiled condition holds (see debug.c) */
+static int
+test_cond (program *prog, const uint16_t *code)
 {
-  memory[address] = val;
+  int32_t stack[COND_MAX], *sp = stack;
+  for (;;)
+    switch (*code++)
+      {
+      case COND_END:
+        return sp == stack || sp[-1];
+      case COND_CONST:
+        *sp++ = (int16_t)*code++;
+        break;
+      case COND_REG:
+        *sp++ = (int16_t)(*code == R_PSR
+                              ? prog->reg[R_PSR] | prog->reg[R_COND]
+                              : prog->reg[*code]);
+        code++;
+        break;
+      case COND_MEM:
+        sp[-1] = (int16_t)prog->mem[(uint16_t)sp[-1]];
+        break;
+      case COND_EQ:
+        sp--, sp[-1] = sp[-1] == sp[0];
+        break;
+      case COND_NE:
+        sp--, sp[-1] = sp[-1] != sp[0];
+        break;
+      case COND_LT:
+        sp--, sp[-1] = sp[-1] < sp[0];
+        break;
+      case COND_LE:
+        sp--, sp[-1] = sp[-1] <= sp[0];
+        break;
+      case COND_GT:
+        sp--, sp[-1] = sp[-1] > sp[0];
+        break;
+      case COND_GE:
+        sp--, sp[-1] = sp[-1] >= sp[0];
+        break;
+      case COND_AND:
+        sp--, sp[-1] = sp[-1] && sp[0];
+        break;
+      case COND_OR:
+        sp--, sp[-1] = sp[-1] || sp[0];
+        break;
+      }
 }
 
-static uint16_t
-mem_read (uint16_t memory[], uint16_t address)
+/* a breakpoint at pc stops the machine before the instruction there runs,
+ * unless that's where it was resumed, its condition doesn't hold, or it's
+ * ignoring this hit */
+static inline int
+at_break (program *prog, uint16_t pc, uint64_t icount)
 {
-  if (address == MR_KBSR)
+  debug *dbg = prog->debug;
+  if (!dbg || !(dbg->breaks[pc >> 3] & (1 << (pc & 7))) || icount == dbg->from)
+    return 0;
+  breakpoint *bp = dbg->bps; // it's in there, with the bit set
+  while (bp->addr != pc)
+    bp++;
+  if (bp->code[0] != COND_END && !test_cond (prog, bp->code))
+    return 0;
+  if (dbg->replaying)
     {
-      if (check_key ())
-        {
-          memory[MR_KBSR] = (1 << 15);
-          memory[MR_KBDR] = getchar ();
-        }
-      else
+      if (icount < dbg->before)
         {
-          memory[MR_KBSR] = 0;
+          dbg->seen = icount;
+          dbg->seen_stop = STOP_BREAK;
         }
+      return 0;
+    }
+  bp->hits++;
+  if (bp->ignore)
+    {
+      bp->ignore--;
+      return 0;
     }
-  return memory[address];
+  dbg->stop = STOP_BREAK;
+  return 1;
 }
 
-uint16_t
-execute_program (program *prog)
+/* fill in a trace record for an instruction that has just retired */
+static inline void
+trace_step (trace_record *r, uint16_t reg[], uint16_t pc, uint16_t word,
+            uint16_t waddr)
+{
+  r->pc = pc;
+  r->word = word;
+  switch (word >> 12)
+    {
+    case OP_ST:
+    case OP_STI:
+    case OP_STR:
+      r->addr = waddr;
+      // SR, as stored: a device register's backing word may not hold it
+      r->value = reg[(word >> 9) & 0x7];
+      break;
+    case OP_BR:
+    case OP_JMP:
+      r->addr = R_PC;
+      r->value = reg[R_PC];
+      break;
+    case OP_JSR:
+      r->addr = R_R7;
+      r->value = reg[R_R7];
+      break;
+    case OP_TRAP: // GETC/IN read into R0; everything else leaves it be
+      r->addr = R_R0;
+      r->value = reg[R_R0];
+      break;
+    default: // everything else writes DR
+      r->addr = (word >> 9) & 0x7;
+      r->value = reg[r->addr];
+    }
+}
+
+/* whether a native GETC or IN can go ahead: under a debugger, one that
+ * would block on the terminal waits here instead, where a signal that asks
+ * the machine to stop (^C) can; zero if one did */
+static int
+await_key (program *prog, uint16_t vector)
+{
+  if ((vector != TRAP_GETC && vector != TRAP_IN) || key_ready (prog)
+      || !isatty (STDIN_FILENO))
+    return 1;
+
+  flush_output (1); // whatever prompted for it
+  fd_set readfds;
+  do
+    {
+      if (stop_signal)
+        return 0;
+      FD_ZERO (&readfds);
+      FD_SET (STDIN_FILENO, &readfds);
+    }
+  while (select (1, &readfds, NULL, NULL, NULL) < 0 && errno == EINTR);
+  return 1;
+}
+
+/* the interpreter loop is instantiated twice: once with every hook compiled
+ * out, and once "instrumented" for profiling and friends */
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__ ((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+static ALWAYS_INLINE uint16_t
+run (program *prog, const int instrumented)
 {
   // for convenience (may refactor later)
   uint16_t *memory = prog->mem;
   uint16_t *reg = prog->reg;
-
-  /* since exactly one condition flag should be set at any given time, set the
-   * Z flag */
-  reg[R_COND] = FL_ZRO;
-
-  /* set the PC to starting position */
-  /* 0x3000 is the default */
-  enum
-  {
-    PC_START = 0x3000
-  };
-  reg[R_PC] = PC_START;
+  profile *prof = instrumented ? prog->prof : 0;
+  trace *tr = instrumented ? prog->trace : 0;
+  debug *dbg = instrumented ? prog->debug : 0;
+  uint64_t icount = prog->icount;
+  uint16_t rc = 0;
 
   int running = 1;
   while (running)
     {
-      /* FETCH */
-      uint16_t word = mem_read (memory, reg[R_PC]++);
+      // interrupts are taken between instructions (and replayed ones at
+      // the very instruction they were)
+      if (device_signal || (instrumented && icount == prog->due))
+        {
+          prog->icount = icount;
+          if (service_devices (prog) != 0)
+            break;
+        }
+
+      /* FETCH: pages with breakpoints share the device test, so a run
+       * only pays for them on the pages they're in */
+      uint16_t pc = reg[R_PC]++, word;
+      uint8_t flags = prog->pages[pc >> PAGE_BITS];
+      if (flags & (PG_DEVICE | PG_BREAK))
+        {
+          if ((flags & PG_BREAK) && at_break (prog, pc, icount))
+            {
+              reg[R_PC] = pc;
+              break;
+            }
+          word = (flags & PG_DEVICE) ? device_read (prog, pc) : memory[pc];
+        }
+      else
+        word = memory[pc];
+      if (prof)
+        prof->exec[pc]++;
+
       uint16_t op = word >> 12;
+      uint16_t waddr = 0; /* memory address written, if any */
+      icount++;
+      if (instrumented) // hooks see the count as of this instruction
+        prog->icount = icount;
 
       switch (op)
         {
@@ -147,7 +353,14 @@ execute_program (program *prog)
             uint16_t cond_flag = (word >> 9) & 0x7;
             if (cond_flag & reg[R_COND])
               {
+                if (prof)
+                  prof->taken[reg[R_PC] - 1]++;
                 reg[R_PC] += pc_offset;
+                if (pc_offset == 0xFFFF) // waiting for an interrupt?
+                  {
+                    prog->icount = icount; // for a timer it sees expire
+                    wait_for_device (prog);
+                  }
               }
           }
           break;
@@ -156,6 +369,13 @@ execute_program (program *prog)
             /* Also handles RET */
             uint16_t r1 = (word >> 6) & 0x7;
             reg[R_PC] = reg[r1];
+            if (prof && r1 == R_R7)
+              profile_return (prof, icount);
+            if (dbg && dbg->depth && r1 == R_R7 && --dbg->depth == 0)
+              {
+                dbg->stop = STOP_FINISH;
+                running = 0;
+              }
           }
           break;
         case OP_JSR:
@@ -172,13 +392,32 @@ execute_program (program *prog)
                 uint16_t r1 = (word >> 6) & 0x7;
                 reg[R_PC] = reg[r1]; /* JSRR */
               }
+            if (prof)
+              {
+                prof->calls[reg[R_PC]]++;
+                profile_call (prof, reg[R_PC], icount);
+              }
+            if (dbg && dbg->depth)
+              dbg->depth++;
+            /* unless we have to stop somewhere inside it, or something
+             * (a trace, a profile, a debugger) wants to see inside it */
+            if (prog->natives && !prog->debug
+                && !(instrumented && (prog->limit || prof || tr)))
+              {
+                uint64_t n = call_intrinsic (prog);
+                icount += n;
+                if (n && prof)
+                  profile_return (prof, icount);
+                if (n && dbg && dbg->depth)
+                  dbg->depth--;
+              }
           }
           break;
         case OP_LD:
           {
             uint16_t r0 = (word >> 9) & 0x7;
             uint16_t pc_offset = SIGN_EXTEND (word & 0x1FF, 9);
-            reg[r0] = mem_read (memory, reg[R_PC] + pc_offset);
+            reg[r0] = mem_read (prog, reg[R_PC] + pc_offset, icount);
             update_flags (reg, r0);
           }
           break;
@@ -190,8 +429,8 @@ execute_program (program *prog)
             uint16_t pc_offset = SIGN_EXTEND (word & 0x1FF, 9);
             /* add pc_offset to the current PC, look at that memory location to
              * get the final address */
-            reg[r0]
-                = mem_read (memory, mem_read (memory, reg[R_PC] + pc_offset));
+            uint16_t ptr = mem_read (prog, reg[R_PC] + pc_offset, icount);
+            reg[r0] = mem_read (prog, ptr, icount);
             update_flags (reg, r0);
           }
           break;
@@ -200,7 +439,7 @@ execute_program (program *prog)
             uint16_t r0 = (word >> 9) & 0x7;
             uint16_t r1 = (word >> 6) & 0x7;
             uint16_t offset = SIGN_EXTEND (word & 0x3F, 6);
-            reg[r0] = mem_read (memory, reg[r1] + offset);
+            reg[r0] = mem_read (prog, reg[r1] + offset, icount);
             update_flags (reg, r0);
           }
           break;
@@ -216,15 +455,16 @@ execute_program (program *prog)
           {
             uint16_t r0 = (word >> 9) & 0x7;
             uint16_t pc_offset = SIGN_EXTEND (word & 0x1FF, 9);
-            mem_write (memory, reg[R_PC] + pc_offset, reg[r0]);
+            waddr = reg[R_PC] + pc_offset;
+            mem_store (prog, waddr, reg[r0], icount);
           }
           break;
         case OP_STI:
           {
             uint16_t r0 = (word >> 9) & 0x7;
             uint16_t pc_offset = SIGN_EXTEND (word & 0x1FF, 9);
-            mem_write (memory, mem_read (memory, reg[R_PC] + pc_offset),
-                       reg[r0]);
+            waddr = mem_read (prog, reg[R_PC] + pc_offset, icount);
+            mem_store (prog, waddr, reg[r0], icount);
           }
           break;
         case OP_STR:
@@ -232,77 +472,153 @@ execute_program (program *prog)
             uint16_t r0 = (word >> 9) & 0x7;
             uint16_t r1 = (word >> 6) & 0x7;
             uint16_t offset = SIGN_EXTEND (word & 0x3F, 6);
-            mem_write (memory, reg[r1] + offset, reg[r0]);
+            waddr = reg[r1] + offset;
+            mem_store (prog, waddr, reg[r0], icount);
           }
           break;
         case OP_TRAP:
+          if (prog->debug && !await_key (prog, word & 0xFF))
+            {
+              // stopped waiting: it'll run when the machine resumes
+              reg[R_PC] = pc;
+              prog->icount = --icount;
+              if (prof)
+                prof->exec[pc]--;
+              continue;
+            }
           reg[R_R7] = reg[R_PC];
-
-          switch (word & 0xFF)
+          if (prog->os && !native_trap (prog, word & 0xFF))
             {
-            case TRAP_GETC:
-              /* read a single ASCII char */
-              reg[R_R0] = (uint16_t)getchar ();
-              update_flags (reg, R_R0);
-              break;
-            case TRAP_OUT:
-              putc ((char)reg[R_R0], stdout);
-              fflush (stdout);
-              break;
-            case TRAP_PUTS:
-              {
-                /* one char per word */
-                uint16_t *c = memory + reg[R_R0];
-                while (*c)
-                  {
-                    putc ((char)*c, stdout);
-                    ++c;
-                  }
-                fflush (stdout);
-              }
-              break;
-            case TRAP_IN:
-              {
-                printf ("Enter a character: ");
-                char c = getchar ();
-                putc (c, stdout);
-                fflush (stdout);
-                reg[R_R0] = (uint16_t)c;
-                update_flags (reg, R_R0);
-              }
-              break;
-            case TRAP_PUTSP:
-              {
-                /* one char per byte (two bytes per word)
-                   here we need to swap back to
-                   big endian format */
-                uint16_t *c = memory + reg[R_R0];
-                while (*c)
-                  {
-                    char char1 = (*c) & 0xFF;
-                    putc (char1, stdout);
-                    char char2 = (*c) >> 8;
-                    if (char2)
-                      putc (char2, stdout);
-                    ++c;
-                  }
-                fflush (stdout);
-              }
-              break;
-            case TRAP_HALT:
-              // puts("HALT");
-              // fflush(stdout);
-              running = 0;
+              reg[R_PC] = memory[word & 0xFF]; // through the vector table
+              if (prof)
+                {
+                  prof->calls[reg[R_PC]]++;
+                  profile_call (prof, reg[R_PC], icount);
+                }
+              if (dbg && dbg->depth)
+                dbg->depth++;
+            }
+          else
+            {
+              prog->icount = icount; // for any input it reads
+              if (execute_trap (prog, word & 0xFF) != 0)
+                {
+                  // the clock stops, as the OS's HALT leaves it (so a
+                  // snapshot shows the machine halted)
+                  prog->mem[MR_MCR] &= ~(1 << 15);
+                  mark_dirty (prog, MR_MCR, 1);
+                  running = 0;
+                }
+            }
+          break;
+        case OP_RTI:
+          if (!(reg[R_PSR] & PSR_USER))
+            {
+              reg[R_PC] = mem_read (prog, reg[R_R6]++, icount);
+              uint16_t psr = mem_read (prog, reg[R_R6]++, icount);
+              reg[R_PSR] = psr & (PSR_USER | PSR_PRIORITY);
+              reg[R_COND] = (psr & 0x7) ? (psr & 0x7) : FL_ZRO;
+              if (reg[R_PSR] & PSR_USER)
+                {
+                  reg[R_SAVED_SSP] = reg[R_R6];
+                  reg[R_R6] = reg[R_SAVED_USP];
+                }
+              device_signal = 1; // something may have been held off
               break;
             }
+          if (enter_handler (prog, EX_PRIVILEGE, reg[R_PSR] >> 8 & 0x7) == 0)
+            break;
+          rc = -1;
+          running = 0;
           break;
         case OP_RES:
-        case OP_RTI:
         default:
-          return -1;
+          if (enter_handler (prog, EX_ILLEGAL, reg[R_PSR] >> 8 & 0x7) == 0)
+            break;
+          rc = -1;
+          running = 0;
           break;
         }
+
+      if (tr)
+        {
+          if (tr->cur == tr->end)
+            next_trace_chunk (tr);
+          trace_step (tr->cur++, reg, pc, word, waddr);
+        }
+
+      if (instrumented && icount == prog->limit)
+        running = 0;
     }
 
-  return 0;
+  prog->icount = icount;
+  flush_output (1);
+  if (prof)
+    profile_return (prof, icount);
+
+  return rc;
+}
+
+uint16_t
+execute_program (program *prog)
+{
+  start_program (prog);
+  return resume_program (prog);
+}
+
+/* where a run starts: where it was asked to, or else the origin of the
+ * first program loaded (not an OS image) */
+uint16_t
+entry_point (program *prog)
+{
+  if (prog->entry)
+    return prog->entry - 1;
+  for (uint32_t s = 0; s < prog->nsegs; s++)
+    if (!(prog->segs[s].flags & SEG_OS))
+      return prog->segs[s].orig;
+
+  /* loaded some other way (e.g. lc3d's jobs), or not at all */
+  enum
+  {
+    PC_START = 0x3000
+  };
+  return prog->len ? prog->orig : PC_START;
+}
+
+/* put the machine where a run starts */
+void
+start_program (program *prog)
+{
+  uint16_t *reg = prog->reg;
+
+  /* since exactly one condition flag should be set at any given time, set the
+   * Z flag */
+  reg[R_COND] = FL_ZRO;
+
+  reg[R_PC] = entry_point (prog);
+  reg[R_PSR] = PSR_USER;
+  reg[R_SAVED_SSP] = SSP_START;
+  prog->icount = 0;
+
+  if (prog->prof)
+    prog->prof->cur = 0;
+}
+
+/* pick up from wherever the machine is (e.g. a restored snapshot) */
+uint16_t
+resume_program (program *prog)
+{
+  if (prog->prof && !prog->prof->cur)
+    {
+      // each run starts a fresh stack under the synthetic root
+      prog->prof->mark = prog->icount;
+      profile_call (prog->prof, prog->reg[R_PC], prog->icount);
+    }
+
+  if (start_devices (prog) != 0)
+    return 1;
+  int instrumented = prog->prof || prog->trace || prog->input || prog->limit
+                     || prog->due != UINT64_MAX
+                     || (prog->debug && prog->debug->depth);
+  return instrumented ? run (prog, 1) : run (prog, 0);
 }
@@ -0,0 +1,150 @@
+#include "program.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Forking a machine means capturing its state into an image whose pages are
+ * reference counted, so any number of children can share them. A child is
+ * just another reference to the same pages (a couple of KiB); running one
+ * means loading it into a program, which copies only the pages that differ
+ * from what that program last held. Pages the child then writes are flagged
+ * dirty, and become new pages when it's captured in turn: copy on write at
+ * page granularity, with the interpreter still running out of a flat mem[].
+ *
+ * The same tracking makes a pristine image a cheap way to start over: a
+ * batch runner resets its machine between runs by copying back just the
+ * pages the last run wrote, rather than clearing all of it.
+ *
+ * Reference counts aren't atomic: an image and its clones belong to one
+ * thread. */
+
+static void
+release (vmpage *page)
+{
+  if (page && --page->refs == 0)
+    free (page);
+}
+
+static int
+page_used (const uint16_t *words)
+{
+  for (int i = 0; i < PAGE_WORDS; i++)
+    if (words[i])
+      return 1;
+  return 0;
+}
+
+vmimage *
+clone_image (vmimage *img)
+{
+  vmimage *clone = malloc (sizeof (vmimage));
+  if (!clone)
+    return 0;
+
+  memcpy (clone, img, sizeof (vmimage));
+  for (int i = 0; i < PAGES; i++)
+    if (clone->page[i])
+      clone->page[i]->refs++;
+
+  return clone;
+}
+
+void
+free_image (vmimage *img)
+{
+  if (!img)
+    return;
+  for (int i = 0; i < PAGES; i++)
+    release (img->page[i]);
+  free (img);
+}
+
+vmimage *
+capture_image (program *prog)
+{
+  vmimage *img = calloc (1, sizeof (vmimage));
+  if (!img)
+    return 0;
+
+  for (int i = 0; i < PAGES; i++)
+    {
+      const uint16_t *words = prog->mem + (i << PAGE_BITS);
+
+      // untouched since the last capture/load: share what we had
+      if (prog->image && !(prog->pages[i] & PG_DIRTY))
+        {
+          if ((img->page[i] = prog->image->page[i]))
+            img->page[i]->refs++;
+          continue;
+        }
+
+      if (!page_used (words))
+        continue;
+      if (!(img->page[i] = malloc (sizeof (vmpage))))
+        {
+          free_image (img);
+          return 0;
+        }
+      img->page[i]->refs = 1;
+      memcpy (img->page[i]->words, words, sizeof (img->page[i]->words));
+    }
+  memcpy (img->reg, prog->reg, sizeof (img->reg));
+  img->icount = prog->icount;
+
+  // from here on, writes are tracked against the new image
+  vmimage *held = clone_image (img);
+  if (!held)
+    {
+      free_image (img);
+      return 0;
+    }
+  free_image (prog->image);
+  prog->image = held;
+  for (int i = 0; i < PAGES; i++)
+    prog->pages[i] &= ~PG_DIRTY;
+
+  return img;
+}
+
+uint16_t
+load_image (program *prog, vmimage *img)
+{
+  vmimage *held = clone_image (img);
+  if (!held)
+    {
+      fprintf (stderr, "error: out of memory loading image\n");
+      return 1;
+    }
+
+  for (int i = 0; i < PAGES; i++)
+    {
+      // already holding exactly this page
+      if (prog->image && prog->image->page[i] == img->page[i]
+          && !(prog->pages[i] & PG_DIRTY))
+        continue;
+
+      uint16_t *words = prog->mem + (i << PAGE_BITS);
+      if (img->page[i])
+        memcpy (words, img->page[i]->words, sizeof (img->page[i]->words));
+      else
+        memset (words, 0, PAGE_WORDS * sizeof (uint16_t));
+      prog->pages[i] &= ~PG_DIRTY;
+    }
+  memcpy (prog->reg, img->reg, sizeof (prog->reg));
+  prog->icount = img->icount;
+
+  free_image (prog->image);
+  prog->image = held;
+
+  return 0;
+}
+
+/* put a machine back the way pristine had it, devices detached, copying
+ * only the pages written since */
+uint16_t
+reset_program (program *prog, vmimage *pristine)
+{
+  free_devices (prog);
+  prog->limit = 0;
+  return load_image (prog, pristine);
+}
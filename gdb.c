@@ -0,0 +1,667 @@
+#include "program.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix only */
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* A stub for GDB's remote serial protocol, so GDB (or a script) can drive
+ * the machine over a TCP port on localhost or a UNIX socket. It's a client
+ * of the debugger in debug.c: breakpoints are its breakpoints, and continue
+ * is its continue, so the machine runs at full speed between them rather
+ * than a packet per instruction.
+ *
+ * On the wire memory is bytes, so word A is bytes 2A and 2A+1, big endian
+ * like object files are; registers are big endian too. They're r0-r7, pc
+ * and psr (with the condition codes in its low bits), as the target
+ * description (qXfer:features:read) has them. There's no LC-3 in GDB, so
+ * the description names no architecture.
+ *
+ * Supported: ?, g/G, p/P, m/M, c/s (from where it is), bc/bs (backwards),
+ * Z0/z0 (breakpoints), Z2-Z4/z2-z4 (write, read and access watchpoints),
+ * D and k, and ^C while it's running. */
+
+#define PACKET_MAX 4096
+#define NREGS 10 // r0-r7, pc, psr
+
+static const char target_xml[]
+    = "<?xml version=\"1.0\"?>\n"
+      "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+      "<target version=\"1.0\">\n"
+      "  <feature name=\"org.lc3.core\">\n"
+      "    <reg name=\"r0\" bitsize=\"16\" type=\"int16\"/>\n"
+      "    <reg name=\"r1\" bitsize=\"16\" type=\"int16\"/>\n"
+      "    <reg name=\"r2\" bitsize=\"16\" type=\"int16\"/>\n"
+      "    <reg name=\"r3\" bitsize=\"16\" type=\"int16\"/>\n"
+      "    <reg name=\"r4\" bitsize=\"16\" type=\"int16\"/>\n"
+      "    <reg name=\"r5\" bitsize=\"16\" type=\"int16\"/>\n"
+      "    <reg name=\"r6\" bitsize=\"16\" type=\"data_ptr\"/>\n"
+      "    <reg name=\"r7\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+      "    <reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+      "    <reg name=\"psr\" bitsize=\"16\" type=\"uint16\"/>\n"
+      "  </feature>\n"
+      "</target>\n";
+
+/* a connection to a debugger */
+typedef struct rsp
+{
+  int fd;
+  int noack;                 /* QStartNoAckMode: no +/- */
+  char in[PACKET_MAX];       /* read, not yet consumed */
+  size_t inlen, inpos;
+  char last[PACKET_MAX + 4]; /* the last packet sent, for a - */
+  size_t lastlen;
+} rsp;
+
+static int conn_fd = -1;
+
+/* input while the machine runs is a ^C (or a hang up): stop it */
+static void
+on_input (int sig)
+{
+  int saved = errno;
+  char c;
+  ssize_t n = recv (conn_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (n == 0 || (n == 1 && c == 0x03))
+    interrupt_debug ();
+  errno = saved;
+}
+
+/* listen on where (a port, 0 for any that's free, or else a path), and
+ * take one connection */
+static int
+accept_debugger (const char *where)
+{
+  char *end;
+  long port = strtol (where, &end, 10);
+  int tcp = *where && !*end;
+  if (tcp && port > 65535)
+    {
+      fprintf (stderr, "error: bad port '%s'\n", where);
+      return -1;
+    }
+
+  int fd = socket (tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      fprintf (stderr, "error: couldn't create socket: %s\n",
+               strerror (errno));
+      return -1;
+    }
+
+  int rc;
+  if (tcp)
+    {
+      int on = 1;
+      setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+      struct sockaddr_in addr;
+      memset (&addr, 0, sizeof (addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+      addr.sin_port = htons (port);
+      rc = bind (fd, (struct sockaddr *)&addr, sizeof (addr));
+    }
+  else
+    {
+      struct sockaddr_un addr;
+      memset (&addr, 0, sizeof (addr));
+      addr.sun_family = AF_UNIX;
+      if (strlen (where) >= sizeof (addr.sun_path))
+        {
+          fprintf (stderr, "error: socket path too long: %s\n", where);
+          close (fd);
+          return -1;
+        }
+      strcpy (addr.sun_path, where);
+      unlink (where);
+      rc = bind (fd, (struct sockaddr *)&addr, sizeof (addr));
+    }
+  if (rc != 0 || listen (fd, 1) != 0)
+    {
+      fprintf (stderr, "error: couldn't listen on %s: %s\n", where,
+               strerror (errno));
+      close (fd);
+      return -1;
+    }
+
+  if (tcp)
+    {
+      struct sockaddr_in addr;
+      socklen_t len = sizeof (addr);
+      getsockname (fd, (struct sockaddr *)&addr, &len);
+      fprintf (stderr, "waiting for gdb on localhost:%d...\n",
+               ntohs (addr.sin_port));
+    }
+  else
+    fprintf (stderr, "waiting for gdb on %s...\n", where);
+  int conn;
+  while ((conn = accept (fd, 0, 0)) < 0 && errno == EINTR)
+    ;
+  if (conn < 0)
+    fprintf (stderr, "error: couldn't accept a connection: %s\n",
+             strerror (errno));
+  close (fd);
+  if (!tcp)
+    unlink (where);
+  return conn;
+}
+
+/* the next byte from the debugger, or -1 when it's gone */
+static int
+get_byte (rsp *r)
+{
+  if (r->inpos == r->inlen)
+    {
+      ssize_t n;
+      while ((n = read (r->fd, r->in, sizeof (r->in))) < 0 && errno == EINTR)
+        ;
+      if (n <= 0)
+        return -1;
+      r->inlen = n;
+      r->inpos = 0;
+    }
+  return (unsigned char)r->in[r->inpos++];
+}
+
+static void
+send_raw (rsp *r, const char *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t n = write (r->fd, buf, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return; // we'll find out when we next read
+      buf += n;
+      len -= n;
+    }
+}
+
+static int
+hex_digit (int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static const char hex[] = "0123456789abcdef";
+
+/* whether s is exactly len hex digits */
+static int
+all_hex (const char *s, size_t len)
+{
+  if (strlen (s) != len)
+    return 0;
+  for (size_t i = 0; i < len; i++)
+    if (hex_digit (s[i]) < 0)
+      return 0;
+  return 1;
+}
+
+/* read a packet's data into pkt (NUL terminated); its length, or -1 when
+ * the debugger's gone */
+static int
+get_packet (rsp *r, char *pkt)
+{
+  for (;;)
+    {
+      int c = get_byte (r);
+      if (c < 0)
+        return -1;
+      if (c == '-' && !r->noack)
+        send_raw (r, r->last, r->lastlen);
+      if (c != '$')
+        continue; // acks, and ^Cs (on_input's seen to those)
+
+      size_t len = 0;
+      uint8_t sum = 0;
+      while ((c = get_byte (r)) >= 0 && c != '#')
+        {
+          if (len < PACKET_MAX - 1)
+            pkt[len++] = c;
+          sum += c;
+        }
+      int hi = get_byte (r), lo = get_byte (r);
+      if (c < 0 || lo < 0)
+        return -1;
+      pkt[len] = '\0';
+
+      if (!r->noack)
+        {
+          if (hex_digit (hi) * 16 + hex_digit (lo) != sum)
+            {
+              send_raw (r, "-", 1);
+              continue;
+            }
+          send_raw (r, "+", 1);
+        }
+      return len;
+    }
+}
+
+static void
+put_packet (rsp *r, const char *data)
+{
+  size_t len = strlen (data);
+  if (len > PACKET_MAX - 1)
+    len = PACKET_MAX - 1;
+
+  uint8_t sum = 0;
+  r->last[0] = '$';
+  for (size_t i = 0; i < len; i++)
+    sum += r->last[i + 1] = data[i];
+  r->last[len + 1] = '#';
+  r->last[len + 2] = hex[sum >> 4];
+  r->last[len + 3] = hex[sum & 0xF];
+  r->lastlen = len + 4;
+  send_raw (r, r->last, r->lastlen);
+}
+
+/* parse hex at *s, leaving *s after it; -1 if there's none */
+static long
+parse_hex (const char **s)
+{
+  long val = 0;
+  int d, any = 0;
+  while ((d = hex_digit (**s)) >= 0)
+    {
+      val = val << 4 | d;
+      (*s)++;
+      any = 1;
+    }
+  return any ? val : -1;
+}
+
+static void
+put_word (char *out, uint16_t val)
+{
+  for (int i = 0; i < 4; i++)
+    out[i] = hex[val >> (12 - 4 * i) & 0xF];
+  out[4] = '\0';
+}
+
+static uint16_t
+get_reg (program *prog, int n)
+{
+  if (n < 8)
+    return prog->reg[R_R0 + n];
+  if (n == 8)
+    return prog->reg[R_PC];
+  return prog->reg[R_PSR] | prog->reg[R_COND];
+}
+
+static void
+set_reg (program *prog, int n, uint16_t val)
+{
+  if (n < 8)
+    prog->reg[R_R0 + n] = val;
+  else if (n == 8)
+    prog->reg[R_PC] = val;
+  else
+    {
+      prog->reg[R_PSR] = val & ~(FL_NEG | FL_ZRO | FL_POS);
+      prog->reg[R_COND] = val & (FL_NEG | FL_ZRO | FL_POS);
+    }
+}
+
+/* a byte of memory, by its address on the wire */
+static uint8_t
+get_byte_at (program *prog, uint32_t b)
+{
+  uint16_t word = prog->mem[b >> 1 & 0xFFFF];
+  return b & 1 ? word & 0xFF : word >> 8;
+}
+
+static void
+set_byte_at (program *prog, uint32_t b, uint8_t val)
+{
+  uint16_t addr = b >> 1 & 0xFFFF, word = prog->mem[addr];
+  mem_write (prog, addr,
+             b & 1 ? (word & 0xFF00) | val : (word & 0x00FF) | val << 8);
+}
+
+/* the stop reply for why the machine stopped */
+static void
+put_stop (rsp *r, program *prog, int stop)
+{
+  char buf[64];
+  debug *dbg = prog->debug;
+  switch (stop)
+    {
+    case STOP_HALT:
+      put_packet (r, "W00");
+      return;
+    case STOP_ERROR:
+      put_packet (r, "S04"); // SIGILL
+      return;
+    case STOP_INTERRUPT:
+      put_packet (r, "S02"); // SIGINT
+      return;
+    case STOP_WATCH:
+      {
+        int kind = WATCH_WRITE;
+        for (uint32_t i = 0; i < dbg->nwatches; i++)
+          if (dbg->watches[i].first <= dbg->hit.addr
+              && dbg->hit.addr <= dbg->watches[i].last
+              && (dbg->watches[i].kind & dbg->hit.kind))
+            kind = dbg->watches[i].kind;
+        snprintf (buf, sizeof (buf), "T05%s:%x;",
+                  kind == WATCH_ACCESS ? "awatch"
+                  : kind == WATCH_READ ? "rwatch"
+                                       : "watch",
+                  (unsigned)dbg->hit.addr << 1);
+        put_packet (r, buf);
+      }
+      return;
+    case STOP_START:
+      put_packet (r, "T05replaylog:begin;");
+      return;
+    }
+  put_packet (r, "S05"); // SIGTRAP
+}
+
+/* Z/z: a breakpoint or watchpoint, set or cleared */
+static void
+do_point (rsp *r, program *prog, const char *args, int on)
+{
+  const char *s = args + 1;
+  int type = args[0] - '0';
+  long addr = -1, len = -1;
+  if (*s++ == ',')
+    addr = parse_hex (&s);
+  if (addr >= 0 && *s++ == ',')
+    len = parse_hex (&s);
+  if (addr < 0 || len < 0)
+    {
+      put_packet (r, "E01");
+      return;
+    }
+
+  uint16_t first = addr >> 1 & 0xFFFF;
+  uint16_t last = (addr + (len ? len : 1) - 1) >> 1 & 0xFFFF;
+  static const int kinds[] = { 0, 0, WATCH_WRITE, WATCH_READ, WATCH_ACCESS };
+  uint16_t rc;
+  if (type == 0)
+    rc = set_break (prog, first, on);
+  else if (type >= 2 && type <= 4)
+    rc = on ? set_watch (prog, first, last, kinds[type])
+            : clear_watch (prog, first, last);
+  else
+    {
+      put_packet (r, ""); // hardware breakpoints: there's no hardware
+      return;
+    }
+  put_packet (r, rc ? "E02" : "OK");
+}
+
+/* qXfer:features:read:target.xml:OFFSET,LENGTH */
+static void
+do_features (rsp *r, const char *args)
+{
+  static const char prefix[] = "target.xml:";
+  char buf[PACKET_MAX];
+  if (strncmp (args, prefix, sizeof (prefix) - 1) != 0)
+    {
+      put_packet (r, "E00");
+      return;
+    }
+
+  const char *s = args + sizeof (prefix) - 1;
+  long off = parse_hex (&s), len = -1;
+  if (off >= 0 && *s++ == ',')
+    len = parse_hex (&s);
+  if (len < 0)
+    {
+      put_packet (r, "E01");
+      return;
+    }
+
+  long size = sizeof (target_xml) - 1;
+  if (off > size)
+    off = size;
+  if (len > size - off)
+    len = size - off;
+  if (len > PACKET_MAX - 2)
+    len = PACKET_MAX - 2;
+  buf[0] = off + len < size ? 'm' : 'l';
+  memcpy (buf + 1, target_xml + off, len);
+  buf[len + 1] = '\0';
+  put_packet (r, buf);
+}
+
+/* handle one packet; non-zero when the session's over */
+static int
+do_packet (rsp *r, program *prog, char *pkt, int *stop)
+{
+  char buf[PACKET_MAX];
+  const char *s = pkt + 1;
+
+  switch (pkt[0])
+    {
+    case '?':
+      put_stop (r, prog, *stop);
+      break;
+
+    case 'g':
+      for (int i = 0; i < NREGS; i++)
+        put_word (buf + 4 * i, get_reg (prog, i));
+      put_packet (r, buf);
+      break;
+
+    case 'G':
+      if (!all_hex (s, 4 * NREGS))
+        {
+          put_packet (r, "E01");
+          break;
+        }
+      for (int i = 0; i < NREGS; i++)
+        {
+          char word[5];
+          const char *w = word;
+          memcpy (word, s + 4 * i, 4);
+          word[4] = '\0';
+          set_reg (prog, i, parse_hex (&w));
+        }
+      put_packet (r, "OK");
+      break;
+
+    case 'p':
+      {
+        long n = parse_hex (&s);
+        if (n < 0 || n >= NREGS)
+          put_packet (r, "E01");
+        else
+          {
+            put_word (buf, get_reg (prog, n));
+            put_packet (r, buf);
+          }
+      }
+      break;
+
+    case 'P':
+      {
+        long n = parse_hex (&s), val = -1;
+        if (*s++ == '=')
+          val = parse_hex (&s);
+        if (n < 0 || n >= NREGS || val < 0)
+          put_packet (r, "E01");
+        else
+          {
+            set_reg (prog, n, val);
+            put_packet (r, "OK");
+          }
+      }
+      break;
+
+    case 'm':
+      {
+        long addr = parse_hex (&s), len = -1;
+        if (*s++ == ',')
+          len = parse_hex (&s);
+        if (addr < 0 || len < 0)
+          {
+            put_packet (r, "E01");
+            break;
+          }
+        if (len > (PACKET_MAX - 1) / 2)
+          len = (PACKET_MAX - 1) / 2;
+        for (long i = 0; i < len; i++)
+          {
+            uint8_t b = get_byte_at (prog, addr + i);
+            buf[2 * i] = hex[b >> 4];
+            buf[2 * i + 1] = hex[b & 0xF];
+          }
+        buf[2 * len] = '\0';
+        put_packet (r, buf);
+      }
+      break;
+
+    case 'M':
+      {
+        long addr = parse_hex (&s), len = -1;
+        if (*s++ == ',')
+          len = parse_hex (&s);
+        if (addr < 0 || len < 0 || *s++ != ':'
+            || !all_hex (s, (size_t)len * 2))
+          {
+            put_packet (r, "E01");
+            break;
+          }
+        for (long i = 0; i < len; i++)
+          set_byte_at (prog, addr + i,
+                       hex_digit (s[2 * i]) << 4 | hex_digit (s[2 * i + 1]));
+        put_packet (r, "OK");
+      }
+      break;
+
+    case 'c':
+    case 's':
+      if (*s)
+        {
+          put_packet (r, "E01"); // resuming somewhere else: set pc first
+          break;
+        }
+      if (*stop != STOP_HALT && *stop != STOP_ERROR)
+        *stop = pkt[0] == 'c' ? debug_continue (prog)
+                              : debug_step (prog, 1, 0);
+      put_stop (r, prog, *stop);
+      break;
+
+    case 'b':
+      if (strcmp (s, "c") != 0 && strcmp (s, "s") != 0)
+        {
+          put_packet (r, "");
+          break;
+        }
+      *stop = *s == 'c' ? debug_reverse_continue (prog)
+                        : debug_reverse_step (prog, 1);
+      put_stop (r, prog, *stop);
+      break;
+
+    case 'Z':
+    case 'z':
+      do_point (r, prog, s, pkt[0] == 'Z');
+      break;
+
+    case 'H':
+      put_packet (r, "OK"); // there's the one thread
+      break;
+
+    case 'D':
+      put_packet (r, "OK");
+      return 1;
+
+    case 'k':
+      return 1;
+
+    case 'q':
+      if (strncmp (s, "Supported", 9) == 0)
+        {
+          snprintf (buf, sizeof (buf),
+                    "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+;"
+                    "ReverseStep+;ReverseContinue+",
+                    PACKET_MAX);
+          put_packet (r, buf);
+        }
+      else if (strncmp (s, "Xfer:features:read:", 19) == 0)
+        do_features (r, s + 19);
+      else if (strcmp (s, "Attached") == 0)
+        put_packet (r, "1");
+      else if (strcmp (s, "C") == 0)
+        put_packet (r, "QC1");
+      else if (strcmp (s, "fThreadInfo") == 0)
+        put_packet (r, "m1");
+      else if (strcmp (s, "sThreadInfo") == 0)
+        put_packet (r, "l");
+      else
+        put_packet (r, "");
+      break;
+
+    case 'Q':
+      if (strcmp (s, "StartNoAckMode") == 0)
+        {
+          put_packet (r, "OK");
+          r->noack = 1;
+        }
+      else
+        put_packet (r, "");
+      break;
+
+    default:
+      put_packet (r, ""); // not supported
+      break;
+    }
+  return 0;
+}
+
+/* wait on where (a TCP port on localhost, or a UNIX socket's path) for a
+ * debugger, and let it run the program until it detaches or kills it */
+int
+serve_gdb (program *prog, const char *where)
+{
+  rsp *r = calloc (1, sizeof (rsp));
+  if (!r)
+    {
+      fprintf (stderr, "error: out of memory\n");
+      return 1;
+    }
+  if ((r->fd = accept_debugger (where)) < 0)
+    {
+      free (r);
+      return 1;
+    }
+
+  // a ^C from the debugger stops the machine, as a breakpoint would
+  conn_fd = r->fd;
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = on_input;
+  sa.sa_flags = SA_RESTART;
+  sigaction (SIGIO, &sa, 0);
+  fcntl (r->fd, F_SETOWN, getpid ());
+  fcntl (r->fd, F_SETFL, fcntl (r->fd, F_GETFL) | O_ASYNC);
+
+  int stop = debug_start (prog);
+  int rc = stop == STOP_ERROR;
+  char pkt[PACKET_MAX];
+  while (!rc && get_packet (r, pkt) >= 0 && !do_packet (r, prog, pkt, &stop))
+    ;
+
+  signal (SIGIO, SIG_IGN);
+  conn_fd = -1;
+  close (r->fd);
+  free (r);
+  return rc;
+}
@@ -1,7 +1,13 @@
 #include "parse.h"
 #include "program.h"
 
-#include <ctype.h> // isprint()
+#include <ctype.h>   // isprint()
+#include <stdlib.h>  // strtol()
+#include <strings.h> // strcasecmp()
+/* unix only */
+#include <dirent.h> // opendir()
+#include <sys/stat.h>
+#include <unistd.h> // isatty()
 
 enum
 {
@@ -9,6 +15,21 @@ enum
   CMD_ASM,  /* assemble and load */
   CMD_LOAD, /* load object files */
   CMD_RUN,  /* execute what's loaded */
+  CMD_BREAK,    /* set/list breakpoints */
+  CMD_DELETE,   /* clear breakpoints */
+  CMD_IGNORE,   /* go on past breakpoint hits */
+  CMD_STEP,     /* single-step */
+  CMD_NEXT,     /* single-step over calls */
+  CMD_CONTINUE, /* resume */
+  CMD_FINISH,   /* run until the subroutine returns */
+  CMD_RSTEP,    /* single-step backwards */
+  CMD_RCONTINUE, /* run backwards */
+  CMD_WATCH,    /* set/list watchpoints */
+  CMD_UNWATCH,  /* clear watchpoints */
+  CMD_ASSERT,   /* check a register or word */
+  CMD_EXAMINE,  /* show memory */
+  CMD_DISAS,    /* disassemble memory */
+  CMD_INFO,     /* show registers or symbols */
   CMD_HELP, /* display help */
   CMD_EXIT  /* exit */
 };
@@ -32,6 +53,81 @@ static command command_table[]
           "load one or more object files",
           { "l", 0 } },
         { CMD_RUN, "run", 0, "run the currently-loaded program", { "r", 0 } },
+        { CMD_BREAK,
+          "break",
+          "addr",
+          "set breakpoints, or one with if cond (or list)",
+          { "b", 0 } },
+        { CMD_DELETE,
+          "delete",
+          "addr",
+          "delete breakpoints (or all of them)",
+          { "d", 0 } },
+        { CMD_IGNORE,
+          "ignore",
+          "addr n",
+          "go on past the next n hits of a breakpoint",
+          { 0 } },
+        { CMD_STEP,
+          "step",
+          "n",
+          "run n instructions (default 1)",
+          { "s", 0 } },
+        { CMD_NEXT,
+          "next",
+          "n",
+          "step, running each call through as one",
+          { "n", 0 } },
+        { CMD_CONTINUE,
+          "continue",
+          0,
+          "resume until a breakpoint",
+          { "c", 0 } },
+        { CMD_FINISH,
+          "finish",
+          0,
+          "resume until the current subroutine returns",
+          { "fin", 0 } },
+        { CMD_RSTEP,
+          "reverse-step",
+          "n",
+          "go back n instructions (default 1)",
+          { "rs", 0 } },
+        { CMD_RCONTINUE,
+          "reverse-continue",
+          0,
+          "go back to the last breakpoint or watchpoint",
+          { "rc", 0 } },
+        { CMD_WATCH,
+          "watch",
+          "range",
+          "stop on writes (or reads) of a range, or list",
+          { "w", 0 } },
+        { CMD_UNWATCH,
+          "unwatch",
+          "range",
+          "delete watchpoints in a range (or all of them)",
+          { "uw", 0 } },
+        { CMD_EXAMINE,
+          "x/N",
+          "addr",
+          "show N words of memory (default 1) from addr",
+          { 0 } },
+        { CMD_DISAS,
+          "disas",
+          "range",
+          "disassemble a range, or a routine (default: PC's)",
+          { 0 } },
+        { CMD_INFO,
+          "info",
+          "what",
+          "show the registers, symbols or segments",
+          { "i", 0 } },
+        { CMD_ASSERT,
+          "assert",
+          "check",
+          "fail unless reg R0 (or mem addr) == (or !=) val",
+          { 0 } },
         { CMD_HELP, "help", 0, "display this help message", { "h", "?", 0 } },
         { CMD_EXIT, "exit", 0, "exit the program", { "quit", "q", "x", 0 } },
         { 0, 0, 0, 0, 0 }
@@ -67,6 +163,9 @@ print_help (char *sofar)
 static int
 parse_command (const char *s)
 {
+  if (strncmp (s, "x/", 2) == 0) // the count's part of it
+    return CMD_EXAMINE;
+
   for (command *cmd = command_table; cmd->name; cmd++)
     {
       if (strcmp (s, cmd->name) == 0)
@@ -82,6 +181,295 @@ parse_command (const char *s)
   return CMD_UNK;
 }
 
+#define LABELLED(prog, addr)                                                  \
+  ((prog)->sym[addr] && (prog)->sym[addr]->label                              \
+   && *(prog)->sym[addr]->label != '_')
+
+/* the address, its label if it has one, and what's there; returns how many
+ * more words that took (for a .STRINGZ) */
+static uint16_t
+print_location (program *prog, uint16_t addr)
+{
+  char buf[4096] = "";
+  uint16_t more = disassemble_addr (buf, 0, addr, prog);
+  printf ("x%04X", addr);
+  if (LABELLED (prog, addr))
+    printf (" <%s>", prog->sym[addr]->label);
+  printf (": %s\n", buf);
+  return more;
+}
+
+/* a breakpoint, with its condition and counts if it has any */
+static void
+print_break (program *prog, uint16_t addr)
+{
+  breakpoint *bp = find_break (prog, addr);
+  print_location (prog, addr);
+  if (bp->cond)
+    printf ("    if %s\n", bp->cond);
+  if (bp->hits)
+    printf ("    hit %u time%s\n", bp->hits, bp->hits == 1 ? "" : "s");
+  if (bp->ignore)
+    printf ("    ignoring the next %u\n", bp->ignore);
+}
+
+/* addr or first-last, as for the watch command; non-zero if it isn't */
+static int
+parse_range (program *prog, char *s, uint16_t *first, uint16_t *last)
+{
+  char *dash = strchr (s, '-');
+  if (dash)
+    *dash = 0;
+  int rc = lookup_addr (prog, s, first) != 0
+           || lookup_addr (prog, dash ? dash + 1 : s, last) != 0
+           || *last < *first;
+  if (dash)
+    *dash = '-';
+  return rc;
+}
+
+static const char *watch_kinds[] = { 0, "read", "write", "access" };
+
+/* a register by name (R0-R7, PC or PSR, with the condition codes); non-zero
+ * if there's no such */
+static int
+lookup_reg (program *prog, const char *s, uint16_t *val)
+{
+  if ((s[0] == 'R' || s[0] == 'r') && s[1] >= '0' && s[1] <= '7' && !s[2])
+    *val = prog->reg[R_R0 + s[1] - '0'];
+  else if (strcasecmp (s, "PC") == 0)
+    *val = prog->reg[R_PC];
+  else if (strcasecmp (s, "PSR") == 0)
+    *val = prog->reg[R_PSR] | prog->reg[R_COND];
+  else
+    return 1;
+  return 0;
+}
+
+/* a value to compare with: an address or label, or #-1 and the like */
+static int
+parse_value (program *prog, const char *s, uint16_t *val)
+{
+  if (s[0] == '#' && s[1] == '-')
+    {
+      char *end;
+      long n = strtol (s + 1, &end, 10);
+      if (*end || n < -32768)
+        return 1;
+      *val = n;
+      return 0;
+    }
+  return lookup_addr (prog, s, val);
+}
+
+/* assert reg R0 == x1234, or mem LABEL != #0; non-zero if it doesn't hold
+ * (or makes no sense) */
+static int
+check_assert (program *prog, const char *kind)
+{
+  char *what = strtok (0, " "), *op = strtok (0, " "),
+       *want = strtok (0, " ");
+  uint16_t addr, have, val;
+  int reg = kind && strcmp (kind, "reg") == 0;
+  int mem = kind && strcmp (kind, "mem") == 0;
+  if ((!reg && !mem) || !what || !op || !want)
+    {
+      printf ("usage: assert reg|mem WHAT ==|!= VALUE\n");
+      return 1;
+    }
+  if (reg && lookup_reg (prog, what, &have) != 0)
+    {
+      printf ("no such register: %s\n", what);
+      return 1;
+    }
+  if (mem && lookup_addr (prog, what, &addr) != 0)
+    {
+      printf ("no such address or label: %s\n", what);
+      return 1;
+    }
+  if (mem)
+    have = prog->mem[addr];
+  if (parse_value (prog, want, &val) != 0)
+    {
+      printf ("not a value: %s\n", want);
+      return 1;
+    }
+
+  int eq = strcmp (op, "==") == 0;
+  if (!eq && strcmp (op, "!=") != 0)
+    {
+      printf ("not == or !=: %s\n", op);
+      return 1;
+    }
+  if ((have == val) == eq)
+    return 0;
+  if (eq)
+    printf ("assertion failed: %s is x%04X, not x%04X\n", what, have, val);
+  else
+    printf ("assertion failed: %s is x%04X\n", what, have);
+  return 1;
+}
+
+/* say where the program stopped, unless it's done; non-zero if it
+ * couldn't go on */
+static int
+print_stop (program *prog, int stop)
+{
+  switch (stop)
+    {
+    case STOP_NONE:
+      printf ("the program isn't running\n");
+      return 1;
+    case STOP_ERROR:
+      return 1;
+    case STOP_WATCH:
+      {
+        debug *dbg = prog->debug;
+        printf ("watchpoint: x%04X", dbg->hit.addr);
+        if (dbg->hit.kind == WATCH_WRITE)
+          printf (" written: x%04X -> x%04X\n", dbg->hit.old, dbg->hit.val);
+        else
+          printf (" read: x%04X\n", dbg->hit.val);
+        print_location (prog, prog->reg[R_PC]);
+      }
+      break;
+    case STOP_START:
+      printf ("back at the start: ");
+      print_location (prog, prog->reg[R_PC]);
+      break;
+    case STOP_INTERRUPT:
+      printf ("interrupted at ");
+      print_location (prog, prog->reg[R_PC]);
+      break;
+    case STOP_BREAK:
+      printf ("breakpoint at ");
+      // fall through
+    case STOP_STEP:
+    case STOP_FINISH:
+      print_location (prog, prog->reg[R_PC]);
+      break;
+    }
+  return 0;
+}
+
+#define EXAMINE_WORDS 8 // words per line of x/N
+#define DISAS_MAX 64    // words of a routine disas goes through, at most
+
+/* x/N addr: N words from addr */
+static int
+examine (program *prog, const char *cmd, const char *args)
+{
+  char *end = "";
+  long n = cmd[2] ? strtol (cmd + 2, &end, 10) : 1;
+  uint16_t addr;
+  if (*end || n < 1)
+    {
+      printf ("not a number of words: %s\n", cmd + 2);
+      return 1;
+    }
+  if (!args || lookup_addr (prog, args, &addr) != 0)
+    {
+      printf ("no such address or label: %s\n", args ? args : "");
+      return 1;
+    }
+
+  for (uint32_t a = addr; a < addr + (uint32_t)n && a < MEMORY_MAX; a++)
+    {
+      if ((a - addr) % EXAMINE_WORDS == 0)
+        {
+          if (a != addr)
+            printf ("\n");
+          printf ("x%04X", a);
+          if (LABELLED (prog, a))
+            printf (" <%s>", prog->sym[a]->label);
+          printf (":");
+        }
+      printf (" x%04X", prog->mem[a]);
+    }
+  printf ("\n");
+  return 0;
+}
+
+/* disas first-last, or the routine at an address (PC by default, once
+ * it's running) through its RET, RTI or HALT, as far as DISAS_MAX words */
+static int
+disassemble (program *prog, char *args)
+{
+  uint16_t first = prog->debug && prog->debug->stop ? prog->reg[R_PC]
+                                                    : prog->orig,
+           last;
+  int routine = !args || !strchr (args, '-');
+  if (args
+      && (routine ? lookup_addr (prog, args, &first)
+                  : parse_range (prog, args, &first, &last))
+             != 0)
+    {
+      printf ("no such address, label or range: %s\n", args);
+      return 1;
+    }
+
+  uint32_t end = routine ? first + DISAS_MAX : last + 1U;
+  uint32_t loaded = prog->orig + prog->len;
+  if (routine && first >= prog->orig && first < loaded && end > loaded)
+    end = loaded; // or the end of the program
+  for (uint32_t a = first; a < end && a < MEMORY_MAX; a++)
+    {
+      uint16_t word = prog->mem[a];
+      int data = prog->sym[a] && (prog->sym[a]->flags >> 12) != HINT_INST;
+      a += print_location (prog, a);
+      if (routine && !data
+          && (word == 0xC1C0 || word == 0x8000 || word == 0xF025))
+        break; // RET, RTI, HALT
+    }
+  return 0;
+}
+
+/* info registers, info symbols or info segments (or any prefix of them) */
+static int
+info (program *prog, const char *what)
+{
+  size_t len = what ? strlen (what) : 0;
+  if (len && strncmp (what, "registers", len) == 0)
+    {
+      uint16_t *reg = prog->reg;
+      for (int r = 0; r < 8; r++)
+        printf ("R%d   x%04X  #%d\n", r, reg[R_R0 + r],
+                (int16_t)reg[R_R0 + r]);
+      printf ("PC   x%04X\n", reg[R_PC]);
+      printf ("PSR  x%04X  %s, priority %d, %s\n", reg[R_PSR] | reg[R_COND],
+              reg[R_PSR] & PSR_USER ? "user" : "supervisor",
+              (reg[R_PSR] & PSR_PRIORITY) >> 8,
+              reg[R_COND] & FL_NEG   ? "N"
+              : reg[R_COND] & FL_ZRO ? "Z"
+                                     : "P");
+    }
+  else if (len && strncmp (what, "symbols", len) == 0)
+    {
+      for (uint32_t a = 0; a < MEMORY_MAX; a++)
+        if (LABELLED (prog, a))
+          printf ("x%04X %s\n", a, prog->sym[a]->label);
+    }
+  else if (len && strncmp (what, "segments", len) == 0)
+    {
+      uint16_t entry = entry_point (prog);
+      for (uint32_t s = 0; s < prog->nsegs; s++)
+        {
+          segment *seg = prog->segs + s;
+          printf ("x%04X-x%04X %s%s\n", seg->orig,
+                  (uint16_t)(seg->orig + seg->len - 1), seg->name,
+                  seg->flags & SEG_OS ? " (os)" : "");
+        }
+      printf ("entry ");
+      print_location (prog, entry);
+    }
+  else
+    {
+      printf ("info registers, symbols or segments?\n");
+      return 1;
+    }
+  return 0;
+}
+
 static int
 process_command (program *prog, const char *cmd, char *args)
 {
@@ -113,10 +501,17 @@ process_command (program *prog, const char *cmd, char *args)
                 printf ("failed to assemble: %s\n", arg);
                 error_count++;
               }
+            else if (add_segment (prog, prog->orig, prog->len, arg,
+                                  SEG_RELOAD) != 0)
+              {
+                printf ("failed to load: %s\n", arg);
+                error_count++;
+              }
             else
               printf ("successfully loaded\n");
 
-            fclose (in);
+            if (in)
+              fclose (in);
           }
       }
       break;
@@ -133,20 +528,204 @@ process_command (program *prog, const char *cmd, char *args)
                 printf ("failed to open: %s\n", arg);
                 error_count++;
               }
-            else if (load_program (prog, in) != 0)
+            else if (load_segment (prog, in, arg, SEG_RELOAD) != 0)
               {
                 printf ("failed to load image: %s\n", arg);
                 error_count++;
               }
             else
               printf ("successfully loaded\n");
+
+            if (in)
+              fclose (in);
           }
       }
       break;
 
     case CMD_RUN:
-      if (execute_program (prog) != 0)
-        error_count++;
+      error_count += print_stop (prog, debug_run (prog));
+      break;
+
+    case CMD_BREAK:
+    case CMD_DELETE:
+      {
+        int on = parse_command (cmd) == CMD_BREAK;
+        if (!args && on) // list them
+          {
+            for (uint32_t a = 0; a < MEMORY_MAX; a++)
+              if (is_break (prog, a))
+                print_break (prog, a);
+          }
+        else if (!args) // delete them all
+          {
+            for (uint32_t a = 0; a < MEMORY_MAX; a++)
+              if (is_break (prog, a))
+                set_break (prog, a, 0);
+          }
+
+        for (char *arg = args, *next; arg; arg = next)
+          {
+            // break ADDR if COND: the rest of the line's the condition
+            char *cond = 0;
+            int conditional = 0;
+            next = strtok (0, " "); // danger!
+            if (on && next && strcasecmp (next, "if") == 0)
+              {
+                cond = strtok (0, "");
+                conditional = 1;
+                next = 0;
+              }
+
+            uint16_t addr;
+            if (lookup_addr (prog, arg, &addr) != 0)
+              {
+                printf ("no such address or label: %s\n", arg);
+                error_count++;
+                continue;
+              }
+            if (conditional && !cond)
+              {
+                printf ("usage: break ADDR if COND\n");
+                error_count++;
+                continue;
+              }
+
+            int was = is_break (prog, addr);
+            const char *err;
+            if (set_break (prog, addr, on) != 0)
+              error_count++;
+            else if (on && (err = set_cond (prog, addr, cond)))
+              {
+                printf ("bad condition: %s\n", err);
+                if (!was)
+                  set_break (prog, addr, 0);
+                error_count++;
+              }
+          }
+      }
+      break;
+
+    case CMD_IGNORE:
+      {
+        char *n = strtok (0, " "), *end;
+        uint16_t addr;
+        breakpoint *bp;
+        long count = n ? strtol (n, &end, 0) : -1;
+        if (!args || count < 0 || *end)
+          {
+            printf ("usage: ignore ADDR N\n");
+            error_count++;
+          }
+        else if (lookup_addr (prog, args, &addr) != 0)
+          {
+            printf ("no such address or label: %s\n", args);
+            error_count++;
+          }
+        else if (!(bp = find_break (prog, addr)))
+          {
+            printf ("no breakpoint at x%04X\n", addr);
+            error_count++;
+          }
+        else
+          bp->ignore = count;
+      }
+      break;
+
+    case CMD_STEP:
+    case CMD_NEXT:
+    case CMD_RSTEP:
+      {
+        long n = args ? strtol (args, 0, 0) : 1;
+        if (n < 1)
+          {
+            printf ("not a number of instructions: %s\n", args);
+            error_count++;
+            break;
+          }
+        int code = parse_command (cmd);
+        if (code == CMD_RSTEP)
+          error_count += print_stop (prog, debug_reverse_step (prog, n));
+        else
+          error_count += print_stop (
+              prog, debug_step (prog, n, code == CMD_NEXT));
+      }
+      break;
+
+    case CMD_WATCH:
+      {
+        if (!args) // list them
+          {
+            for (uint32_t i = 0; prog->debug && i < prog->debug->nwatches;
+                 i++)
+              {
+                watchpoint *w = prog->debug->watches + i;
+                printf ("x%04X-x%04X %s\n", w->first, w->last,
+                        watch_kinds[w->kind]);
+              }
+            break;
+          }
+
+        uint16_t first, last;
+        char *how = strtok (0, " ");
+        int kind = WATCH_WRITE;
+        if (how)
+          for (kind = WATCH_ACCESS; kind && strcmp (how, watch_kinds[kind]);
+               kind--)
+            ;
+        if (parse_range (prog, args, &first, &last) != 0)
+          {
+            printf ("no such address, label or range: %s\n", args);
+            error_count++;
+          }
+        else if (!kind)
+          {
+            printf ("not read, write or access: %s\n", how);
+            error_count++;
+          }
+        else if (set_watch (prog, first, last, kind) != 0)
+          error_count++;
+      }
+      break;
+
+    case CMD_UNWATCH:
+      {
+        uint16_t first = 0, last = MEMORY_MAX - 1;
+        if (args && parse_range (prog, args, &first, &last) != 0)
+          {
+            printf ("no such address, label or range: %s\n", args);
+            error_count++;
+          }
+        else
+          clear_watch (prog, first, last);
+      }
+      break;
+
+    case CMD_CONTINUE:
+      error_count += print_stop (prog, debug_continue (prog));
+      break;
+
+    case CMD_FINISH:
+      error_count += print_stop (prog, debug_finish (prog));
+      break;
+
+    case CMD_RCONTINUE:
+      error_count += print_stop (prog, debug_reverse_continue (prog));
+      break;
+
+    case CMD_ASSERT:
+      error_count += check_assert (prog, args);
+      break;
+
+    case CMD_EXAMINE:
+      error_count += examine (prog, cmd, args);
+      break;
+
+    case CMD_DISAS:
+      error_count += disassemble (prog, args);
+      break;
+
+    case CMD_INFO:
+      error_count += info (prog, args);
       break;
 
     default:
@@ -159,6 +738,8 @@ process_command (program *prog, const char *cmd, char *args)
 }
 
 #define PROMPT_TEXT "> "
+#define BOOP putc ('\a', stdout)
+#define INPUT_BUFFER_SIZE 4096
 
 static void
 prompt (const char *current_input)
@@ -180,15 +761,315 @@ extend_cursor (char *cursor, int n)
     *(p + n) = *p;
 }
 
-#define BOOP putc ('\a', stdout)
-#define INPUT_BUFFER_SIZE 4096
+/* put the line back up, with the cursor where it was */
+static void
+redraw (const char *buf, const char *cursor)
+{
+  printf ("\r\e[K");
+  prompt (buf);
+  for (size_t n = strlen (cursor); n > 0; n--)
+    putc ('\b', stdout);
+}
+
+/* Command history: a ring of the last HISTORY_MAX lines, read from
+ * ~/.lc3vm_history the first time it's wanted, and appended to a line at a
+ * time (and trimmed when it's read, if it's grown too long). */
+#define HISTORY_MAX 1000
+#define HISTORY_FILE ".lc3vm_history"
+
+static struct
+{
+  char *lines[HISTORY_MAX];
+  uint32_t first, n; /* the oldest line, and how many there are */
+  int loaded;
+} history;
+
+static const char *
+history_line (uint32_t i)
+{
+  return history.lines[(history.first + i) % HISTORY_MAX];
+}
+
+static void
+remember (const char *line)
+{
+  char *copy = strdup (line);
+  if (!copy)
+    return;
+  if (history.n == HISTORY_MAX) // the oldest goes
+    {
+      free (history.lines[history.first]);
+      history.first = (history.first + 1) % HISTORY_MAX;
+      history.n--;
+    }
+  history.lines[(history.first + history.n++) % HISTORY_MAX] = copy;
+}
+
+/* ~/.lc3vm_history, in path (of size len); non-zero if there's no home */
+static int
+history_path (char *path, size_t len)
+{
+  const char *home = getenv ("HOME");
+  return !home || snprintf (path, len, "%s/" HISTORY_FILE, home) >= (int)len;
+}
+
+static void
+load_history (void)
+{
+  char path[4096];
+  if (history.loaded || history_path (path, sizeof (path)) != 0)
+    return;
+  history.loaded = 1;
+
+  FILE *in = fopen (path, "r");
+  if (!in)
+    return;
+  char *line = 0;
+  size_t size = 0;
+  uint32_t read = 0;
+  while (getline (&line, &size, in) > 0)
+    {
+      line[strcspn (line, "\n")] = '\0';
+      remember (line);
+      read++;
+    }
+  free (line);
+  fclose (in);
+
+  FILE *out;
+  if (read > 2 * HISTORY_MAX && (out = fopen (path, "w")))
+    {
+      for (uint32_t i = 0; i < history.n; i++)
+        fprintf (out, "%s\n", history_line (i));
+      fclose (out);
+    }
+}
+
+static void
+add_history (const char *line)
+{
+  char path[4096];
+  load_history ();
+  if (history.n && strcmp (history_line (history.n - 1), line) == 0)
+    return;
+  remember (line);
+
+  FILE *out;
+  if (history_path (path, sizeof (path)) == 0 && (out = fopen (path, "a")))
+    {
+      fprintf (out, "%s\n", line);
+      fclose (out);
+    }
+}
+
+static void
+free_history (void)
+{
+  for (uint32_t i = 0; i < history.n; i++)
+    free (history.lines[(history.first + i) % HISTORY_MAX]);
+  memset (&history, 0, sizeof (history));
+}
+
+/* Tab completion: the first word is a command; after asm or load it's a
+ * file, and after anything else a label, from the symbols' sorted index
+ * (see match_labels()). A single match is filled in; several are filled
+ * in as far as they agree, and listed if that's no further. */
+typedef struct matches
+{
+  char **names;
+  uint32_t n, max;
+} matches;
+
+static void
+add_match (matches *m, const char *name, size_t len)
+{
+  if (m->n == m->max)
+    {
+      uint32_t max = m->max ? 2 * m->max : 64;
+      char **names = realloc (m->names, max * sizeof (char *));
+      if (!names)
+        return;
+      m->names = names;
+      m->max = max;
+    }
+  if ((m->names[m->n] = strndup (name, len)))
+    m->n++;
+}
+
+static int
+compare_names (const void *a, const void *b)
+{
+  return strcmp (*(char *const *)a, *(char *const *)b);
+}
+
+static void
+match_commands (matches *m, const char *word, size_t len)
+{
+  for (command *cmd = command_table; cmd->name; cmd++)
+    {
+      if (strncmp (cmd->name, word, len) == 0 && !strchr (cmd->name, '/'))
+        add_match (m, cmd->name, strlen (cmd->name));
+      for (char **p = cmd->aliases; *p; p++)
+        if (len && strncmp (*p, word, len) == 0)
+          add_match (m, *p, strlen (*p));
+    }
+}
+
+/* files (and directories, with a /) starting with word */
+static void
+match_files (matches *m, const char *word, size_t len)
+{
+  size_t dirlen = len;
+  while (dirlen > 0 && word[dirlen - 1] != '/')
+    dirlen--;
+  char dir[4096];
+  snprintf (dir, sizeof (dir), "%.*s", (int)(dirlen ? dirlen : 1),
+            dirlen ? word : ".");
+
+  DIR *d = opendir (dir);
+  if (!d)
+    return;
+  struct dirent *e;
+  while ((e = readdir (d)))
+    {
+      if (strncmp (e->d_name, word + dirlen, len - dirlen) != 0
+          || strcmp (e->d_name, ".") == 0 || strcmp (e->d_name, "..") == 0
+          || (e->d_name[0] == '.' && len == dirlen))
+        continue;
+
+      char path[8192];
+      struct stat st;
+      int n = snprintf (path, sizeof (path), "%.*s%s", (int)dirlen, word,
+                        e->d_name);
+      if (stat (path, &st) == 0 && S_ISDIR (st.st_mode))
+        path[n++] = '/';
+      add_match (m, path, n);
+    }
+  closedir (d);
+}
+
+static void
+match_symbols (matches *m, program *prog, const char *word, size_t len)
+{
+  char prefix[256];
+  snprintf (prefix, sizeof (prefix), "%.*s", (int)len, word);
+  const char *const *labels;
+  uint32_t n = match_labels (prog, prefix, &labels);
+  for (uint32_t i = 0; i < n; i++)
+    add_match (m, labels[i], strlen (labels[i]));
+}
+
+/* complete the word before the cursor, in buf (of size INPUT_BUFFER_SIZE);
+ * returns the cursor */
+static char *
+complete (program *prog, char *buf, char *cursor)
+{
+  char *word = cursor;
+  while (word > buf && word[-1] != ' ')
+    word--;
+  size_t len = cursor - word;
+
+  matches m = { 0 };
+  int ends = 1; // a unique match ends the word (a directory doesn't)
+  char *first = buf + strspn (buf, " ");
+  if (word == first)
+    match_commands (&m, word, len);
+  else
+    {
+      char cmd[32];
+      snprintf (cmd, sizeof (cmd), "%.*s", (int)strcspn (first, " "), first);
+      int code = parse_command (cmd);
+      if (code == CMD_ASM || code == CMD_LOAD)
+        match_files (&m, word, len);
+      else
+        match_symbols (&m, prog, word, len);
+    }
+  if (m.n > 1)
+    qsort (m.names, m.n, sizeof (char *), compare_names);
+
+  // how far they all agree (labels ignore case, but keep what's typed)
+  size_t common = m.n ? strlen (m.names[0]) : 0;
+  for (uint32_t i = 1; i < m.n; i++)
+    {
+      size_t j = 0;
+      while (j < common && tolower (m.names[i][j]) == tolower (m.names[0][j]))
+        j++;
+      common = j;
+    }
+  if (m.n == 1 && m.names[0][common - 1] == '/')
+    ends = 0;
+
+  size_t more = common > len ? common - len : 0;
+  size_t used = strlen (buf);
+  if (!m.n)
+    BOOP;
+  else if (more || m.n == 1)
+    {
+      int space = m.n == 1 && ends && *cursor != ' ';
+      if (used + more + space < INPUT_BUFFER_SIZE)
+        {
+          extend_cursor (cursor, more + space);
+          memcpy (cursor, m.names[0] + len, more);
+          cursor += more;
+          if (space)
+            *cursor++ = ' ';
+        }
+      redraw (buf, cursor);
+    }
+  else
+    {
+      putc ('\n', stdout);
+      for (uint32_t i = 0; i < m.n; i++)
+        printf ("%s%s", m.names[i], i + 1 < m.n ? "  " : "\n");
+      redraw (buf, cursor);
+    }
+
+  for (uint32_t i = 0; i < m.n; i++)
+    free (m.names[i]);
+  free (m.names);
+  return cursor;
+}
+
+/* run the commands in a script (or piped in), a line at a time, without
+ * the line editor: blank lines and #comments are skipped, and each command
+ * is echoed after a prompt, as if it had been typed; non-zero if any
+ * failed */
+int
+run_script (program *prog, FILE *in)
+{
+  char *line = 0;
+  size_t size = 0;
+  int failed = 0;
+  while (getline (&line, &size, in) > 0)
+    {
+      line[strcspn (line, "\r\n")] = '\0';
+      char *cmd = line + strspn (line, " \t");
+      if (!*cmd || *cmd == '#')
+        continue;
+
+      printf (PROMPT_TEXT "%s\n", cmd);
+      fflush (stdout); // so it shows while it runs
+      cmd = strtok (cmd, " ");
+      char *args = strtok (0, " ");
+      int rc = process_command (prog, cmd, args);
+      if (rc == -1) // exit
+        break;
+      failed |= rc;
+    }
+  free (line);
+  return failed != 0;
+}
 
 int
 handle_interactive (program *prog)
 {
   char buf[INPUT_BUFFER_SIZE] = "", cpbuf[INPUT_BUFFER_SIZE] = "", c,
-       *cursor = buf;
+       *cursor = buf, typed[INPUT_BUFFER_SIZE] = "";
   int running = 1, rc = 0;
+  uint32_t back = 0; // how far back in the history we are (0: typing)
+
+  if (!isatty (STDIN_FILENO)) // there's nobody to edit lines
+    return run_script (prog, stdin);
 
   prompt (0);
   do
@@ -231,10 +1112,24 @@ handle_interactive (program *prog)
                 {
                   switch (c = getchar ())
                     {
-                      // TODO implement!
                     case 'A': // up arrow
-                      break;
                     case 'B': // down arrow
+                      {
+                        load_history ();
+                        if (c == 'A' ? back == history.n : back == 0)
+                          {
+                            BOOP;
+                            break;
+                          }
+                        if (c == 'A' && back == 0) // keep what's typed
+                          strcpy (typed, buf);
+                        back += c == 'A' ? 1 : -1;
+                        snprintf (buf, sizeof (buf), "%s",
+                                  back ? history_line (history.n - back)
+                                       : typed);
+                        cursor = buf + strlen (buf);
+                        redraw (buf, cursor);
+                      }
                       break;
                     case 'C': // right arrow
                       {
@@ -324,12 +1219,7 @@ handle_interactive (program *prog)
           break;
 
         case '\t':
-          {
-            // TODO match on existing input?
-            putc ('\n', stdout);
-            print_help (buf);
-            prompt (buf);
-          }
+          cursor = complete (prog, buf, cursor);
           break;
 
         case '\n':
@@ -337,6 +1227,9 @@ handle_interactive (program *prog)
             putc (c, stdout);
             if (*buf) // we have existing input
               {
+                add_history (buf);
+                back = 0;
+
                 // TODO handle this better
                 char *cmd = strtok (buf, " ");
                 char *args = strtok (0, " ");
@@ -383,5 +1276,6 @@ handle_interactive (program *prog)
     }
   while (running);
 
+  free_history ();
   return rc;
 }
@@ -0,0 +1,267 @@
+#include "program.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Intrinsics are host implementations of subroutines that programs commonly
+ * carry their own copies of, and spend most of their time in. We know each
+ * one by its exact body: at load time, every subroutine entry point (every
+ * JSR target control flow recovery finds, and every label) is hashed and
+ * compared against the table below. A JSR/JSRR to one of them then runs the
+ * host version instead, which leaves registers, memory (stack slots
+ * included), condition codes and the instruction count just as the LC-3
+ * code would have, and returns.
+ *
+ * A host version can decline a call (say, arguments it would take a loop to
+ * reproduce exactly), in which case the LC-3 code runs as usual. */
+
+/* runs the routine at entry with the machine as it is on arrival; returns
+ * the instructions it would have retired (RET included), or 0 to decline */
+typedef uint64_t (*native) (program *prog, uint16_t entry);
+
+static int
+negative (uint16_t val)
+{
+  return val >> 15;
+}
+
+/* r0 = r0 * r1 by shift and add, saving r1-r4 on the stack (2048.asm) */
+static uint64_t
+mult (program *prog, uint16_t entry)
+{
+  uint16_t *reg = prog->reg, sp = reg[R_R6];
+
+  if (!reg[R_R0] || !reg[R_R1])
+    {
+      uint64_t n = reg[R_R0] ? 6 : 4;
+      reg[R_R0] = 0;
+      reg[R_COND] = FL_ZRO;
+      return n;
+    }
+
+  // the loop runs out of tester bits before it gets to bit 15
+  uint16_t a = reg[R_R0] & 0x7FFF;
+  int bits = 0;
+  for (uint16_t b = a; b; b &= b - 1)
+    bits++;
+
+  mem_write (prog, sp - 1, reg[R_R1]);
+  mem_write (prog, sp - 2, reg[R_R2]);
+  mem_write (prog, sp - 3, reg[R_R3]);
+  mem_write (prog, sp - 4, reg[R_R4]);
+  reg[R_R0] = (uint32_t)a * reg[R_R1];
+  update_flags (reg, R_R6);
+  return 93 + bits;
+}
+
+/* r0 = r0 % r1, r1 = r0 / r1 by repeated subtraction, saving r1-r3 on the
+ * stack (2048.asm) */
+static uint64_t
+mod_div (program *prog, uint16_t entry)
+{
+  uint16_t *reg = prog->reg, sp = reg[R_R6];
+  uint16_t x = reg[R_R0], d = reg[R_R1];
+
+  // division by zero halts; anything else non-positive is odd enough that
+  // we'd rather not second-guess the loop
+  if (!x || negative (x) || !d || negative (d))
+    return 0;
+
+  mem_write (prog, sp - 1, d);
+  mem_write (prog, sp - 2, reg[R_R2]);
+  mem_write (prog, sp - 3, reg[R_R3]);
+  reg[R_R0] = x % d;
+  reg[R_R1] = x / d;
+  update_flags (reg, R_R6);
+  // an inexact division goes round once more, then backs it out
+  return (reg[R_R0] ? 19 : 13) + 3 * (uint64_t)reg[R_R1];
+}
+
+/* r0 = r0 % r1 by repeated subtraction, leaving r1 = -r1 and saving r2-r5
+ * and r7 on the stack (rogue.asm) */
+static uint64_t
+modulo (program *prog, uint16_t entry)
+{
+  uint16_t *reg = prog->reg, sp = reg[R_R6];
+  uint16_t x = reg[R_R0], q = reg[R_R1];
+
+  if (q && (negative (x) || negative (q)))
+    return 0;
+
+  mem_write (prog, sp - 1, reg[R_R2]);
+  mem_write (prog, sp - 2, reg[R_R3]);
+  mem_write (prog, sp - 3, reg[R_R4]);
+  mem_write (prog, sp - 4, reg[R_R5]);
+  mem_write (prog, sp - 5, reg[R_R7]);
+  reg[R_R1] = -q;
+  update_flags (reg, R_R6);
+  if (!q)
+    return 16;
+
+  reg[R_R0] = x % q;
+  return 18 + 3 * (uint64_t)(x / q);
+}
+
+/* r0 = seed = (a * seed + c) & m, with the multiplication done by repeated
+ * addition, saving r1-r5 and r7 on the stack (rogue.asm) */
+static uint64_t
+rand_lcg (program *prog, uint16_t entry)
+{
+  uint16_t *reg = prog->reg, sp = reg[R_R6];
+  // the data follows the code, where the matched LDs say it is
+  uint16_t seed = prog->mem[(uint16_t)(entry + 26)],
+           a = prog->mem[(uint16_t)(entry + 27)],
+           c = prog->mem[(uint16_t)(entry + 28)],
+           m = prog->mem[(uint16_t)(entry + 29)];
+
+  if (!a || negative (a))
+    return 0;
+
+  mem_write (prog, sp - 1, reg[R_R1]);
+  mem_write (prog, sp - 2, reg[R_R2]);
+  mem_write (prog, sp - 3, reg[R_R3]);
+  mem_write (prog, sp - 4, reg[R_R4]);
+  mem_write (prog, sp - 5, reg[R_R5]);
+  mem_write (prog, sp - 6, reg[R_R7]);
+  reg[R_R0] = ((uint16_t)((uint32_t)a * seed) + c) & m;
+  mem_write (prog, entry + 26, reg[R_R0]);
+  update_flags (reg, R_R6);
+  return 23 + 3 * (uint64_t)a;
+}
+
+static const uint16_t mult_body[] = {
+  0x1020, 0x0416, 0x1260, 0x0414, 0x73BF, 0x75BE, 0x77BD, 0x79BC, 0x1DBC,
+  0x54A0, 0x16A1, 0x5803, 0x0C01, 0x1481, 0x1241, 0x16C3, 0x03FA, 0x10A0,
+  0x6980, 0x6781, 0x6582, 0x6383, 0x1DA4, 0xC1C0, 0x5020, 0xC1C0
+};
+
+static const uint16_t mod_div_body[] = {
+  0x73BF, 0x75BE, 0x77BD, 0x1DBD, 0x947F, 0x14A1, 0x040C,
+  0x5260, 0x1261, 0x1002, 0x03FD, 0x0403, 0x6582, 0x127F,
+  0x1002, 0x6780, 0x6581, 0x1DA3, 0xC1C0, 0xF025
+};
+
+static const uint16_t modulo_body[] = {
+  0x75BF, 0x77BE, 0x79BD, 0x7BBC, 0x7FBB, 0x1DBB, 0x927F,
+  0x1261, 0x0405, 0x1401, 0x0803, 0x1001, 0x1401, 0x07FD,
+  0x6F80, 0x6B81, 0x6982, 0x6783, 0x6584, 0x1DA5, 0xC1C0
+};
+
+// followed by four words of data: seed, a, c and m
+static const uint16_t rand_body[] = {
+  0x73BF, 0x75BE, 0x77BD, 0x79BC, 0x7BBB, 0x7FBA, 0x1DBA, 0x2213, 0x2411,
+  0x5020, 0x1002, 0x127F, 0x03FD, 0x220E, 0x1001, 0x220D, 0x5001, 0x3008,
+  0x6F80, 0x6B81, 0x6982, 0x6783, 0x6584, 0x6385, 0x1DA6, 0xC1C0
+};
+
+#define ROUTINE(name, body, fn) { name, body, sizeof (body) / 2, fn }
+
+static const struct
+{
+  const char *name;
+  const uint16_t *body;
+  uint16_t len;
+  native fn;
+} routines[] = {
+  ROUTINE ("MULT", mult_body, mult),
+  ROUTINE ("MOD_DIV", mod_div_body, mod_div),
+  ROUTINE ("MODULO", modulo_body, modulo),
+  ROUTINE ("RAND", rand_body, rand_lcg),
+};
+
+#define NROUTINES (sizeof (routines) / sizeof (routines[0]))
+
+/* FNV-1a, a word at a time */
+static uint32_t
+hash (const uint16_t *words, uint16_t len)
+{
+  uint32_t h = 2166136261u;
+  for (uint16_t i = 0; i < len; i++)
+    h = (h ^ words[i]) * 16777619u;
+  return h;
+}
+
+intrinsics *
+find_intrinsics (program *prog)
+{
+  intrinsics *natives = calloc (1, sizeof (intrinsics));
+  cfg *g = build_cfg (prog, 0x3000);
+  if (!natives || !g)
+    {
+      free (natives);
+      free_cfg (g);
+      return 0;
+    }
+
+  uint32_t sums[NROUTINES];
+  for (size_t r = 0; r < NROUTINES; r++)
+    sums[r] = hash (routines[r].body, routines[r].len);
+
+  for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+      if (!(g->kind[addr] & W_ENTRY) && !prog->sym[addr])
+        continue;
+
+      for (size_t r = 0; r < NROUTINES; r++)
+        {
+          uint16_t len = routines[r].len;
+          if (addr + len > MEMORY_MAX
+              || hash (prog->mem + addr, len) != sums[r]
+              || memcmp (prog->mem + addr, routines[r].body, 2 * len) != 0)
+            continue;
+
+          if (natives->nfound == sizeof (natives->found)
+                                     / sizeof (natives->found[0]))
+            break;
+          natives->found[natives->nfound].addr = addr;
+          natives->found[natives->nfound].routine = r;
+          natives->at[addr] = ++natives->nfound;
+          break;
+        }
+    }
+
+  free_cfg (g);
+  return natives;
+}
+
+/* called with PC at the target of a JSR/JSRR: returns the number of
+ * instructions run natively (PC is then back at the caller), or 0 if the
+ * LC-3 code should run */
+uint64_t
+call_intrinsic (program *prog)
+{
+  intrinsics *natives = prog->natives;
+  uint16_t entry = prog->reg[R_PC];
+  if (!natives->at[entry])
+    return 0;
+
+  uint8_t i = natives->at[entry] - 1;
+  uint64_t n = routines[natives->found[i].routine].fn (prog, entry);
+  if (n)
+    {
+      natives->found[i].hits++;
+      natives->found[i].retired += n;
+      prog->reg[R_PC] = prog->reg[R_R7]; // RET
+    }
+  return n;
+}
+
+uint16_t
+dump_intrinsics (FILE *out, program *prog)
+{
+  intrinsics *natives = prog->natives;
+
+  fprintf (out, "%-8s%-16s%-16s%12s%16s\n", "# entry", "routine", "label",
+           "hits", "instructions");
+  for (uint32_t i = 0; i < natives->nfound; i++)
+    {
+      uint16_t addr = natives->found[i].addr;
+      fprintf (out, "x%04X   %-16s%-16s%12lu%16lu\n", addr,
+               routines[natives->found[i].routine].name,
+               prog->sym[addr] ? prog->sym[addr]->label : "-",
+               (unsigned long)natives->found[i].hits,
+               (unsigned long)natives->found[i].retired);
+    }
+
+  return 0;
+}
@@ -0,0 +1,314 @@
+#include "program.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix only */
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Input logs are plain text, one consumed character per line:
+ *
+ *   <instruction count> <character code>
+ *
+ * where the instruction count is that of the instruction that consumed it
+ * (a GETC/IN trap, or the load from KBSR that found a key waiting). Lines
+ * starting with # are ignored.
+ *
+ * Under a debugger every key consumed is also kept in memory, and while it
+ * re-runs the machine's past (see debug.c) the keys come from there. */
+
+static uint16_t
+check_key ()
+{
+  fd_set readfds;
+  FD_ZERO (&readfds);
+  FD_SET (STDIN_FILENO, &readfds);
+
+  struct timeval timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 0;
+  return select (1, &readfds, NULL, NULL, &timeout) != 0;
+}
+
+/* queue up the next event from the replay log */
+static void
+next_event (input *in)
+{
+  char buf[256];
+  unsigned long long icount;
+  int c;
+
+  while (fgets (buf, sizeof (buf), in->replay))
+    {
+      if (*buf == '#' || *buf == '\n')
+        continue;
+      if (sscanf (buf, "%llu %d", &icount, &c) == 2)
+        {
+          in->next = icount;
+          in->ch = c;
+          return;
+        }
+      fprintf (stderr, "warning: ignoring bad input log line: %s", buf);
+    }
+
+  in->next = UINT64_MAX; // nothing left to replay
+  in->ch = EOF;
+}
+
+input *
+open_input (FILE *record, FILE *replay)
+{
+  input *in = calloc (1, sizeof (input));
+  if (!in)
+    return 0;
+
+  in->record = record;
+  in->replay = replay;
+  if (record)
+    fprintf (record, "# lc3vm input log: <instruction count> <character>\n");
+  if (replay)
+    next_event (in);
+
+  return in;
+}
+
+/* skip replayed input consumed before icount (e.g. ahead of a snapshot) */
+void
+seek_input (input *in, uint64_t icount)
+{
+  while (in->replay && in->next < icount)
+    next_event (in);
+}
+
+void
+close_input (input *in)
+{
+  free (in);
+}
+
+/* keep a key for the debugger to hand back when it re-runs the past */
+static void
+log_key (debug *dbg, uint64_t icount, int c)
+{
+  if (dbg->nkeys == dbg->maxkeys)
+    {
+      uint32_t max = dbg->maxkeys ? dbg->maxkeys * 2 : 64;
+      keypress *keys = realloc (dbg->keys, max * sizeof (keypress));
+      if (!keys)
+        {
+          fprintf (stderr, "warning: out of memory logging input\n");
+          return;
+        }
+      dbg->keys = keys;
+      dbg->maxkeys = max;
+    }
+  dbg->keys[dbg->nkeys].icount = icount;
+  dbg->keys[dbg->nkeys++].ch = c;
+  dbg->nextkey = dbg->nkeys;
+}
+
+int
+key_ready (program *prog)
+{
+  debug *dbg = prog->debug;
+  if (dbg && dbg->nextkey < dbg->nkeys) // re-running the past
+    return prog->icount >= dbg->keys[dbg->nextkey].icount;
+  if (prog->input && prog->input->replay)
+    return prog->icount >= prog->input->next;
+  if (prog->input && prog->input->from)
+    return 1; // like a pipe: there's either a character or EOF waiting
+
+  return check_key ();
+}
+
+/* the instruction count the next replayed key is due at, or UINT64_MAX if
+ * keys come as they're typed */
+uint64_t
+key_due (program *prog)
+{
+  debug *dbg = prog->debug;
+  if (dbg && dbg->nextkey < dbg->nkeys)
+    return dbg->keys[dbg->nextkey].icount;
+  if (prog->input && prog->input->replay)
+    return prog->input->next;
+  return UINT64_MAX;
+}
+
+uint16_t
+read_key (program *prog)
+{
+  input *in = prog->input;
+  debug *dbg = prog->debug;
+  int c;
+
+  flush_output (1); // whatever prompted for this
+  if (dbg && dbg->nextkey < dbg->nkeys)
+    return (uint16_t)dbg->keys[dbg->nextkey++].ch;
+  if (in && in->replay)
+    {
+      if (in->next != UINT64_MAX && in->next != prog->icount)
+        fprintf (stderr,
+                 "warning: replay diverged: input logged at instruction %llu "
+                 "consumed at %llu\n",
+                 (unsigned long long)in->next,
+                 (unsigned long long)prog->icount);
+      c = in->ch;
+      next_event (in);
+    }
+  else if (in && in->from)
+    c = getc (in->from);
+  else
+    c = getchar ();
+
+  if (in && in->record)
+    fprintf (in->record, "%llu %d\n", (unsigned long long)prog->icount, c);
+  if (dbg)
+    log_key (dbg, prog->icount, c);
+
+  return (uint16_t)c;
+}
+
+/* Output goes through stdout's buffer (or whatever stream set_output
+ * picked instead), which is flushed once flush_every characters are waiting
+ * (checked at the end of each trap or DDR write), and whenever the machine
+ * could block or stops. */
+static unsigned flush_every = 1, unflushed;
+static FILE *output;
+
+#define OUTPUT (output ? output : stdout)
+
+void
+set_flush (unsigned every)
+{
+  flush_every = every;
+  if (every != 1) // we'll decide when, even on a terminal
+    setvbuf (stdout, 0, _IOFBF, BUFSIZ);
+}
+
+/* send output to out from now on (0 for stdout) */
+void
+set_output (FILE *out)
+{
+  flush_output (1);
+  output = out;
+}
+
+void
+put_char (uint16_t c)
+{
+  putc ((char)c, OUTPUT);
+  unflushed++;
+}
+
+/* flush if enough is waiting, or if force is set and anything is */
+void
+flush_output (int force)
+{
+  if (unflushed && (force || (flush_every && unflushed >= flush_every)))
+    {
+      fflush (OUTPUT);
+      unflushed = 0;
+    }
+}
+
+/* Without an OS image every TRAP runs natively. With one, a TRAP goes
+ * through the vector table in memory, unless its entry (and those of the
+ * routines the OS image's version calls) still points where the image left
+ * it, in which case the native version stands in for the image's. */
+
+#define STOCK(vector) (1 << ((vector) - TRAP_GETC))
+
+// the standard traps each routine relies on, itself included
+static const uint8_t uses[] = {
+  [TRAP_GETC - TRAP_GETC] = STOCK (TRAP_GETC),
+  [TRAP_OUT - TRAP_GETC] = STOCK (TRAP_OUT),
+  [TRAP_PUTS - TRAP_GETC] = STOCK (TRAP_PUTS) | STOCK (TRAP_OUT),
+  [TRAP_IN - TRAP_GETC] = STOCK (TRAP_IN) | STOCK (TRAP_PUTS)
+                          | STOCK (TRAP_GETC) | STOCK (TRAP_OUT),
+  [TRAP_PUTSP - TRAP_GETC] = STOCK (TRAP_PUTSP) | STOCK (TRAP_OUT),
+  [TRAP_HALT - TRAP_GETC] = STOCK (TRAP_HALT),
+};
+
+/* whether a TRAP through vector can run natively */
+int
+native_trap (program *prog, uint16_t vector)
+{
+  if (!prog->os)
+    return 1;
+  if (vector < TRAP_GETC || vector > TRAP_HALT)
+    return prog->mem[vector] == prog->os[vector];
+
+  for (uint16_t v = TRAP_GETC; v <= TRAP_HALT; v++)
+    if ((uses[vector - TRAP_GETC] & STOCK (v))
+        && prog->mem[v] != prog->os[v])
+      return 0;
+  return 1;
+}
+
+/* the trap routines, implemented natively; returns non-zero on HALT */
+uint16_t
+execute_trap (program *prog, uint16_t vector)
+{
+  uint16_t *memory = prog->mem;
+  uint16_t *reg = prog->reg;
+
+  switch (vector)
+    {
+    case TRAP_GETC:
+      /* read a single ASCII char */
+      reg[R_R0] = read_key (prog);
+      update_flags (reg, R_R0);
+      break;
+    case TRAP_OUT:
+      put_char (reg[R_R0]);
+      break;
+    case TRAP_PUTS:
+      {
+        /* one char per word */
+        uint16_t *c = memory + reg[R_R0];
+        while (*c)
+          {
+            put_char (*c);
+            ++c;
+          }
+      }
+      break;
+    case TRAP_IN:
+      {
+        for (const char *p = "Enter a character: "; *p; p++)
+          put_char (*p);
+        char c = read_key (prog);
+        put_char (c);
+        reg[R_R0] = (uint16_t)c;
+        update_flags (reg, R_R0);
+      }
+      break;
+    case TRAP_PUTSP:
+      {
+        /* one char per byte (two bytes per word)
+           here we need to swap back to
+           big endian format */
+        uint16_t *c = memory + reg[R_R0];
+        while (*c)
+          {
+            char char1 = (*c) & 0xFF;
+            put_char (char1);
+            char char2 = (*c) >> 8;
+            if (char2)
+              put_char (char2);
+            ++c;
+          }
+      }
+      break;
+    case TRAP_HALT:
+      // puts("HALT");
+      // fflush(stdout);
+      flush_output (1);
+      return 1;
+    }
+
+  flush_output (0);
+  return 0;
+}
@@ -0,0 +1,404 @@
+#define PROGRAM_NAME "lc3aot"
+#define PROGRAM_DESCRIPTION "an LC-3 ahead-of-time compiler"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#define HELP_POSTAMBLE "Report bugs to <" PACKAGE_BUGREPORT ">."
+#else
+#define PACKAGE_VERSION "unknown"
+#endif
+
+#define VERSION_STRING PROGRAM_NAME " " PACKAGE_VERSION
+
+#include "popt/popt.h"
+#include "program.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HELP_PREAMBLE                                                         \
+  "Translate object code to C. The result builds against program.h and io.c " \
+  "\nfrom this package, e.g.:\n\n"                                            \
+  "  cc -I lc3 -o prog prog.c lc3/io.c\n\n"                                   \
+  "If FILE is not provided this program will read from stdin."
+
+#define ERR_EXIT(args...)                                                     \
+  do                                                                          \
+    {                                                                         \
+      fprintf (stderr, "error: ");                                            \
+      fprintf (stderr, args);                                                 \
+      fprintf (stderr, "\n");                                                 \
+      poptPrintHelp (optCon, stderr, 0);                                      \
+      poptFreeContext (optCon);                                               \
+      exit (1);                                                               \
+    }                                                                         \
+  while (0)
+
+static void
+emit_prologue (FILE *out, program *prog, const char *name)
+{
+  fprintf (out,
+           "/* translated from %s by " VERSION_STRING "; do not edit */\n"
+           "\n"
+           "#include \"program.h\"\n"
+           "\n"
+           "#include <signal.h>\n"
+           "#include <stdio.h>\n"
+           "#include <stdlib.h>\n"
+           "#include <string.h>\n"
+           "/* unix only */\n"
+           "#include <sys/termios.h>\n"
+           "#include <unistd.h>\n"
+           "\n",
+           name);
+
+  fprintf (out, "static const uint16_t image[] = {");
+  for (int i = 0; i < prog->len; i++)
+    fprintf (out, "%s0x%04X,", (i % 8) ? " " : "\n  ",
+             prog->mem[prog->orig + i]);
+  fprintf (out, "\n};\n\n");
+
+  fprintf (out,
+           "static program prog;\n"
+           "static struct termios original_tio;\n"
+           "\n"
+           "static void\n"
+           "restore_input_buffering ()\n"
+           "{\n"
+           "  tcsetattr (STDIN_FILENO, TCSANOW, &original_tio);\n"
+           "}\n"
+           "\n"
+           "static void\n"
+           "handle_interrupt (int signal)\n"
+           "{\n"
+           "  restore_input_buffering ();\n"
+           "  printf (\"\\n\");\n"
+           "  exit (-2);\n"
+           "}\n"
+           "\n"
+           "static inline uint16_t\n"
+           "rd (uint16_t addr)\n"
+           "{\n"
+           "  if (addr == MR_KBSR && !(prog.mem[MR_KBSR] & DS_READY)\n"
+           "      && key_ready (&prog))\n"
+           "    {\n"
+           "      prog.mem[MR_KBSR] |= DS_READY;\n"
+           "      prog.mem[MR_KBDR] = read_key (&prog);\n"
+           "    }\n"
+           "  else if (addr == MR_KBDR)\n"
+           "    prog.mem[MR_KBSR] &= ~DS_READY;\n"
+           "  else if (addr == MR_DSR)\n"
+           "    return DS_READY;\n"
+           "  return prog.mem[addr];\n"
+           "}\n"
+           "\n"
+           "static inline void\n"
+           "wr (uint16_t addr, uint16_t val)\n"
+           "{\n"
+           "  prog.mem[addr] = val;\n"
+           "  if (addr == MR_DDR)\n"
+           "    {\n"
+           "      put_char (val);\n"
+           "      flush_output (0);\n"
+           "    }\n"
+           "}\n"
+           "\n"
+           "#define RD(a) rd ((uint16_t)(a))\n"
+           "#define WR(a, v) wr ((uint16_t)(a), (v))\n"
+           "#define CC(v) (cc = !(v) ? FL_ZRO : ((v) >> 15) ? FL_NEG : "
+           "FL_POS)\n"
+           "\n");
+}
+
+/* emit one instruction; returns non-zero if control can fall through */
+static int
+emit_inst (FILE *out, program *prog, uint16_t addr)
+{
+  uint16_t word = prog->mem[addr], next = addr + 1;
+  int dr = (word >> 9) & 0x7, sr = (word >> 6) & 0x7;
+  int16_t imm5 = SIGN_EXTEND (word & 0x1F, 5);
+  uint16_t off6 = SIGN_EXTEND (word & 0x3F, 6);
+  uint16_t pcrel = next + SIGN_EXTEND (word & 0x1FF, 9);
+
+  switch (word >> 12)
+    {
+    case OP_ADD:
+    case OP_AND:
+      {
+        const char *op = (word >> 12) == OP_ADD ? "+" : "&";
+        if (word & 0x20)
+          fprintf (out, "  r%d = r%d %s 0x%04X;\n", dr, sr, op,
+                   (uint16_t)imm5);
+        else
+          fprintf (out, "  r%d = r%d %s r%d;\n", dr, sr, op, word & 0x7);
+        fprintf (out, "  CC (r%d);\n", dr);
+      }
+      return 1;
+    case OP_NOT:
+      fprintf (out, "  r%d = ~r%d;\n  CC (r%d);\n", dr, sr, dr);
+      return 1;
+    case OP_BR:
+      {
+        int nzp = (word >> 9) & 0x7;
+        if (nzp == 0x7)
+          {
+            fprintf (out, "  goto L%04X;\n", pcrel);
+            return 0;
+          }
+        if (nzp)
+          fprintf (out, "  if (cc & %d)\n    goto L%04X;\n", nzp, pcrel);
+      }
+      return 1;
+    case OP_JMP:
+      fprintf (out, "  target = r%d;\n  goto dispatch;\n", sr);
+      return 0;
+    case OP_JSR:
+      if (word & 0x0800)
+        {
+          fprintf (out, "  r7 = 0x%04X;\n  goto L%04X;\n", next,
+                   (uint16_t)(next + SIGN_EXTEND (word & 0x7FF, 11)));
+        }
+      else // R7 first, so JSRR R7 does what the VM does
+        fprintf (out, "  r7 = 0x%04X;\n  target = r%d;\n  goto dispatch;\n",
+                 next, sr);
+      return 0;
+    case OP_LD:
+      fprintf (out, "  r%d = RD (0x%04X);\n  CC (r%d);\n", dr, pcrel, dr);
+      return 1;
+    case OP_LDI:
+      fprintf (out, "  r%d = RD (RD (0x%04X));\n  CC (r%d);\n", dr, pcrel,
+               dr);
+      return 1;
+    case OP_LDR:
+      fprintf (out, "  r%d = RD (r%d + 0x%04X);\n  CC (r%d);\n", dr, sr, off6,
+               dr);
+      return 1;
+    case OP_LEA:
+      fprintf (out, "  r%d = 0x%04X;\n  CC (r%d);\n", dr, pcrel, dr);
+      return 1;
+    case OP_ST:
+      fprintf (out, "  WR (0x%04X, r%d);\n", pcrel, dr);
+      return 1;
+    case OP_STI:
+      fprintf (out, "  WR (RD (0x%04X), r%d);\n", pcrel, dr);
+      return 1;
+    case OP_STR:
+      fprintf (out, "  WR (r%d + 0x%04X, r%d);\n", sr, off6, dr);
+      return 1;
+    case OP_TRAP: // traps work on prog's registers
+      fprintf (out,
+               "  prog.reg[R_R0] = r0, prog.reg[R_COND] = cc;\n"
+               "  prog.reg[R_R7] = r7 = 0x%04X;\n"
+               "  if (execute_trap (&prog, 0x%02X) != 0)\n"
+               "    return 0;\n"
+               "  r0 = prog.reg[R_R0], cc = prog.reg[R_COND];\n",
+               next, word & 0xFF);
+      return (word & 0xFF) != TRAP_HALT;
+    default: // RTI, RES
+      fprintf (out, "  return -1;\n");
+      return 0;
+    }
+}
+
+static void
+emit_program (FILE *out, program *prog, cfg *g, const char *name)
+{
+  emit_prologue (out, prog, name);
+
+  fprintf (out, "static uint16_t\n"
+                "run ()\n"
+                "{\n"
+                "  uint16_t r0 = 0, r1 = 0, r2 = 0, r3 = 0, r4 = 0, r5 = 0, "
+                "r6 = 0, r7 = 0;\n"
+                "  uint16_t cc = FL_ZRO, target;\n"
+                "  (void)r1, (void)r2, (void)r3, (void)r4, (void)r5, "
+                "(void)r6;\n"
+                "  goto L%04X;\n\n",
+           prog->orig); // where lc3vm starts a lone program
+
+  /* computed dispatch for JMP/JSRR/RET */
+  fprintf (out, "dispatch:\n  switch (target)\n    {\n");
+  for (uint32_t i = 0; i < g->nblocks; i++)
+    fprintf (out, "    case 0x%04X:\n      goto L%04X;\n", g->blocks[i].start,
+             g->blocks[i].start);
+  fprintf (out, "    }\n"
+                "  fprintf (stderr, \"error: jump to x%%04X, which wasn't "
+                "translated\\n\", target);\n"
+                "  return 1;\n");
+
+  int falls = 0;
+  for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+      if (!(g->kind[addr] & W_CODE))
+        continue;
+      char disasm[4096] = "";
+      disassemble_addr (disasm, 0, addr, prog);
+      if (strstr (disasm, "*/"))
+        *disasm = 0;
+      fprintf (out, "%s/* x%04X  %s */\n",
+               (g->kind[addr] & W_LEADER) ? "\n" : "", addr, disasm);
+      if (g->kind[addr] & W_LEADER)
+        fprintf (out, "L%04X:\n", addr);
+      falls = emit_inst (out, prog, addr);
+    }
+  if (falls) // ran off the end of memory
+    fprintf (out, "  goto L0000;\n");
+  fprintf (out, "}\n\n");
+
+  fprintf (out, "int\n"
+                "main (int argc, const char *argv[])\n"
+                "{\n"
+                "  memcpy (prog.mem + 0x%04X, image, sizeof (image));\n"
+                "\n"
+                "  signal (SIGINT, handle_interrupt);\n"
+                "  tcgetattr (STDIN_FILENO, &original_tio);\n"
+                "  struct termios new_tio = original_tio;\n"
+                "  new_tio.c_lflag &= ~ICANON & ~ECHO;\n"
+                "  tcsetattr (STDIN_FILENO, TCSANOW, &new_tio);\n"
+                "\n"
+                "  uint16_t rc = run ();\n"
+                "\n"
+                "  restore_input_buffering ();\n"
+                "  exit (rc);\n"
+                "}\n",
+           prog->orig);
+}
+
+int
+main (int argc, const char *argv[])
+{
+  poptContext optCon;
+  char *outfile = "-", *symbolfile = 0;
+  FILE *out = 0, *in = 0;
+
+  // hack for injecting preamble/postamble into the help message
+  struct poptOption emptyTable[] = { POPT_TABLEEND };
+
+  struct poptOption progOptions[] = {
+    /* longName, shortName, argInfo, arg, val, descrip, argDescript */
+    { "symbols", 'S', POPT_ARG_STRING, &symbolfile, 'S',
+      "read symbols (and code/data hints) from FILE", "FILE" },
+    { "output", 'o', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &outfile,
+      'o', "write output to FILE", "FILE" },
+    { "version", '\0', POPT_ARG_NONE, 0, 'V',
+      "show version information and exit", 0 },
+    POPT_TABLEEND
+  };
+
+  struct poptOption options[] = {
+#ifdef HELP_PREAMBLE
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &emptyTable, 0, HELP_PREAMBLE, 0 },
+#endif
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &progOptions, 0, "Options:", 0 },
+    POPT_AUTOHELP
+#ifdef HELP_POSTAMBLE
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &emptyTable, 0, HELP_POSTAMBLE, 0 },
+#endif
+    POPT_TABLEEND
+  };
+
+  optCon = poptGetContext (0, argc, argv, options, 0);
+  poptSetOtherOptionHelp (optCon, "[FILE]");
+
+  int rc;
+  while ((rc = poptGetNextOpt (optCon)) > 0)
+    {
+      switch (rc)
+        {
+        case 'o':
+          {
+            if (out)
+              {
+                ERR_EXIT ("more than one output file specified");
+              }
+            else if (strcmp (outfile, "-") == 0)
+              {
+                out = stdout;
+              }
+            else if (!(out = fopen (outfile, "w")))
+              {
+                ERR_EXIT ("couldn't open output file '%s': %s", outfile,
+                          strerror (errno));
+              }
+            free (outfile);
+          }
+          break;
+
+        case 'V':
+          {
+            printf (VERSION_STRING);
+            poptFreeContext (optCon);
+            exit (0);
+          }
+          break;
+        }
+    }
+
+  if (rc != -1)
+    {
+      ERR_EXIT ("%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS),
+                poptStrerror (rc));
+    }
+
+  const char *infile = poptGetArg (optCon);
+  if (poptGetArg (optCon))
+    {
+      ERR_EXIT ("more than one input file specified");
+    }
+  else if (!infile || strcmp (infile, "-") == 0)
+    {
+      infile = "-";
+      in = stdin;
+    }
+  else if (!(in = fopen (infile, "r")))
+    {
+      ERR_EXIT ("couldn't open input file '%s': %s", infile, strerror (errno));
+    }
+
+  program *prog = calloc (1, sizeof (program));
+  if (load_program (prog, in) != 0)
+    ERR_EXIT ("failed to load program: %s", infile);
+  if (in != stdin)
+    fclose (in);
+
+  if (symbolfile)
+    {
+      FILE *symin = fopen (symbolfile, "r");
+      if (!symin)
+        {
+          ERR_EXIT ("couldn't open symbol file '%s': %s", symbolfile,
+                    strerror (errno));
+        }
+      if (load_symbols (prog, symin) != 0)
+        ERR_EXIT ("failed to load symbols: %s", symbolfile);
+      fclose (symin);
+      free (symbolfile);
+      attach_symbols (prog);
+    }
+
+  if (!out)
+    out = stdout;
+
+  cfg *g = build_cfg (prog, prog->orig);
+  if (!g)
+    ERR_EXIT ("out of memory recovering control flow");
+  emit_program (out, prog, g, infile);
+  poptFreeContext (optCon);
+
+  rc = 0;
+  if (fflush (out) != 0)
+    {
+      fprintf (stderr, "error writing output: %s\n", strerror (errno));
+      rc = 1;
+    }
+  if (out != stdout)
+    fclose (out);
+
+  free_cfg (g);
+  free_symbols (prog);
+  free (prog);
+
+  exit (rc);
+}
@@ -47,7 +47,7 @@
 int
 main (int argc, const char *argv[])
 {
-  int rc, disassemble = 0, flags = FMT_OBJECT;
+  int rc, disassemble = 0, flags = FMT_OBJECT, cfgflag = 0, dotflag = 0;
   char *outfile = "-", *symbolfile = 0, *format = "object";
   FILE *out = 0, *in = 0, *symfp = 0;
 
@@ -66,6 +66,10 @@ main (int argc, const char *argv[])
             "also read/write symbols to/from FILE", "FILE" },
           { "output", 'o', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT,
             &outfile, 'o', "write output to FILE", "FILE" },
+          { "cfg", 'G', POPT_ARG_NONE, &cfgflag, 'G',
+            "print the control flow graph instead", 0 },
+          { "cfg-dot", '\0', POPT_ARG_NONE, &dotflag, 'G',
+            "...as a Graphviz digraph", 0 },
           { "version", '\0', POPT_ARG_NONE, 0, 'V',
             "show version information and exit", 0 },
           POPT_TABLEEND
@@ -246,20 +250,32 @@ main (int argc, const char *argv[])
     {
       if ((rc = disassemble_program (&prog, symfp, in)) != 0)
         goto cleanup;
-
-      rc = print_program (out, flags, &prog);
     }
   else
     {
       if ((rc = assemble_program (&prog, in)) != 0)
         goto cleanup;
 
-      rc = print_program (out, flags, &prog);
-
       if (symfp)
         dump_symbols (symfp, flags, &prog);
     }
 
+  if (cfgflag || dotflag)
+    {
+      cfg *g = build_cfg (&prog, prog.orig);
+      if (!g)
+        {
+          fprintf (stderr, "error: out of memory building control flow "
+                           "graph\n");
+          rc = 1;
+          goto cleanup;
+        }
+      rc = dotflag ? dump_cfg_dot (out, g, &prog) : dump_cfg (out, g, &prog);
+      free_cfg (g);
+    }
+  else
+    rc = print_program (out, flags, &prog);
+
 cleanup:
   fclose (in);
   fclose (out);
@@ -0,0 +1,370 @@
+#define PROGRAM_NAME "lc3bench"
+#define PROGRAM_DESCRIPTION "LC-3 interpreter microbenchmarks"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#define HELP_POSTAMBLE "Report bugs to <" PACKAGE_BUGREPORT ">."
+#else
+#define PACKAGE_VERSION "unknown"
+#endif
+
+#define VERSION_STRING PROGRAM_NAME " " PACKAGE_VERSION
+
+#include "popt/popt.h"
+#include "program.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HELP_PREAMBLE                                                         \
+  "If no NAME is given every benchmark is run. Each benchmark repeats a "     \
+  "single\nopcode class, either unrolled inside a tight loop (\"loop\") or "  \
+  "laid out as\none long straight line of code (\"line\")."
+
+#define ERR_EXIT(args...)                                                     \
+  do                                                                          \
+    {                                                                         \
+      fprintf (stderr, "error: ");                                            \
+      fprintf (stderr, args);                                                 \
+      fprintf (stderr, "\n");                                                 \
+      poptPrintHelp (optCon, stderr, 0);                                      \
+      poptFreeContext (optCon);                                               \
+      exit (1);                                                               \
+    }                                                                         \
+  while (0)
+
+#define BENCH_ORIG 0x3000
+#define BENCH_SCRATCH 0x8000
+#define LOOP_BODY 128     // body length; BRp back must fit in PCoffset9
+#define LINE_BODY 0x4000  // x3000-x6FFF, clear of the scratch area
+#define INST(op, bits) ((uint16_t)(((op) << 12) | (bits)))
+
+/* how a body word is generated */
+enum
+{
+  BK_WORD = 0, /* the same word over and over */
+  BK_JSR       /* JSR to a shared RET stub (offset depends on address) */
+};
+
+typedef struct bench
+{
+  const char *name, *desc;
+  int kind;
+  uint16_t word;
+  uint16_t r0;   // initial R0 (ST writes it back over itself)
+  int width;     // instructions retired per op
+  int scale;     // divide the iteration count by this (slow ops)
+  int loop_only; // can't be laid out as one long straight line
+} bench;
+
+/* registers at start: R0 per benchmark, R1 = 1, R2 = scratch, R3 = RET stub
+ * address, R6 = loop counter; R7 is clobbered by JSR/JSRR/TRAP */
+static bench bench_table[] = {
+  /* name, desc, kind, word, r0, width, scale, loop_only */
+  { "nop", "BR with no condition bits (never taken)", BK_WORD,
+    INST (OP_BR, 0), 0, 1, 1, 0 },
+  { "add-imm", "ADD R0, R0, #1", BK_WORD,
+    INST (OP_ADD, (0 << 9) | (0 << 6) | (1 << 5) | 1), 0, 1, 1, 0 },
+  { "add-reg", "ADD R0, R0, R1", BK_WORD,
+    INST (OP_ADD, (0 << 9) | (0 << 6) | 1), 0, 1, 1, 0 },
+  { "and-imm", "AND R0, R0, #-1", BK_WORD,
+    INST (OP_AND, (0 << 9) | (0 << 6) | (1 << 5) | 0x1F), 0, 1, 1, 0 },
+  { "and-reg", "AND R0, R0, R1", BK_WORD,
+    INST (OP_AND, (0 << 9) | (0 << 6) | 1), 0, 1, 1, 0 },
+  { "not", "NOT R0, R0", BK_WORD, INST (OP_NOT, (0 << 9) | (0 << 6) | 0x3F),
+    0, 1, 1, 0 },
+  { "lea", "LEA R0, #0", BK_WORD, INST (OP_LEA, 0 << 9), 0, 1, 1, 0 },
+  { "ld", "LD R0, #-1 (loads itself)", BK_WORD,
+    INST (OP_LD, (0 << 9) | 0x1FF), 0, 1, 1, 0 },
+  { "st", "ST R0, #-1 (stores itself back)", BK_WORD,
+    INST (OP_ST, (0 << 9) | 0x1FF), INST (OP_ST, (0 << 9) | 0x1FF), 1, 1, 0 },
+  { "ldr", "LDR R0, R2, #0", BK_WORD, INST (OP_LDR, (0 << 9) | (2 << 6)), 0,
+    1, 1, 0 },
+  { "str", "STR R0, R2, #0", BK_WORD, INST (OP_STR, (0 << 9) | (2 << 6)), 0,
+    1, 1, 0 },
+  { "ldi", "LDI R0, #-1 (double indirection via itself)", BK_WORD,
+    INST (OP_LDI, (0 << 9) | 0x1FF), 0, 1, 1, 0 },
+  { "sti", "STI R0, #-1 (double indirection via itself)", BK_WORD,
+    INST (OP_STI, (0 << 9) | 0x1FF), 0, 1, 1, 0 },
+  { "br-taken", "BRnzp #0", BK_WORD, INST (OP_BR, (7 << 9)), 0, 1, 1, 0 },
+  { "br-not-taken", "BRn #0 (condition is P)", BK_WORD,
+    INST (OP_BR, (4 << 9)), 0, 1, 1, 0 },
+  { "jsr-ret", "JSR to a RET stub (counts JSR+RET as one op)", BK_JSR, 0, 0,
+    2, 1, 1 },
+  { "jsrr-ret", "JSRR R3 to a RET stub (counts JSRR+RET as one op)", BK_WORD,
+    INST (OP_JSR, (3 << 6)), 0, 2, 1, 1 },
+  { "trap-out", "OUT to a null sink", BK_WORD, INST (OP_TRAP, TRAP_OUT), '.',
+    1, 64, 0 },
+  { 0 }
+};
+
+typedef struct result
+{
+  double ns;             // best wall-clock time of a single run
+  uint64_t instructions; // instructions retired per run
+  uint64_t ops;          // benchmarked ops per run
+} result;
+
+static double
+now_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* lay out a loop image: body, counter decrement, branch back, HALT, stub */
+static uint16_t
+build_loop (program *prog, bench *b, int body)
+{
+  uint16_t addr = BENCH_ORIG, stub = BENCH_ORIG + body + 3;
+
+  for (int i = 0; i < body; i++, addr++)
+    prog->mem[addr]
+        = (b->kind == BK_JSR)
+              ? INST (OP_JSR, (1 << 11) | ((stub - addr - 1) & 0x7FF))
+              : b->word;
+
+  prog->mem[addr++] = INST (OP_ADD, (6 << 9) | (6 << 6) | (1 << 5) | 0x1F);
+  prog->mem[addr]
+      = INST (OP_BR, (1 << 9) | ((BENCH_ORIG - addr - 1) & 0x1FF));
+  addr++;
+  prog->mem[addr++] = INST (OP_TRAP, TRAP_HALT);
+  prog->mem[addr++] = INST (OP_JMP, R_R7 << 6); // the RET stub
+  return stub;
+}
+
+/* lay out one long straight line of body words followed by HALT */
+static uint16_t
+build_line (program *prog, bench *b, int body)
+{
+  for (int i = 0; i < body; i++)
+    prog->mem[BENCH_ORIG + i] = b->word;
+  prog->mem[BENCH_ORIG + body] = INST (OP_TRAP, TRAP_HALT);
+  return BENCH_ORIG + body; // no stub
+}
+
+static int
+run_bench (program *prog, vmimage *pristine, bench *b, int line, int body,
+           int iterations, int repeat, result *res)
+{
+  if (reset_program (prog, pristine) != 0)
+    return 1;
+  uint16_t stub = line ? build_line (prog, b, body)
+                       : build_loop (prog, b, body);
+  mark_dirty (prog, BENCH_ORIG, stub - BENCH_ORIG + 1);
+
+  /* both shapes execute roughly the same number of ops: the line shape
+   * re-runs the image instead of looping inside it */
+  int runs = line ? (iterations / b->scale) * LOOP_BODY / LINE_BODY : 1;
+  int count = line ? 1 : (iterations / b->scale);
+  if (runs < 1)
+    runs = 1;
+  if (count < 1)
+    count = 1;
+
+  res->ns = 0;
+  res->ops = (uint64_t)body * count * runs;
+  res->instructions
+      = line ? ((uint64_t)body * b->width + 1) * runs
+             : ((uint64_t)body * b->width + 2) * count + 1;
+
+  /* send TRAP output to a null sink so we measure the VM, not the tty */
+  fflush (stdout);
+  int saved = dup (STDOUT_FILENO), null = open ("/dev/null", O_WRONLY);
+  if (saved < 0 || null < 0)
+    {
+      fprintf (stderr, "error: couldn't redirect stdout: %s\n",
+               strerror (errno));
+      return 1;
+    }
+  dup2 (null, STDOUT_FILENO);
+  close (null);
+
+  int rc = 0;
+  for (int r = 0; r < repeat && rc == 0; r++)
+    {
+      double start = now_ns ();
+      for (int i = 0; i < runs && rc == 0; i++)
+        {
+          prog->reg[R_R0] = b->r0;
+          prog->reg[R_R1] = 1;
+          prog->reg[R_R2] = BENCH_SCRATCH;
+          prog->reg[R_R3] = stub;
+          prog->reg[R_R6] = count;
+          rc = execute_program (prog);
+        }
+      double elapsed = now_ns () - start;
+      if (r == 0 || elapsed < res->ns)
+        res->ns = elapsed;
+    }
+
+  fflush (stdout);
+  dup2 (saved, STDOUT_FILENO);
+  close (saved);
+
+  if (rc != 0)
+    fprintf (stderr, "error: %s (%s) did not halt cleanly\n", b->name,
+             line ? "line" : "loop");
+  return rc;
+}
+
+int
+main (int argc, const char *argv[])
+{
+  poptContext optCon;
+  int iterations = 20000, repeat = 5, list = 0;
+  char *shape = "all";
+
+  // hack for injecting preamble/postamble into the help message
+  struct poptOption emptyTable[] = { POPT_TABLEEND };
+
+  struct poptOption progOptions[] = {
+    /* longName, shortName, argInfo, arg, val, descrip, argDescript */
+    { "iterations", 'n', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT,
+      &iterations, 'n', "loop iterations per run (line runs as many ops)",
+      "N" },
+    { "repeat", 'r', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &repeat, 'r',
+      "runs per benchmark; the fastest is reported", "N" },
+    { "shape", 's', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &shape, 's',
+      "code shape to run: loop, line or all", "SHAPE" },
+    { "list", 'l', POPT_ARG_NONE, &list, 'l',
+      "list available benchmarks and exit", 0 },
+    { "version", '\0', POPT_ARG_NONE, 0, 'V',
+      "show version information and exit", 0 },
+    POPT_TABLEEND
+  };
+
+  struct poptOption options[] = {
+#ifdef HELP_PREAMBLE
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &emptyTable, 0, HELP_PREAMBLE, 0 },
+#endif
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &progOptions, 0, "Options:", 0 },
+    POPT_AUTOHELP
+#ifdef HELP_POSTAMBLE
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &emptyTable, 0, HELP_POSTAMBLE, 0 },
+#endif
+    POPT_TABLEEND
+  };
+
+  optCon = poptGetContext (0, argc, argv, options, 0);
+  poptSetOtherOptionHelp (optCon, "[NAME...]");
+
+  int rc, shapes = 0;
+  while ((rc = poptGetNextOpt (optCon)) > 0)
+    {
+      switch (rc)
+        {
+        case 'V':
+          {
+            printf (VERSION_STRING);
+            poptFreeContext (optCon);
+            exit (0);
+          }
+          break;
+        }
+    }
+
+  if (rc != -1)
+    {
+      ERR_EXIT ("%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS),
+                poptStrerror (rc));
+    }
+
+  if (strcmp (shape, "loop") == 0)
+    shapes = 1;
+  else if (strcmp (shape, "line") == 0)
+    shapes = 2;
+  else if (strcmp (shape, "all") == 0)
+    shapes = 3;
+  else
+    ERR_EXIT ("unknown shape '%s'", shape);
+
+  if (iterations < 1 || iterations > 0x7FFF)
+    ERR_EXIT ("iterations must be between 1 and 32767");
+  if (repeat < 1)
+    ERR_EXIT ("repeat must be at least 1");
+
+  if (list)
+    {
+      for (bench *b = bench_table; b->name; b++)
+        printf ("%-14s%s\n", b->name, b->desc);
+      poptFreeContext (optCon);
+      exit (0);
+    }
+
+  // optional benchmark names restrict what we run
+  const char **names = poptGetArgs (optCon);
+  for (const char **p = names; p && *p; p++)
+    {
+      bench *b;
+      for (b = bench_table; b->name && strcmp (b->name, *p) != 0; b++)
+        ;
+      if (!b->name)
+        ERR_EXIT ("unknown benchmark '%s'", *p);
+    }
+
+  /* each benchmark starts from an empty machine, restored from this */
+  program *prog = calloc (1, sizeof (program));
+  vmimage *pristine = prog ? capture_image (prog) : 0;
+  if (!pristine)
+    ERR_EXIT ("out of memory");
+
+  /* the cost of the loop scaffolding (ADD + BRp) is measured with an empty
+   * body and subtracted from the per-op figures of the loop shape */
+  result empty;
+  bench scaffold = { "scaffold", 0, BK_WORD, 0, 0, 1, 1, 0 };
+  rc = run_bench (prog, pristine, &scaffold, 0, 0, iterations, repeat,
+                  &empty);
+  double per_iteration = empty.ns / iterations;
+
+  printf ("%-14s%-7s%14s%11s%9s%10s\n", "benchmark", "shape", "instructions",
+          "ns/inst", "ns/op", "Mops/s");
+  for (bench *b = bench_table; b->name && rc == 0; b++)
+    {
+      if (names)
+        {
+          const char **p;
+          for (p = names; *p && strcmp (*p, b->name) != 0; p++)
+            ;
+          if (!*p)
+            continue;
+        }
+
+      for (int line = 0; line < 2 && rc == 0; line++)
+        {
+          if (!(shapes & (1 << line)) || (line && b->loop_only))
+            continue;
+
+          result res;
+          rc = run_bench (prog, pristine, b, line,
+                          line ? LINE_BODY : LOOP_BODY, iterations, repeat,
+                          &res);
+          if (rc != 0)
+            break;
+
+          double op_ns = res.ns;
+          if (!line)
+            op_ns -= per_iteration * (iterations / b->scale);
+          op_ns /= res.ops;
+
+          printf ("%-14s%-7s%14lu%11.2f%9.2f%10.1f\n", b->name,
+                  line ? "line" : "loop", (unsigned long)res.instructions,
+                  res.ns / res.instructions, op_ns,
+                  op_ns > 0 ? 1e3 / op_ns : 0);
+        }
+    }
+
+  free_devices (prog);
+  free_image (prog->image);
+  free_image (pristine);
+  free (prog);
+  poptFreeContext (optCon);
+
+  exit (rc);
+}
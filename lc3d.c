@@ -0,0 +1,817 @@
+#define PROGRAM_NAME "lc3d"
+#define PROGRAM_DESCRIPTION "an LC-3 job server"
+
+#define _GNU_SOURCE // fopencookie()
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#define HELP_POSTAMBLE "Report bugs to <" PACKAGE_BUGREPORT ">."
+#else
+#define PACKAGE_VERSION "unknown"
+#endif
+
+#define VERSION_STRING PROGRAM_NAME " " PACKAGE_VERSION
+
+#ifndef LC3OS_IMAGE // where the OS image we ship is installed
+#define LC3OS_IMAGE "lc3os.obj"
+#endif
+
+#include "popt/popt.h"
+#include "program.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* unix only */
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_SECCOMP_H
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#endif
+
+/* lc3d runs LC-3 programs for clients of a UNIX socket, so a grader can put
+ * thousands of submissions through without starting a VM for each. A pool
+ * of worker processes is forked up front, and each takes jobs one at a
+ * time, running them all in the same program: between jobs it's reset to a
+ * pristine image by copying back only the pages the last job dirtied (see
+ * fork.c). Workers give up whatever they won't need for that (resource
+ * limits, then a seccomp allowlist of system calls) once, as they start.
+ *
+ * A job is a few lines of text, some of them followed by raw bytes:
+ *
+ *   image <N>\n<N bytes of object code>
+ *   input <N>\n<N bytes of keyboard input>     (optional)
+ *   limit <COUNT>                               instructions (optional)
+ *   time <MS>                                   wall clock (optional)
+ *   run
+ *
+ * and the reply streams back as the program runs:
+ *
+ *   out <N>\n<N bytes of output>                any number of these
+ *   exit halt|limit|timeout|error
+ *   icount <COUNT>
+ *   regs <R0> ... <R7> <PC> <COND> <PSR>        each as x%04X
+ *
+ * or "error <why>" if the job couldn't be run. Limits a job asks for are
+ * capped at the server's. */
+
+#define HELP_PREAMBLE                                                         \
+  "Serve LC-3 jobs on SOCKET. With --submit, send FILE to the server on "     \
+  "SOCKET\ninstead: the program's output goes to stdout, and the rest of "    \
+  "the reply to\nstderr."
+
+#define ERR_EXIT(args...)                                                     \
+  do                                                                          \
+    {                                                                         \
+      fprintf (stderr, "error: ");                                            \
+      fprintf (stderr, args);                                                 \
+      fprintf (stderr, "\n");                                                 \
+      poptPrintHelp (optCon, stderr, 0);                                      \
+      poptFreeContext (optCon);                                               \
+      exit (1);                                                               \
+    }                                                                         \
+  while (0)
+
+#define IMAGE_MAX (2 * (MEMORY_MAX + 1)) // an origin and a full memory
+#define INPUT_MAX (1 << 20)
+#define WORKER_FILES 8        // stdio, the socket and a client
+#define WORKER_MEMORY (64 << 20)
+#define REQUEST_TIMEOUT 10    // seconds a client gets to send its job
+#define EXIT_NO_WORKER 3      // a worker couldn't start: don't respawn it
+
+static long long max_insts = 100000000;
+static int max_ms = 10000;
+static int sandboxed = 1;
+
+static volatile sig_atomic_t timed_out, shutting_down;
+
+static void
+time_up (int sig)
+{
+  timed_out = 1;
+  stop_signal = 1;
+  device_signal = 1;
+}
+
+static void
+shut_down (int sig)
+{
+  shutting_down = 1;
+}
+
+static int
+write_all (int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len)
+    {
+      ssize_t n = write (fd, p, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return 1;
+      p += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/* read all of in, up to max bytes; null if it's any longer (or on error) */
+static char *
+slurp (FILE *in, size_t max, size_t *len)
+{
+  char *buf = malloc (max + 1);
+  if (!buf)
+    return 0;
+  *len = fread (buf, 1, max + 1, in);
+  if (ferror (in) || *len > max)
+    {
+      free (buf);
+      return 0;
+    }
+  return buf;
+}
+
+/* the worker side */
+
+typedef struct job
+{
+  char *image, *input;
+  size_t image_len, input_len;
+  unsigned long long limit, ms;
+} job;
+
+/* output is framed as stdio flushes it */
+static ssize_t
+send_output (void *cookie, const char *buf, size_t size)
+{
+  int fd = *(int *)cookie;
+  char head[32];
+  int n = snprintf (head, sizeof (head), "out %zu\n", size);
+  if (write_all (fd, head, n) != 0 || write_all (fd, buf, size) != 0)
+    {
+      // nobody's listening: no point running on
+      stop_signal = 1;
+      device_signal = 1;
+      return -1;
+    }
+  return size;
+}
+
+/* read N bytes (announced on the line before) into a buffer of their own */
+static const char *
+read_bytes (FILE *in, unsigned long long n, size_t max, char **buf,
+            size_t *len)
+{
+  if (*buf)
+    return "sent twice";
+  if (n > max)
+    return "too long";
+  if (!(*buf = malloc (n ? n : 1)))
+    return "out of memory";
+  *len = n;
+  if (fread (*buf, 1, n, in) != n)
+    return "cut short";
+  return 0;
+}
+
+/* null if a whole job was read, or why not */
+static const char *
+read_job (FILE *in, job *j)
+{
+  char *line = 0;
+  size_t size = 0;
+  const char *err = "no \"run\"";
+
+  while (getline (&line, &size, in) > 0)
+    {
+      char key[16];
+      unsigned long long val;
+      if (strcmp (line, "run\n") == 0)
+        {
+          err = j->image ? 0 : "no image";
+          break;
+        }
+
+      const char *bad = 0;
+      if (sscanf (line, "%15s %llu", key, &val) != 2)
+        bad = "bad line";
+      else if (strcmp (key, "image") == 0)
+        {
+          bad = read_bytes (in, val, IMAGE_MAX, &j->image, &j->image_len);
+          if (!bad && (j->image_len < 2 || j->image_len % 2))
+            bad = "image isn't object code";
+        }
+      else if (strcmp (key, "input") == 0)
+        bad = read_bytes (in, val, INPUT_MAX, &j->input, &j->input_len);
+      else if (strcmp (key, "limit") == 0)
+        j->limit = val;
+      else if (strcmp (key, "time") == 0)
+        j->ms = val;
+      else
+        bad = "unknown request";
+      if (bad)
+        {
+          err = bad;
+          break;
+        }
+    }
+
+  free (line);
+  return err;
+}
+
+static unsigned long long
+cap (unsigned long long asked, unsigned long long most)
+{
+  return asked && asked < most ? asked : most;
+}
+
+static void
+run_job (program *prog, vmimage *pristine, timer_t timer, int conn, job *j)
+{
+  static char none[1];
+  FILE *image = fmemopen (j->image, j->image_len, "r"),
+       *keys = fmemopen (j->input ? j->input : none, j->input_len, "r");
+  cookie_io_functions_t io = { 0, send_output, 0, 0 };
+  FILE *out = fopencookie (&conn, "w", io);
+  if (!image || !keys || !out || reset_program (prog, pristine) != 0
+      || load_program (prog, image) != 0)
+    {
+      dprintf (conn, "error couldn't load the image\n");
+      goto done;
+    }
+
+  setvbuf (out, 0, _IOFBF, BUFSIZ);
+  set_output (out);
+  prog->input->from = keys;
+  prog->limit = cap (j->limit, max_insts);
+  unsigned long long ms = cap (j->ms, max_ms);
+  struct itimerspec its = { { 0, 0 }, { ms / 1000, ms % 1000 * 1000000 } };
+  timed_out = 0;
+  timer_settime (timer, 0, &its, 0);
+
+  uint16_t rc = execute_program (prog);
+
+  memset (&its, 0, sizeof (its));
+  timer_settime (timer, 0, &its, 0);
+  stop_signal = 0; // in case it went off as the program stopped anyway
+  set_output (0);
+  prog->input->from = 0;
+
+  const char *why = timed_out                     ? "timeout"
+                    : rc                          ? "error"
+                    : prog->icount == prog->limit ? "limit"
+                                                  : "halt";
+  char regs[R_PSR * 6 + 16], *p = regs;
+  for (int r = R_R0; r <= R_PSR; r++)
+    p += sprintf (p, " x%04X", prog->reg[r]);
+  fclose (out);
+  out = 0;
+  dprintf (conn, "exit %s\nicount %llu\nregs%s\n", why,
+           (unsigned long long)prog->icount, regs);
+
+done:
+  if (out)
+    fclose (out);
+  if (keys)
+    fclose (keys);
+  if (image)
+    fclose (image);
+}
+
+static void
+serve (program *prog, vmimage *pristine, timer_t timer, int conn)
+{
+  struct timeval tv = { REQUEST_TIMEOUT, 0 };
+  setsockopt (conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+  FILE *in = fdopen (conn, "r");
+  if (!in)
+    {
+      close (conn);
+      return;
+    }
+
+  job j;
+  memset (&j, 0, sizeof (j));
+  const char *err = read_job (in, &j);
+  if (err)
+    dprintf (conn, "error %s\n", err);
+  else
+    run_job (prog, pristine, timer, conn, &j);
+
+  free (j.image);
+  free (j.input);
+  fclose (in);
+}
+
+#ifdef HAVE_LINUX_SECCOMP_H
+#if defined(__x86_64__)
+#define FILTER_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define FILTER_ARCH AUDIT_ARCH_AARCH64
+#endif
+#endif
+
+#ifdef FILTER_ARCH
+/* what a worker still needs once it's serving: its socket, memory, signals
+ * and timers; any other system call fails with EPERM */
+static const int allowed[] = {
+  __NR_read, __NR_write, __NR_writev, __NR_close, __NR_fstat, __NR_lseek,
+  __NR_fcntl, __NR_mmap, __NR_munmap, __NR_mremap, __NR_brk, __NR_madvise,
+  __NR_accept, __NR_accept4, __NR_setsockopt, __NR_pselect6, __NR_ppoll,
+  __NR_rt_sigaction, __NR_rt_sigprocmask, __NR_rt_sigreturn,
+  __NR_setitimer, __NR_timer_settime, __NR_clock_gettime,
+  __NR_gettimeofday, __NR_futex, __NR_exit, __NR_exit_group,
+#ifdef __NR_newfstatat
+  __NR_newfstatat,
+#endif
+#ifdef __NR_select
+  __NR_select,
+#endif
+#ifdef __NR_poll
+  __NR_poll,
+#endif
+};
+
+#define NALLOWED (sizeof (allowed) / sizeof (allowed[0]))
+
+static int
+filter_syscalls ()
+{
+  struct sock_filter filter[4 + 2 * NALLOWED + 1], *f = filter;
+  *f++ = (struct sock_filter)BPF_STMT (BPF_LD | BPF_W | BPF_ABS,
+                                       offsetof (struct seccomp_data, arch));
+  *f++ = (struct sock_filter)BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, FILTER_ARCH,
+                                       1, 0);
+  *f++ = (struct sock_filter)BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_KILL);
+  *f++ = (struct sock_filter)BPF_STMT (BPF_LD | BPF_W | BPF_ABS,
+                                       offsetof (struct seccomp_data, nr));
+  for (size_t i = 0; i < NALLOWED; i++)
+    {
+      *f++ = (struct sock_filter)BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K,
+                                           allowed[i], 0, 1);
+      *f++ = (struct sock_filter)BPF_STMT (BPF_RET | BPF_K,
+                                           SECCOMP_RET_ALLOW);
+    }
+  *f++ = (struct sock_filter)BPF_STMT (BPF_RET | BPF_K,
+                                       SECCOMP_RET_ERRNO | EPERM);
+
+  struct sock_fprog prog = { f - filter, filter };
+  if (prctl (PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0
+      || prctl (PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) != 0)
+    {
+      fprintf (stderr, "error: couldn't install seccomp filter: %s\n",
+               strerror (errno));
+      return 1;
+    }
+  return 0;
+}
+#else
+static int
+filter_syscalls ()
+{
+  fprintf (stderr, "warning: no seccomp filter on this platform\n");
+  return 0;
+}
+#endif
+
+static int
+sandbox ()
+{
+  struct rlimit none = { 0, 0 }, files = { WORKER_FILES, WORKER_FILES },
+                memory = { WORKER_MEMORY, WORKER_MEMORY };
+  if (setrlimit (RLIMIT_NOFILE, &files) != 0
+      || setrlimit (RLIMIT_FSIZE, &none) != 0
+      || setrlimit (RLIMIT_CORE, &none) != 0
+      || setrlimit (RLIMIT_NPROC, &none) != 0
+      || setrlimit (RLIMIT_AS, &memory) != 0)
+    {
+      fprintf (stderr, "error: couldn't set resource limits: %s\n",
+               strerror (errno));
+      return 1;
+    }
+  return filter_syscalls ();
+}
+
+/* set up once (inheriting prog, with any OS image loaded, from the server),
+ * then take jobs until killed */
+static int
+worker (int listener, program *prog)
+{
+  int null = open ("/dev/null", O_RDONLY);
+  if (null < 0 || dup2 (null, STDIN_FILENO) < 0)
+    return EXIT_NO_WORKER;
+  close (null);
+
+  signal (SIGPIPE, SIG_IGN);
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = time_up;
+  sigaction (SIGUSR1, &sa, 0);
+  timer_t timer;
+  struct sigevent sev;
+  memset (&sev, 0, sizeof (sev));
+  sev.sigev_notify = SIGEV_SIGNAL;
+  sev.sigev_signo = SIGUSR1;
+  if (timer_create (CLOCK_MONOTONIC, &sev, &timer) != 0)
+    {
+      fprintf (stderr, "error: couldn't create timer: %s\n",
+               strerror (errno));
+      return EXIT_NO_WORKER;
+    }
+
+  set_flush (0); // the reply is framed per flush: make them few
+  vmimage *pristine = capture_image (prog);
+  if (!pristine)
+    {
+      fprintf (stderr, "error: out of memory starting worker\n");
+      return EXIT_NO_WORKER;
+    }
+  if (sandboxed && sandbox () != 0)
+    return EXIT_NO_WORKER;
+
+  for (;;)
+    {
+      int conn = accept (listener, 0, 0);
+      if (conn >= 0)
+        serve (prog, pristine, timer, conn);
+      else if (errno != EINTR && errno != ECONNABORTED)
+        {
+          fprintf (stderr, "error: accept failed: %s\n", strerror (errno));
+          return 1;
+        }
+    }
+}
+
+static pid_t
+spawn (int listener, program *prog)
+{
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      signal (SIGTERM, SIG_DFL);
+      signal (SIGINT, SIG_DFL);
+      exit (worker (listener, prog));
+    }
+  if (pid < 0)
+    fprintf (stderr, "error: couldn't fork worker: %s\n", strerror (errno));
+  return pid;
+}
+
+static int
+unix_address (struct sockaddr_un *addr, const char *path)
+{
+  memset (addr, 0, sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr->sun_path))
+    {
+      fprintf (stderr, "error: socket path too long: %s\n", path);
+      return 1;
+    }
+  strcpy (addr->sun_path, path);
+  return 0;
+}
+
+static int
+listen_on (const char *path)
+{
+  struct sockaddr_un addr;
+  if (unix_address (&addr, path) != 0)
+    return -1;
+
+  struct stat st;
+  if (stat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (path); // left behind by an earlier server
+
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0
+      || listen (fd, SOMAXCONN) != 0)
+    {
+      fprintf (stderr, "error: couldn't listen on %s: %s\n", path,
+               strerror (errno));
+      if (fd >= 0)
+        close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+static int
+run_server (const char *path, program *prog, int nworkers)
+{
+  int listener = listen_on (path);
+  pid_t *pids = calloc (nworkers, sizeof (pid_t));
+  if (listener < 0 || !pids)
+    {
+      if (listener >= 0)
+        close (listener);
+      free (pids);
+      return 1;
+    }
+
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = shut_down; // no SA_RESTART: waitpid should give up
+  sigaction (SIGTERM, &sa, 0);
+  sigaction (SIGINT, &sa, 0);
+
+  int rc = 0;
+  for (int i = 0; i < nworkers; i++)
+    if ((pids[i] = spawn (listener, prog)) < 0)
+      shutting_down = rc = 1;
+
+  while (!shutting_down)
+    {
+      int status;
+      pid_t pid = waitpid (-1, &status, 0);
+      for (int i = 0; pid > 0 && i < nworkers; i++)
+        {
+          if (pids[i] != pid)
+            continue;
+          pids[i] = 0;
+          if (WIFEXITED (status) && WEXITSTATUS (status) == EXIT_NO_WORKER)
+            shutting_down = rc = 1;
+          else if (!shutting_down)
+            {
+              fprintf (stderr, "warning: worker %d died; starting another\n",
+                       (int)pid);
+              if ((pids[i] = spawn (listener, prog)) < 0)
+                shutting_down = rc = 1;
+            }
+        }
+    }
+
+  for (int i = 0; i < nworkers; i++)
+    if (pids[i] > 0)
+      kill (pids[i], SIGTERM);
+  while (wait (0) > 0)
+    ;
+  free (pids);
+  close (listener);
+  unlink (path);
+  return rc;
+}
+
+/* the client side */
+
+static int
+submit (const char *path, FILE *obj, FILE *keys, long long limit, int ms)
+{
+  size_t image_len, input_len = 0;
+  char *image = slurp (obj, IMAGE_MAX, &image_len),
+       *input = keys ? slurp (keys, INPUT_MAX, &input_len) : 0;
+  if (!image || (keys && !input))
+    {
+      fprintf (stderr, "error: couldn't read the job (too big?)\n");
+      free (image);
+      free (input);
+      return 1;
+    }
+
+  struct sockaddr_un addr;
+  int fd = unix_address (&addr, path) ? -1 : socket (AF_UNIX, SOCK_STREAM, 0);
+  FILE *to = 0, *from = 0;
+  if (fd < 0 || connect (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0
+      || !(to = fdopen (dup (fd), "w")) || !(from = fdopen (fd, "r")))
+    {
+      fprintf (stderr, "error: couldn't connect to %s: %s\n", path,
+               strerror (errno));
+      free (image);
+      free (input);
+      return 1;
+    }
+
+  if (limit)
+    fprintf (to, "limit %lld\n", limit);
+  if (ms)
+    fprintf (to, "time %d\n", ms);
+  fprintf (to, "image %zu\n", image_len);
+  fwrite (image, 1, image_len, to);
+  if (input)
+    {
+      fprintf (to, "input %zu\n", input_len);
+      fwrite (input, 1, input_len, to);
+    }
+  fprintf (to, "run\n");
+  fclose (to);
+  free (image);
+  free (input);
+
+  int rc = 1;
+  char *line = 0, buf[BUFSIZ];
+  size_t size = 0, n;
+  while (getline (&line, &size, from) > 0)
+    {
+      if (sscanf (line, "out %zu", &n) == 1)
+        {
+          while (n)
+            {
+              size_t got = fread (buf, 1, n < BUFSIZ ? n : BUFSIZ, from);
+              if (!got)
+                break;
+              fwrite (buf, 1, got, stdout);
+              n -= got;
+            }
+          fflush (stdout);
+          continue;
+        }
+      if (strcmp (line, "exit halt\n") == 0)
+        rc = 0;
+      fputs (line, stderr);
+    }
+
+  free (line);
+  fclose (from);
+  return rc;
+}
+
+int
+main (int argc, const char *argv[])
+{
+  poptContext optCon;
+  int nworkers = 4, useos = 0, submitting = 0, ms = 0;
+  long long limit = 0;
+  char *osfile = 0, *inputfile = 0;
+  FILE *osin = 0, *keys = 0;
+
+  // hack for injecting preamble/postamble into the help message
+  struct poptOption emptyTable[] = { POPT_TABLEEND };
+
+  struct poptOption progOptions[]
+      = { /* longName, shortName, argInfo, arg, val, descrip, argDescript */
+          { "workers", 'w', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT,
+            &nworkers, 'w', "worker processes to run jobs in", "COUNT" },
+          { "max-instructions", '\0',
+            POPT_ARG_LONGLONG | POPT_ARGFLAG_SHOW_DEFAULT, &max_insts, 'm',
+            "most instructions a job may run", "COUNT" },
+          { "max-time", '\0', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT,
+            &max_ms, 't', "most milliseconds a job may run for", "MS" },
+          { "os", '\0', POPT_ARG_NONE, &useos, 'o',
+            "run jobs under the LC-3 OS image (see lc3vm --os)", 0 },
+          { "os-image", '\0', POPT_ARG_STRING, &osfile, 'O',
+            "...or under the OS image in FILE", "FILE" },
+          { "no-sandbox", '\0', POPT_ARG_VAL, &sandboxed, 0,
+            "don't restrict workers (to debug them, say)", 0 },
+          { "submit", 's', POPT_ARG_NONE, &submitting, 's',
+            "send FILE as a job instead of serving", 0 },
+          { "input", '\0', POPT_ARG_STRING, &inputfile, 'i',
+            "...with keyboard input from FILE", "FILE" },
+          { "limit", '\0', POPT_ARG_LONGLONG, &limit, 'l',
+            "...limited to COUNT instructions", "COUNT" },
+          { "time", '\0', POPT_ARG_INT, &ms, 'T', "...and to MS milliseconds",
+            "MS" },
+          { "version", '\0', POPT_ARG_NONE, 0, 'V',
+            "show version information and exit", 0 },
+          POPT_TABLEEND
+        };
+
+  struct poptOption options[] = {
+#ifdef HELP_PREAMBLE
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &emptyTable, 0, HELP_PREAMBLE, 0 },
+#endif
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &progOptions, 0, "Options:", 0 },
+    POPT_AUTOHELP
+#ifdef HELP_POSTAMBLE
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &emptyTable, 0, HELP_POSTAMBLE, 0 },
+#endif
+    POPT_TABLEEND
+  };
+
+  optCon = poptGetContext (0, argc, argv, options, 0);
+  poptSetOtherOptionHelp (optCon, "SOCKET [FILE]");
+
+  int rc;
+  while ((rc = poptGetNextOpt (optCon)) > 0)
+    {
+      switch (rc)
+        {
+        case 'w':
+          {
+            if (nworkers <= 0)
+              ERR_EXIT ("bad worker count '%d'", nworkers);
+          }
+          break;
+
+        case 'm':
+        case 'l':
+          {
+            if (max_insts <= 0 || limit < 0)
+              ERR_EXIT ("bad instruction count");
+          }
+          break;
+
+        case 't':
+        case 'T':
+          {
+            if (max_ms <= 0 || ms < 0)
+              ERR_EXIT ("bad time limit");
+          }
+          break;
+
+        case 'O':
+          {
+            if (!(osin = fopen (osfile, "r")))
+              {
+                ERR_EXIT ("couldn't open OS image '%s': %s", osfile,
+                          strerror (errno));
+              }
+          }
+          break;
+
+        case 'i':
+          {
+            if (!(keys = fopen (inputfile, "r")))
+              {
+                ERR_EXIT ("couldn't open input file '%s': %s", inputfile,
+                          strerror (errno));
+              }
+            free (inputfile);
+          }
+          break;
+
+        case 'V':
+          {
+            printf (VERSION_STRING);
+            poptFreeContext (optCon);
+            exit (0);
+          }
+          break;
+        }
+    }
+
+  if (rc != -1)
+    {
+      ERR_EXIT ("%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS),
+                poptStrerror (rc));
+    }
+
+  const char *path = poptGetArg (optCon), *objfile = poptGetArg (optCon);
+  if (!path)
+    ERR_EXIT ("no socket given");
+  if (submitting != !!objfile || poptPeekArg (optCon))
+    ERR_EXIT ("give FILE (just one) with --submit, and only then");
+
+  if (submitting)
+    {
+      FILE *obj = fopen (objfile, "r");
+      if (!obj)
+        ERR_EXIT ("couldn't open '%s': %s", objfile, strerror (errno));
+      rc = submit (path, obj, keys, limit, ms);
+      fclose (obj);
+      if (keys)
+        fclose (keys);
+      poptFreeContext (optCon);
+      exit (rc);
+    }
+
+  if (useos && !osin && !(osin = fopen (LC3OS_IMAGE, "r")))
+    {
+      ERR_EXIT ("couldn't open OS image '%s': %s", LC3OS_IMAGE,
+                strerror (errno));
+    }
+
+  // what every job starts from
+  program *prog = calloc (1, sizeof (program));
+  if (!prog || !(prog->input = open_input (0, 0)))
+    {
+      fprintf (stderr, "error: out of memory\n");
+      exit (1);
+    }
+  if (osin)
+    {
+      if (load_os (prog, osin, osfile ? osfile : LC3OS_IMAGE) != 0)
+        {
+          fprintf (stderr, "failed to load OS image: %s\n",
+                   osfile ? osfile : LC3OS_IMAGE);
+          exit (1);
+        }
+      fclose (osin);
+      free (osfile);
+    }
+
+  rc = run_server (path, prog, nworkers);
+
+  poptFreeContext (optCon);
+  close_input (prog->input);
+  free (prog->os);
+  free_segments (prog);
+  free (prog);
+  exit (rc);
+}
@@ -0,0 +1,153 @@
+; a small LC-3 operating system: the trap vector table, and service
+; routines for the standard traps that drive the keyboard, display and
+; machine control registers rather than asking the host
+;
+; lc3vm --os loads it under a program; TRAPs through table entries still
+; pointing here are run natively, so these only run once a program has
+; installed routines of its own that they depend on (PUTS, IN and PUTSP
+; print through OUT, and IN reads through GETC). They're called like
+; subroutines (TRAP leaves the return address in R7), and every register
+; but R0 for GETC and IN comes back as it was.
+
+.orig x0000
+
+; trap vector table
+  .blkw x20
+  .fill OS_GETC     ; x20
+  .fill OS_OUT      ; x21
+  .fill OS_PUTS     ; x22
+  .fill OS_IN       ; x23
+  .fill OS_PUTSP    ; x24
+  .fill OS_HALT     ; x25
+  .blkw xDA
+
+; interrupt vector table: no handlers
+  .blkw x100
+
+; R0 = the next key, not echoed
+OS_GETC
+  ldi r0, OS_KBSR
+  brzp OS_GETC
+  ldi r0, OS_KBDR
+  ret
+
+; write the character in R0
+OS_OUT
+  st r1, OUT_R1
+OUT_WAIT
+  ldi r1, OS_DSR
+  brzp OUT_WAIT
+  sti r0, OS_DDR
+  ld r1, OUT_R1
+  ret
+
+; write the string at R0, one character per word
+OS_PUTS
+  st r0, PUTS_R0
+  st r1, PUTS_R1
+  st r7, PUTS_R7
+  add r1, r0, #0
+PUTS_LOOP
+  ldr r0, r1, #0
+  brz PUTS_DONE
+  out
+  add r1, r1, #1
+  br PUTS_LOOP
+PUTS_DONE
+  ld r0, PUTS_R0
+  ld r1, PUTS_R1
+  ld r7, PUTS_R7
+  ret
+
+; prompt for a character, and echo it into R0
+OS_IN
+  st r7, IN_R7
+  lea r0, IN_PROMPT
+  puts
+  getc
+  out
+  ld r7, IN_R7
+  add r0, r0, #0
+  ret
+
+; write the string at R0, two characters per word (low byte first)
+OS_PUTSP
+  st r0, PUTSP_R0
+  st r1, PUTSP_R1
+  st r2, PUTSP_R2
+  st r3, PUTSP_R3
+  st r4, PUTSP_R4
+  st r5, PUTSP_R5
+  st r7, PUTSP_R7
+  add r1, r0, #0
+PUTSP_LOOP
+  ldr r2, r1, #0
+  brz PUTSP_DONE
+  ld r3, LOW_BYTE
+  and r0, r2, r3
+  out
+  and r0, r0, #0  ; shift the high byte down a bit at a time
+  add r3, r0, #1
+  ld r4, HIGH_BIT
+PUTSP_SHIFT
+  and r5, r2, r4
+  brz #1
+  add r0, r0, r3
+  add r3, r3, r3
+  add r4, r4, r4
+  brnp PUTSP_SHIFT
+  add r0, r0, #0
+  brz PUTSP_NEXT
+  out
+PUTSP_NEXT
+  add r1, r1, #1
+  br PUTSP_LOOP
+PUTSP_DONE
+  ld r0, PUTSP_R0
+  ld r1, PUTSP_R1
+  ld r2, PUTSP_R2
+  ld r3, PUTSP_R3
+  ld r4, PUTSP_R4
+  ld r5, PUTSP_R5
+  ld r7, PUTSP_R7
+  ret
+
+; stop the clock
+OS_HALT
+  st r0, HALT_R0
+  st r1, HALT_R1
+  ldi r0, OS_MCR
+  ld r1, CLOCK_OFF
+  and r0, r0, r1
+  sti r0, OS_MCR
+  ld r0, HALT_R0
+  ld r1, HALT_R1
+  ret
+
+OS_KBSR .fill xFE00
+OS_KBDR .fill xFE02
+OS_DSR .fill xFE04
+OS_DDR .fill xFE06
+OS_MCR .fill xFFFE
+LOW_BYTE .fill x00FF
+HIGH_BIT .fill x0100
+CLOCK_OFF .fill x7FFF
+
+OUT_R1 .fill #0
+PUTS_R0 .fill #0
+PUTS_R1 .fill #0
+PUTS_R7 .fill #0
+IN_R7 .fill #0
+PUTSP_R0 .fill #0
+PUTSP_R1 .fill #0
+PUTSP_R2 .fill #0
+PUTSP_R3 .fill #0
+PUTSP_R4 .fill #0
+PUTSP_R5 .fill #0
+PUTSP_R7 .fill #0
+HALT_R0 .fill #0
+HALT_R1 .fill #0
+
+IN_PROMPT .stringz "Enter a character: "
+
+.end
@@ -0,0 +1,277 @@
+#define PROGRAM_NAME "lc3trace"
+#define PROGRAM_DESCRIPTION "an LC-3 execution trace decoder"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#define HELP_POSTAMBLE "Report bugs to <" PACKAGE_BUGREPORT ">."
+#else
+#define PACKAGE_VERSION "unknown"
+#endif
+
+#define VERSION_STRING PROGRAM_NAME " " PACKAGE_VERSION
+
+#include "popt/popt.h"
+#include "program.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HELP_PREAMBLE                                                         \
+  "Decode a trace recorded with lc3vm --trace. If FILE is not provided this " \
+  "\nprogram will read from stdin."
+
+#define ERR_EXIT(args...)                                                     \
+  do                                                                          \
+    {                                                                         \
+      fprintf (stderr, "error: ");                                            \
+      fprintf (stderr, args);                                                 \
+      fprintf (stderr, "\n");                                                 \
+      poptPrintHelp (optCon, stderr, 0);                                      \
+      poptFreeContext (optCon);                                               \
+      exit (1);                                                               \
+    }                                                                         \
+  while (0)
+
+/* parse x3000, 0x3000 or 3000 */
+static int
+parse_addr (const char *s, uint16_t *addr, const char **endp)
+{
+  if (*s == 'x' || *s == 'X')
+    s++;
+  else if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    s += 2;
+
+  char *end;
+  long val = strtol (s, &end, 16);
+  if (end == s || val < 0 || val >= MEMORY_MAX)
+    return 1;
+
+  *addr = val;
+  *endp = end;
+  return 0;
+}
+
+/* what an instruction wrote, as recorded by the VM */
+static void
+describe (char *dest, trace_record *r)
+{
+  switch (r->word >> 12)
+    {
+    case OP_ST:
+    case OP_STI:
+    case OP_STR:
+      sprintf (dest, "mem[x%04X] = x%04X", r->addr, r->value);
+      break;
+    case OP_BR:
+    case OP_JMP:
+      sprintf (dest, "PC = x%04X", r->value);
+      break;
+    case OP_RTI:
+    case OP_RES:
+      *dest = 0;
+      break;
+    default:
+      sprintf (dest, "R%d = x%04X", r->addr & 0x7, r->value);
+    }
+}
+
+int
+main (int argc, const char *argv[])
+{
+  poptContext optCon;
+  char *outfile = "-", *symbolfile = 0, *range = 0;
+  FILE *out = 0, *in = 0;
+  uint16_t from = 0, to = MEMORY_MAX - 1;
+  int lower = 0;
+
+  // hack for injecting preamble/postamble into the help message
+  struct poptOption emptyTable[] = { POPT_TABLEEND };
+
+  struct poptOption progOptions[] = {
+    /* longName, shortName, argInfo, arg, val, descrip, argDescript */
+    { "range", 'r', POPT_ARG_STRING, &range, 'r',
+      "only show instructions at addresses FROM through TO", "FROM[-TO]" },
+    { "symbols", 'S', POPT_ARG_STRING, &symbolfile, 'S',
+      "read symbols from FILE", "FILE" },
+    { "lower", 'l', POPT_ARG_NONE, &lower, 'l', "print everything in lowercase",
+      0 },
+    { "output", 'o', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &outfile,
+      'o', "write output to FILE", "FILE" },
+    { "version", '\0', POPT_ARG_NONE, 0, 'V',
+      "show version information and exit", 0 },
+    POPT_TABLEEND
+  };
+
+  struct poptOption options[] = {
+#ifdef HELP_PREAMBLE
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &emptyTable, 0, HELP_PREAMBLE, 0 },
+#endif
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &progOptions, 0, "Options:", 0 },
+    POPT_AUTOHELP
+#ifdef HELP_POSTAMBLE
+    { 0, '\0', POPT_ARG_INCLUDE_TABLE, &emptyTable, 0, HELP_POSTAMBLE, 0 },
+#endif
+    POPT_TABLEEND
+  };
+
+  optCon = poptGetContext (0, argc, argv, options, 0);
+  poptSetOtherOptionHelp (optCon, "[FILE]");
+
+  int rc;
+  while ((rc = poptGetNextOpt (optCon)) > 0)
+    {
+      switch (rc)
+        {
+        case 'r':
+          {
+            const char *end;
+            if (parse_addr (range, &from, &end) != 0)
+              ERR_EXIT ("bad address range '%s'", range);
+            if (*end == '-')
+              {
+                if (parse_addr (end + 1, &to, &end) != 0 || *end || to < from)
+                  ERR_EXIT ("bad address range '%s'", range);
+              }
+            else if (*end)
+              ERR_EXIT ("bad address range '%s'", range);
+            else
+              to = from;
+            free (range);
+          }
+          break;
+
+        case 'o':
+          {
+            if (out)
+              {
+                ERR_EXIT ("more than one output file specified");
+              }
+            else if (strcmp (outfile, "-") == 0)
+              {
+                out = stdout;
+              }
+            else if (!(out = fopen (outfile, "w")))
+              {
+                ERR_EXIT ("couldn't open output file '%s': %s", outfile,
+                          strerror (errno));
+              }
+            free (outfile);
+          }
+          break;
+
+        case 'V':
+          {
+            printf (VERSION_STRING);
+            poptFreeContext (optCon);
+            exit (0);
+          }
+          break;
+        }
+    }
+
+  if (rc != -1)
+    {
+      ERR_EXIT ("%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS),
+                poptStrerror (rc));
+    }
+
+  const char *infile = poptGetArg (optCon);
+  if (poptGetArg (optCon))
+    {
+      ERR_EXIT ("more than one input file specified");
+    }
+  else if (!infile || strcmp (infile, "-") == 0)
+    {
+      in = stdin;
+    }
+  else if (!(in = fopen (infile, "r")))
+    {
+      ERR_EXIT ("couldn't open input file '%s': %s", infile, strerror (errno));
+    }
+
+  /* instructions are disassembled one at a time out of a scratch image;
+   * symbols live in a separate one so their hints don't turn code into
+   * .FILLs */
+  program *scratch = calloc (1, sizeof (program));
+  program *syms = calloc (1, sizeof (program));
+  if (symbolfile)
+    {
+      FILE *symin = fopen (symbolfile, "r");
+      if (!symin)
+        {
+          ERR_EXIT ("couldn't open symbol file '%s': %s", symbolfile,
+                    strerror (errno));
+        }
+      if (load_symbols (syms, symin) != 0)
+        ERR_EXIT ("failed to load symbols: %s", symbolfile);
+      fclose (symin);
+      free (symbolfile);
+    }
+  poptFreeContext (optCon);
+
+  if (!out)
+    out = stdout;
+
+  // owner[addr] is the closest label at or before addr
+  uint16_t owner[MEMORY_MAX];
+  for (int addr = 0, cur = -1; addr < MEMORY_MAX; addr++)
+    {
+      if (syms->sym[addr] && *syms->sym[addr]->label != '_')
+        cur = addr;
+      owner[addr] = (cur < 0) ? addr : cur;
+    }
+
+  rc = read_trace_header (in);
+
+  trace_record *records = 0;
+  size_t n;
+  uint64_t index = 0;
+  int more;
+  while (rc == 0 && (more = read_trace_chunk (in, &records, &n)) != 0)
+    {
+      if (more < 0)
+        {
+          rc = 1;
+          break;
+        }
+
+      for (trace_record *r = records; r < records + n; r++)
+        {
+          index++;
+          if (r->pc < from || r->pc > to)
+            continue;
+
+          char disasm[4096] = "", effect[64], label[256] = "";
+          scratch->mem[r->pc] = r->word;
+          disassemble_addr (disasm, lower ? FMT_LC : 0, r->pc, scratch);
+          describe (effect, r);
+
+          uint16_t o = owner[r->pc];
+          if (syms->sym[o] && *syms->sym[o]->label != '_')
+            {
+              int len = sprintf (label, "%s", syms->sym[o]->label);
+              if (o != r->pc)
+                sprintf (label + len, "+%d", r->pc - o);
+            }
+
+          fprintf (out, lower ? "%10lu  x%04x  %-20s%-24s%s\n"
+                              : "%10lu  x%04X  %-20s%-24s%s\n",
+                   (unsigned long)index, r->pc, label, disasm, effect);
+        }
+    }
+
+  free (records);
+  if (in != stdin)
+    fclose (in);
+  if (out != stdout)
+    fclose (out);
+  syms->orig = 0;
+  syms->len = MEMORY_MAX - 1;
+  free_symbols (syms);
+  free (syms);
+  free (scratch);
+
+  exit (rc);
+}
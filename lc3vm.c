@@ -10,6 +10,10 @@
 
 #define VERSION_STRING PROGRAM_NAME " " PACKAGE_VERSION
 
+#ifndef LC3OS_IMAGE // where the OS image we ship is installed
+#define LC3OS_IMAGE "lc3os.obj"
+#endif
+
 #include "parse.h"
 #include "popt/popt.h"
 #include "program.h"
@@ -27,10 +31,14 @@
 #include <unistd.h>
 
 struct termios original_tio;
+static int raw_input; // set once we've changed the terminal settings
 
 static void
 disable_input_buffering ()
 {
+  if (!isatty (STDIN_FILENO))
+    return;
+  raw_input = 1;
   tcgetattr (STDIN_FILENO, &original_tio);
   struct termios new_tio = original_tio;
   new_tio.c_lflag &= ~ICANON & ~ECHO;
@@ -40,13 +48,15 @@ disable_input_buffering ()
 static void
 restore_input_buffering ()
 {
-  tcsetattr (STDIN_FILENO, TCSANOW, &original_tio);
+  if (raw_input)
+    tcsetattr (STDIN_FILENO, TCSANOW, &original_tio);
 }
 
 static void
 handle_interrupt (int signal)
 {
-  // TODO handle this for interactive mode (drop back into shell)
+  if (interrupt_debug ()) // it'll stop, and it's back to the prompt
+    return;
   restore_input_buffering ();
   printf ("\n");
   exit (-2);
@@ -64,14 +74,76 @@ handle_interrupt (int signal)
     }                                                                         \
   while (0)
 
+/* fork a child from wherever prog stopped for each line of variants, and
+ * run it with that line (newline included) as its keyboard input */
+static int
+run_variants (program *prog, FILE *variants)
+{
+  if (prog->icount != prog->limit)
+    {
+      fprintf (stderr, "error: halted after %llu instructions, before the "
+                       "fork\n",
+               (unsigned long long)prog->icount);
+      return 1;
+    }
+  prog->limit = 0;
+
+  vmimage *parent = capture_image (prog);
+  if (!parent || (!prog->input && !(prog->input = open_input (0, 0))))
+    {
+      fprintf (stderr, "error: out of memory forking\n");
+      free_image (parent);
+      return 1;
+    }
+  prog->input->replay = 0; // any replay log only covered the parent
+
+  char *line = 0;
+  size_t size = 0;
+  ssize_t len;
+  int rc = 0;
+  for (int n = 1; (len = getline (&line, &size, variants)) > 0; n++)
+    {
+      FILE *from = fmemopen (line, len, "r");
+      if (!from || load_image (prog, parent) != 0)
+        {
+          fprintf (stderr, "error: couldn't fork variant %d\n", n);
+          rc = 1;
+          break;
+        }
+
+      printf ("\n==> variant %d <==\n", n);
+      prog->input->from = from;
+      if (resume_program (prog) != 0)
+        rc = 1;
+      prog->input->from = 0;
+      fclose (from);
+    }
+
+  free (line);
+  free_image (parent);
+  return rc;
+}
+
 // TODO put this in a header somewhere?
 int handle_interactive (program *prog);
+int run_script (program *prog, FILE *in);
 
 int
 main (int argc, const char *argv[])
 {
   poptContext optCon;
   int interactive = 0;
+  char *symbolfile = 0, *profilefile = 0, *stacksfile = 0, *tracefile = 0,
+       *recordfile = 0, *replayfile = 0, *snapfile = 0, *restorefile = 0,
+       *variantsfile = 0, *nativesfile = 0, *osfile = 0, *gdbwhere = 0,
+       *scriptfile = 0, *entryat = 0;
+  char *symbolfiles[SEGMENTS_MAX];
+  int nsymbolfiles = 0;
+  FILE *profout = 0, *stacksout = 0, *traceout = 0, *recordout = 0,
+       *replayin = 0, *snapout = 0, *restorein = 0, *variantsin = 0,
+       *nativesout = 0, *osin = 0, *scriptin = 0;
+  long long snapat = 0, forkat = 0;
+  int flushevery = 1, useos = 0;
 
   // hack for injecting preamble/postamble into the help message
   struct poptOption emptyTable[] = { POPT_TABLEEND };
@@ -80,6 +152,62 @@ main (int argc, const char *argv[])
       = { /* longName, shortName, argInfo, arg, val, descrip, argDescript */
           { "interactive", 'i', POPT_ARG_NONE, &interactive, 'i',
             "run in interactive mode", 0 },
+          { "script", '\0', POPT_ARG_STRING, &scriptfile, 'x',
+            "run the interactive mode commands in FILE, then exit (as -i "
+            "does with commands piped in)",
+            "FILE" },
+          { "gdb", '\0', POPT_ARG_STRING, &gdbwhere, 'g',
+            "wait for GDB (or another remote protocol client) to connect "
+            "on localhost PORT or at SOCKET, and let it run the program",
+            "PORT|SOCKET" },
+          { "symbols", 'S', POPT_ARG_STRING, &symbolfile, 'S',
+            "read symbols from FILE (again for each image that has them)",
+            "FILE" },
+          { "entry", '\0', POPT_ARG_STRING, &entryat, 'E',
+            "start at ADDR (a label or address), not the first program's "
+            "origin",
+            "ADDR" },
+          { "profile", '\0', POPT_ARG_STRING, &profilefile, 'p',
+            "write an execution profile to FILE", "FILE" },
+          { "profile-stacks", '\0', POPT_ARG_STRING, &stacksfile, 's',
+            "write collapsed call stacks (for flame graphs) to FILE",
+            "FILE" },
+          { "trace", '\0', POPT_ARG_STRING, &tracefile, 't',
+            "record a binary execution trace to FILE (see lc3trace)",
+            "FILE" },
+          { "record", '\0', POPT_ARG_STRING, &recordfile, 'r',
+            "log keyboard input (and when it was read) to FILE", "FILE" },
+          { "replay", '\0', POPT_ARG_STRING, &replayfile, 'R',
+            "replay keyboard input logged with --record from FILE", "FILE" },
+          { "snapshot", '\0', POPT_ARG_STRING, &snapfile, 'n',
+            "save the machine state to FILE when the program halts",
+            "FILE" },
+          { "snapshot-at", '\0', POPT_ARG_LONGLONG, &snapat, 'N',
+            "...or stop and save it after COUNT instructions", "COUNT" },
+          { "restore", '\0', POPT_ARG_STRING, &restorefile, 'e',
+            "start from a snapshot saved to FILE (any FILEs given are "
+            "loaded over it)",
+            "FILE" },
+          { "fork-at", '\0', POPT_ARG_LONGLONG, &forkat, 'f',
+            "run COUNT instructions, then fork a child for each line of "
+            "--variants",
+            "COUNT" },
+          { "variants", '\0', POPT_ARG_STRING, &variantsfile, 'v',
+            "keyboard input for the forked children, one per line", "FILE" },
+          { "intrinsics", '\0', POPT_ARG_STRING, &nativesfile, 'I',
+            "run well-known subroutines natively, and write how often they "
+            "were to FILE",
+            "FILE" },
+          { "flush-every", '\0', POPT_ARG_INT, &flushevery, 'F',
+            "flush output once COUNT characters are waiting (0: only before "
+            "input, or on stopping)",
+            "COUNT" },
+          { "os", '\0', POPT_ARG_NONE, &useos, 'o',
+            "run under the LC-3 OS image " PROGRAM_NAME " ships with, "
+            "dispatching TRAPs through its vector table",
+            0 },
+          { "os-image", '\0', POPT_ARG_STRING, &osfile, 'O',
+            "...or under the OS image in FILE", "FILE" },
           { "version", '\0', POPT_ARG_NONE, 0, 'V',
             "show version information and exit", 0 },
           POPT_TABLEEND
@@ -105,6 +233,155 @@ main (int argc, const char *argv[])
     {
       switch (rc)
         {
+        case 'S':
+          {
+            if (nsymbolfiles == SEGMENTS_MAX)
+              ERR_EXIT ("no more than %d symbol files", SEGMENTS_MAX);
+            symbolfiles[nsymbolfiles++] = symbolfile;
+          }
+          break;
+
+        case 'p':
+          {
+            if (!(profout = fopen (profilefile, "w")))
+              {
+                ERR_EXIT ("couldn't open profile file '%s': %s", profilefile,
+                          strerror (errno));
+              }
+            free (profilefile);
+          }
+          break;
+
+        case 's':
+          {
+            if (!(stacksout = fopen (stacksfile, "w")))
+              {
+                ERR_EXIT ("couldn't open stacks file '%s': %s", stacksfile,
+                          strerror (errno));
+              }
+            free (stacksfile);
+          }
+          break;
+
+        case 't':
+          {
+            if (!(traceout = fopen (tracefile, "w")))
+              {
+                ERR_EXIT ("couldn't open trace file '%s': %s", tracefile,
+                          strerror (errno));
+              }
+            free (tracefile);
+          }
+          break;
+
+        case 'r':
+          {
+            if (!(recordout = fopen (recordfile, "w")))
+              {
+                ERR_EXIT ("couldn't open input log '%s': %s", recordfile,
+                          strerror (errno));
+              }
+            free (recordfile);
+          }
+          break;
+
+        case 'R':
+          {
+            if (!(replayin = fopen (replayfile, "r")))
+              {
+                ERR_EXIT ("couldn't open input log '%s': %s", replayfile,
+                          strerror (errno));
+              }
+            free (replayfile);
+          }
+          break;
+
+        case 'n':
+          {
+            if (!(snapout = fopen (snapfile, "w")))
+              {
+                ERR_EXIT ("couldn't open snapshot file '%s': %s", snapfile,
+                          strerror (errno));
+              }
+            free (snapfile);
+          }
+          break;
+
+        case 'N':
+          {
+            if (snapat <= 0)
+              ERR_EXIT ("bad instruction count '%lld'", snapat);
+          }
+          break;
+
+        case 'e':
+          {
+            if (!(restorein = fopen (restorefile, "r")))
+              {
+                ERR_EXIT ("couldn't open snapshot file '%s': %s",
+                          restorefile, strerror (errno));
+              }
+          }
+          break;
+
+        case 'f':
+          {
+            if (forkat <= 0)
+              ERR_EXIT ("bad instruction count '%lld'", forkat);
+          }
+          break;
+
+        case 'v':
+          {
+            if (!(variantsin = fopen (variantsfile, "r")))
+              {
+                ERR_EXIT ("couldn't open variants file '%s': %s",
+                          variantsfile, strerror (errno));
+              }
+            free (variantsfile);
+          }
+          break;
+
+        case 'I':
+          {
+            if (!(nativesout = fopen (nativesfile, "w")))
+              {
+                ERR_EXIT ("couldn't open intrinsics file '%s': %s",
+                          nativesfile, strerror (errno));
+              }
+            free (nativesfile);
+          }
+          break;
+
+        case 'F':
+          {
+            if (flushevery < 0)
+              ERR_EXIT ("bad character count '%d'", flushevery);
+            set_flush (flushevery);
+          }
+          break;
+
+        case 'O':
+          {
+            if (!(osin = fopen (osfile, "r")))
+              {
+                ERR_EXIT ("couldn't open OS image '%s': %s", osfile,
+                          strerror (errno));
+              }
+          }
+          break;
+
+        case 'x':
+          {
+            if (!(scriptin = fopen (scriptfile, "r")))
+              {
+                ERR_EXIT ("couldn't open script '%s': %s", scriptfile,
+                          strerror (errno));
+              }
+            free (scriptfile);
+          }
+          break;
+
         case 'V':
           {
             printf (VERSION_STRING);
@@ -121,9 +398,51 @@ main (int argc, const char *argv[])
                 poptStrerror (rc));
     }
 
+  if (useos && !osin && !(osin = fopen (LC3OS_IMAGE, "r")))
+    {
+      ERR_EXIT ("couldn't open OS image '%s': %s", LC3OS_IMAGE,
+                strerror (errno));
+    }
+  if (snapat && !snapout)
+    ERR_EXIT ("--snapshot-at requires --snapshot");
+  if (!forkat != !variantsin)
+    ERR_EXIT ("--fork-at and --variants go together");
+  if (forkat && (snapat || interactive || recordout))
+    ERR_EXIT ("--fork-at can't be combined with --snapshot-at, --record or "
+              "--interactive");
+  if (scriptin && (interactive || forkat || snapat))
+    ERR_EXIT ("--script can't be combined with --interactive, --fork-at or "
+              "--snapshot-at");
+  if (gdbwhere && (interactive || scriptin || forkat || snapat || restorein))
+    ERR_EXIT ("--gdb can't be combined with --interactive, --script, "
+              "--fork-at, --snapshot-at or --restore");
+
   program prog;
   memset (&prog, 0, sizeof (program));
 
+  if (restorein)
+    {
+      if (restore_snapshot (&prog, restorein) != 0)
+        {
+          fprintf (stderr, "failed to restore snapshot: %s\n", restorefile);
+          exit (1);
+        }
+      fclose (restorein);
+      free (restorefile);
+    }
+
+  if (osin) // under whatever's loaded next
+    {
+      if (load_os (&prog, osin, osfile ? osfile : LC3OS_IMAGE) != 0)
+        {
+          fprintf (stderr, "failed to load OS image: %s\n",
+                   osfile ? osfile : LC3OS_IMAGE);
+          exit (1);
+        }
+      fclose (osin);
+      free (osfile);
+    }
+
   int programs_loaded = 0;
   for (const char *infile = poptGetArg (optCon); infile;
        infile = poptGetArg (optCon))
@@ -139,7 +458,7 @@ main (int argc, const char *argv[])
           exit (1);
         }
 
-      if (load_program (&prog, in) != 0)
+      if (load_segment (&prog, in, infile, 0) != 0)
         {
           fprintf (stderr, "failed to load image: %s\n", infile);
           exit (1);
@@ -151,13 +470,78 @@ main (int argc, const char *argv[])
       if (interactive)
         printf ("successfully loaded\n");
     }
+
+  for (int i = 0; i < nsymbolfiles; i++)
+    {
+      FILE *symin = fopen (symbolfiles[i], "r");
+      if (!symin)
+        {
+          ERR_EXIT ("couldn't open symbol file '%s': %s", symbolfiles[i],
+                    strerror (errno));
+        }
+      if (load_symbols (&prog, symin) != 0)
+        {
+          fprintf (stderr, "failed to load symbols: %s\n", symbolfiles[i]);
+          exit (1);
+        }
+      fclose (symin);
+      free (symbolfiles[i]);
+    }
+
+  if (entryat)
+    {
+      uint16_t addr;
+      if (lookup_addr (&prog, entryat, &addr) != 0)
+        ERR_EXIT ("no such address or label: '%s'", entryat);
+      prog.entry = addr + 1;
+      free (entryat);
+    }
   poptFreeContext (optCon);
 
+  if ((profout || stacksout) && !(prog.prof = alloc_profile ()))
+    {
+      fprintf (stderr, "error: couldn't allocate profile\n");
+      exit (1);
+    }
+  if (nativesout && !(prog.natives = find_intrinsics (&prog)))
+    {
+      fprintf (stderr, "error: couldn't allocate intrinsics\n");
+      exit (1);
+    }
+  if (traceout && !(prog.trace = open_trace (traceout)))
+    exit (1);
+  if ((recordout || replayin)
+      && !(prog.input = open_input (recordout, replayin)))
+    {
+      fprintf (stderr, "error: couldn't allocate input log\n");
+      exit (1);
+    }
+  if (restorein && replayin)
+    seek_input (prog.input, prog.icount);
+
   signal (SIGINT, handle_interrupt);
-  disable_input_buffering ();
-  if (!interactive)
+  // a replayed run never touches the terminal
+  if (!replayin || interactive)
+    disable_input_buffering ();
+  if (gdbwhere)
     {
-      rc = execute_program (&prog);
+      rc = serve_gdb (&prog, gdbwhere);
+      free (gdbwhere);
+    }
+  else if (scriptin)
+    {
+      rc = run_script (&prog, scriptin);
+      fclose (scriptin);
+    }
+  else if (!interactive)
+    {
+      prog.limit = snapat ? snapat : forkat;
+      if (restorein && !(prog.mem[MR_MCR] & (1 << 15)))
+        rc = 0; // it was saved halted: there's nothing to pick up
+      else
+        rc = restorein ? resume_program (&prog) : execute_program (&prog);
+      if (rc == 0 && forkat)
+        rc = run_variants (&prog, variantsin);
     }
   else
     {
@@ -165,6 +549,51 @@ main (int argc, const char *argv[])
     }
   restore_input_buffering ();
 
+  if (snapout)
+    {
+      if (rc == 0 && snapat && prog.icount != (uint64_t)snapat)
+        fprintf (stderr, "warning: halted after %llu instructions\n",
+                 (unsigned long long)prog.icount);
+      if (save_snapshot (snapout, &prog) != 0 && rc == 0)
+        rc = 1;
+      fclose (snapout);
+    }
+  if (profout)
+    {
+      dump_profile (profout, &prog);
+      fclose (profout);
+    }
+  if (stacksout)
+    {
+      dump_stacks (stacksout, &prog);
+      fclose (stacksout);
+    }
+  if (nativesout)
+    {
+      dump_intrinsics (nativesout, &prog);
+      fclose (nativesout);
+    }
+  free_profile (prog.prof);
+  free (prog.natives);
+  free_debug (prog.debug);
+  free (prog.os);
+  free_image (prog.image);
+  free_devices (&prog);
+  free_segments (&prog);
+  close_input (prog.input);
+  if (recordout)
+    fclose (recordout);
+  if (replayin)
+    fclose (replayin);
+  if (variantsin)
+    fclose (variantsin);
+  if (traceout)
+    {
+      if (close_trace (prog.trace) != 0 && rc == 0)
+        rc = 1;
+      fclose (traceout);
+    }
+
   free_symbols (&prog);
 
   exit (rc);
@@ -44,7 +44,7 @@
 %token REG
 
 // assembler directives
-%token ORIG END FILL STRINGZ
+%token ORIG END FILL STRINGZ BLKW
 
 // literals
 %token NUMLIT STRLIT LABEL
@@ -191,6 +191,18 @@ instruction:
   $ref->flags = (HINT_FILL << 12); // so we know to use the whole thing
   prog->ref[ADDR(prog)++] = $ref;
 }
+| BLKW NUMLIT[count]
+{
+  // zeroes, hinted like so many .FILLs
+  for(int i = 0; i < $count; i++)
+    {
+      symbol *sym = calloc(1, sizeof(symbol));
+      sym->flags = (HINT_FILL << 12);
+      sym->label = strdup("_FILL");
+      prog->sym[ADDR(prog)] = sym;
+      prog->mem[ADDR(prog)++] = 0;
+    }
+}
 | STRINGZ STRLIT[raw]
 {
   // hint to the disassembler
@@ -227,6 +239,8 @@ assemble_program (program *prog, FILE *in)
   yyset_in (in, scanner);
 
   uint16_t rc = yyparse (prog, scanner);
+  mark_dirty (prog, prog->orig, prog->len);
+  drop_labels (prog);
   if (rc == 0)
     rc = resolve_symbols (prog);
 
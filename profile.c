@@ -0,0 +1,304 @@
+#include "program.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_TOP 20               // hottest blocks to report
+#define PROFILE_MAX_FRAMES (1 << 20) // call tree nodes before we stop growing
+
+profile *
+alloc_profile ()
+{
+  profile *prof = calloc (1, sizeof (profile));
+  if (!prof)
+    return 0;
+
+  prof->maxframes = 1024;
+  prof->frames = calloc (prof->maxframes, sizeof (frame));
+  if (!prof->frames)
+    {
+      free (prof);
+      return 0;
+    }
+  prof->nframes = 1; // the synthetic root
+
+  return prof;
+}
+
+void
+free_profile (profile *prof)
+{
+  if (prof)
+    free (prof->frames);
+  free (prof);
+}
+
+/* charge everything retired since the last call/return to the current frame */
+static void
+settle (profile *prof, uint64_t icount)
+{
+  prof->frames[prof->cur].self += icount - prof->mark;
+  prof->mark = icount;
+}
+
+void
+profile_call (profile *prof, uint16_t target, uint64_t icount)
+{
+  settle (prof, icount);
+
+  frame *cur = prof->frames + prof->cur;
+  uint32_t i;
+  for (i = cur->child; i; i = prof->frames[i].sibling)
+    if (prof->frames[i].addr == target)
+      break;
+
+  if (!i) // first time we've seen this call from here
+    {
+      if (prof->nframes == PROFILE_MAX_FRAMES)
+        return; // deep recursion; keep charging the caller
+      if (prof->nframes == prof->maxframes)
+        {
+          frame *frames = realloc (prof->frames,
+                                   2 * prof->maxframes * sizeof (frame));
+          if (!frames)
+            return;
+          prof->frames = frames;
+          prof->maxframes *= 2;
+          cur = prof->frames + prof->cur;
+        }
+
+      i = prof->nframes++;
+      memset (prof->frames + i, 0, sizeof (frame));
+      prof->frames[i].addr = target;
+      prof->frames[i].parent = prof->cur;
+      prof->frames[i].sibling = cur->child;
+      cur->child = i;
+    }
+
+  prof->cur = i;
+}
+
+void
+profile_return (profile *prof, uint64_t icount)
+{
+  settle (prof, icount);
+
+  // never pop the frame a run started in
+  if (prof->frames[prof->cur].parent)
+    prof->cur = prof->frames[prof->cur].parent;
+}
+
+#define IS_LABEL(prog, addr)                                                  \
+  ((prog)->sym[addr] && *(prog)->sym[addr]->label != '_')
+
+/* the (non-hint) label at an address, or its address */
+static const char *
+name_of (char *buf, program *prog, uint16_t addr)
+{
+  if (IS_LABEL (prog, addr))
+    return prog->sym[addr]->label;
+  sprintf (buf, "x%04X", addr);
+  return buf;
+}
+
+/* "LABEL+offset" for an address, given the label that owns it */
+static const char *
+where (char *buf, program *prog, uint16_t owner, uint16_t addr)
+{
+  if (!IS_LABEL (prog, owner))
+    return name_of (buf, prog, addr);
+
+  int n = sprintf (buf, "%s", prog->sym[owner]->label);
+  if (addr != owner)
+    sprintf (buf + n, "+%d", addr - owner);
+  return buf;
+}
+
+static int
+is_transfer (uint16_t word)
+{
+  switch (word >> 12)
+    {
+    case OP_BR:
+    case OP_JMP:
+    case OP_JSR:
+    case OP_RTI:
+      return 1;
+    case OP_TRAP:
+      return (word & 0xFF) == TRAP_HALT;
+    }
+  return 0;
+}
+
+typedef struct block
+{
+  uint16_t start, end; // inclusive
+  uint64_t entries, insts;
+} block;
+
+static int
+by_insts (const void *a, const void *b)
+{
+  const block *x = a, *y = b;
+  return (x->insts < y->insts) - (x->insts > y->insts);
+}
+
+static int
+by_calls (const void *a, const void *b)
+{
+  const uint64_t *x = *(const uint64_t **)a, *y = *(const uint64_t **)b;
+  return (*x < *y) - (*x > *y);
+}
+
+uint16_t
+dump_profile (FILE *out, program *prog)
+{
+  profile *prof = prog->prof;
+  uint64_t total = 0;
+  char buf1[256], buf2[256];
+
+  // owner[addr] is the closest label at or before addr
+  uint16_t *owner = calloc (MEMORY_MAX, sizeof (uint16_t));
+  block *blocks = calloc (MEMORY_MAX, sizeof (block));
+  const uint64_t **calls = calloc (MEMORY_MAX, sizeof (uint64_t *));
+  if (!owner || !blocks || !calls)
+    {
+      fprintf (stderr, "error: out of memory writing profile\n");
+      free (owner);
+      free (blocks);
+      free (calls);
+      return 1;
+    }
+
+  for (int addr = 0, cur = 0; addr < MEMORY_MAX; addr++)
+    {
+      if (IS_LABEL (prog, addr))
+        cur = addr;
+      owner[addr] = cur;
+      total += prof->exec[addr];
+    }
+
+  fprintf (out, "# %lu instructions retired\n", (unsigned long)total);
+
+  /* per-label totals */
+  fprintf (out, "\n%-24s%14s%8s\n", "# label", "instructions", "%");
+  for (int addr = 0; addr < MEMORY_MAX;)
+    {
+      uint64_t sum = 0;
+      int start = addr;
+      do
+        sum += prof->exec[addr++];
+      while (addr < MEMORY_MAX && owner[addr] == owner[start]);
+
+      if (sum)
+        fprintf (out, "%-24s%14lu%8.2f\n",
+                 IS_LABEL (prog, owner[start]) ? prog->sym[owner[start]]->label
+                                               : "(unlabeled)",
+                 (unsigned long)sum, 100.0 * sum / total);
+    }
+
+  /* basic blocks: split wherever control can enter or leave, or where the
+   * execution count changes (i.e. something jumped into the middle) */
+  int nblocks = 0;
+  for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+      if (!prof->exec[addr])
+        continue;
+
+      if (!nblocks || blocks[nblocks - 1].end != addr - 1
+          || is_transfer (prog->mem[addr - 1])
+          || prof->exec[addr] != prof->exec[addr - 1]
+          || IS_LABEL (prog, addr))
+        {
+          blocks[nblocks].start = addr;
+          blocks[nblocks].entries = prof->exec[addr];
+          nblocks++;
+        }
+      blocks[nblocks - 1].end = addr;
+      blocks[nblocks - 1].insts += prof->exec[addr];
+    }
+  qsort (blocks, nblocks, sizeof (block), by_insts);
+
+  fprintf (out, "\n%-16s%-24s%14s%14s%8s\n", "# block", "label", "entries",
+           "instructions", "%");
+  for (int i = 0; i < nblocks && i < PROFILE_TOP; i++)
+    {
+      block *b = blocks + i;
+      sprintf (buf2, "x%04X-x%04X", b->start, b->end);
+      fprintf (out, "%-16s%-24s%14lu%14lu%8.2f\n", buf2,
+               where (buf1, prog, owner[b->start], b->start),
+               (unsigned long)b->entries, (unsigned long)b->insts,
+               100.0 * b->insts / total);
+    }
+
+  /* branches */
+  fprintf (out, "\n%-8s%-24s%14s%14s%14s\n", "# addr", "label", "executed",
+           "taken", "not-taken");
+  for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+      if (!prof->exec[addr] || (prog->mem[addr] >> 12) != OP_BR
+          || !(prog->mem[addr] & 0x0E00))
+        continue;
+      fprintf (out, "x%04X   %-24s%14lu%14lu%14lu\n", addr,
+               where (buf1, prog, owner[addr], addr),
+               (unsigned long)prof->exec[addr],
+               (unsigned long)prof->taken[addr],
+               (unsigned long)(prof->exec[addr] - prof->taken[addr]));
+    }
+
+  /* subroutine calls */
+  int ncalls = 0;
+  for (int addr = 0; addr < MEMORY_MAX; addr++)
+    if (prof->calls[addr])
+      calls[ncalls++] = prof->calls + addr;
+  qsort (calls, ncalls, sizeof (uint64_t *), by_calls);
+
+  fprintf (out, "\n%-8s%-24s%14s\n", "# addr", "target", "calls");
+  for (int i = 0; i < ncalls; i++)
+    {
+      uint16_t addr = calls[i] - prof->calls;
+      fprintf (out, "x%04X   %-24s%14lu\n", addr,
+               where (buf1, prog, owner[addr], addr),
+               (unsigned long)*calls[i]);
+    }
+
+  free (owner);
+  free (blocks);
+  free (calls);
+
+  return 0;
+}
+
+uint16_t
+dump_stacks (FILE *out, program *prog)
+{
+  profile *prof = prog->prof;
+  uint32_t *path = calloc (prof->nframes, sizeof (uint32_t));
+  if (!path)
+    {
+      fprintf (stderr, "error: out of memory writing stacks\n");
+      return 1;
+    }
+
+  /* one "outer;inner;innermost count" line per frame, as consumed by
+   * flamegraph.pl and friends */
+  for (uint32_t i = 1; i < prof->nframes; i++)
+    {
+      if (!prof->frames[i].self)
+        continue;
+
+      int depth = 0;
+      for (uint32_t f = i; f; f = prof->frames[f].parent)
+        path[depth++] = f;
+
+      char buf[16];
+      while (depth-- > 0)
+        fprintf (out, "%s%c",
+                 name_of (buf, prog, prof->frames[path[depth]].addr),
+                 depth ? ';' : ' ');
+      fprintf (out, "%lu\n", (unsigned long)prof->frames[i].self);
+    }
+
+  free (path);
+  return 0;
+}
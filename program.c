@@ -1,38 +1,156 @@
 #include "program.h"
 #include "parse.h"
+#include <ctype.h> // tolower()
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> // strcasecmp()
 
+/* load an image as a segment of its own (unless path's null): non-zero if
+ * it overlaps one that's loaded already (other than one it replaces; see
+ * add_segment()) */
 uint16_t
-load_program (program *prog, FILE *in)
+load_segment (program *prog, FILE *in, const char *path, int flags)
 {
-  /* the origin tells us where in memory to place the image */
-  size_t read = fread (&prog->orig, sizeof (prog->orig), 1, in);
-  if (ferror (in))
+  /* the origin tells us where in memory to place the image, and we know
+   * the maximum file size so we only need one fread */
+  uint16_t *img = malloc ((MEMORY_MAX + 1) * sizeof (uint16_t));
+  if (!img)
+    {
+      fprintf (stderr, "error: out of memory loading program\n");
+      return 1;
+    }
+  size_t read = fread (img, sizeof (uint16_t), MEMORY_MAX + 1, in);
+  if (ferror (in) || read == 0)
     {
-      fprintf (stderr, "error loading program: %s\n", strerror (errno));
+      fprintf (stderr, "error loading program: %s\n",
+               ferror (in) ? strerror (errno) : "no origin");
+      free (img);
       return 1;
     }
-  prog->orig = SWAP16 (prog->orig);
 
-  /* we know the maximum file size so we only need one fread */
-  uint16_t *p = prog->mem + prog->orig;
-  read = fread (p, sizeof (uint16_t), (MEMORY_MAX - prog->orig), in);
-  if (ferror (in))
+  uint16_t orig = SWAP16 (img[0]);
+  uint32_t len = read - 1;
+  if (len > MEMORY_MAX - orig)
+    len = MEMORY_MAX - orig;
+  if (path && add_segment (prog, orig, len, path, flags) != 0)
     {
-      fprintf (stderr, "error loading program: %s\n", strerror (errno));
+      free (img);
       return 1;
     }
-  prog->len = read;
 
   /* swap to little endian */
-  while (read-- > 0)
+  for (uint32_t i = 0; i < len; i++)
+    prog->mem[orig + i] = SWAP16 (img[1 + i]);
+  free (img);
+
+  prog->orig = orig;
+  prog->len = len;
+  mark_dirty (prog, orig, len);
+  return 0;
+}
+
+uint16_t
+load_program (program *prog, FILE *in)
+{
+  return load_segment (prog, in, 0, 0);
+}
+
+/* whether another segment than skip has name */
+static int
+name_taken (program *prog, const char *name, int32_t skip)
+{
+  for (uint32_t i = 0; i < prog->nsegs; i++)
+    if ((int32_t)i != skip && strcmp (prog->segs[i].name, name) == 0)
+      return 1;
+  return 0;
+}
+
+/* note an image at orig-orig+len from path (see load_segment()); with
+ * SEG_RELOAD, one loaded from the same path before is replaced */
+uint16_t
+add_segment (program *prog, uint16_t orig, uint16_t len, const char *path,
+             int flags)
+{
+  int32_t old = -1;
+  for (uint32_t i = 0; (flags & SEG_RELOAD) && i < prog->nsegs; i++)
+    if (strcmp (prog->segs[i].path, path) == 0)
+      old = i;
+
+  char name[sizeof (prog->segs[0].name)];
+  const char *base = strrchr (path, '/'), *dot;
+  base = base ? base + 1 : path;
+  dot = strrchr (base, '.');
+  int n = dot && dot != base ? dot - base : (int)strlen (base);
+  if (n > (int)sizeof (name) - 4) // room for a number
+    n = sizeof (name) - 4;
+  snprintf (name, sizeof (name), "%.*s", n, base);
+  for (int i = 2; name_taken (prog, name, old) && i < 1000; i++)
+    snprintf (name, sizeof (name), "%.*s%d", n, base, i);
+
+  for (uint32_t i = 0; i < prog->nsegs; i++)
+    {
+      segment *seg = prog->segs + i;
+      if ((int32_t)i != old && len && seg->len
+          && orig < seg->orig + seg->len && seg->orig < orig + len)
+        {
+          fprintf (stderr,
+                   "error: %s (x%04X-x%04X) overlaps %s (x%04X-x%04X)\n",
+                   name, orig, orig + len - 1, seg->name, seg->orig,
+                   seg->orig + seg->len - 1);
+          return 1;
+        }
+    }
+  if (old < 0 && prog->nsegs == SEGMENTS_MAX)
+    {
+      fprintf (stderr, "error: no more than %d images\n", SEGMENTS_MAX);
+      return 1;
+    }
+  char *copy = strdup (path);
+  if (!copy)
+    {
+      fprintf (stderr, "error: out of memory loading %s\n", path);
+      return 1;
+    }
+
+  // a reloaded image goes last, as if it were new, and the rest keep their
+  // order
+  if (old >= 0)
     {
-      *p = SWAP16 (*p);
-      ++p;
+      free (prog->segs[old].path);
+      memmove (prog->segs + old, prog->segs + old + 1,
+               (--prog->nsegs - old) * sizeof (segment));
     }
+  segment *seg = prog->segs + prog->nsegs++;
+  seg->orig = orig;
+  seg->len = len;
+  seg->flags = flags & ~SEG_RELOAD;
+  strcpy (seg->name, name);
+  seg->path = copy;
+  drop_labels (prog); // which shadow which has changed
+  return 0;
+}
+
+void
+free_segments (program *prog)
+{
+  while (prog->nsegs)
+    free (prog->segs[--prog->nsegs].path);
+}
 
+/* load an OS image, noting where its trap vector table points (see
+ * native_trap) */
+uint16_t
+load_os (program *prog, FILE *in, const char *path)
+{
+  if (load_segment (prog, in, path, SEG_OS) != 0)
+    return 1;
+  if (!prog->os && !(prog->os = malloc (TRAP_VECTORS * sizeof (uint16_t))))
+    {
+      fprintf (stderr, "error: out of memory loading OS image\n");
+      return 1;
+    }
+  memcpy (prog->os, prog->mem, TRAP_VECTORS * sizeof (uint16_t));
   return 0;
 }
 
@@ -183,9 +301,177 @@ load_symbols (program *prog, FILE *in)
         }
     }
 
+  drop_labels (prog);
   return 0;
 }
 
+/* labels (ignoring case, and the assembler's _FILLs and _STRINGZs) to
+ * their addresses: an open addressed hash table, built from sym the first
+ * time a label's looked up, and dropped whenever sym changes; and the same
+ * labels sorted, for completing them */
+typedef struct labels
+{
+  const char **sorted; /* each label once, ignoring case */
+  uint32_t nsorted;
+  uint32_t mask;   /* the number of slots, less one (a power of two) */
+  uint32_t slot[]; /* an address plus one, or 0 if it's empty */
+} labels;
+
+#define IS_LABEL(prog, addr)                                                  \
+  ((prog)->sym[addr] && (prog)->sym[addr]->label                              \
+   && *(prog)->sym[addr]->label != '_')
+
+static uint32_t
+hash_label (const char *s)
+{
+  uint32_t h = 2166136261u; // FNV-1a
+  while (*s)
+    h = (h ^ (uint8_t)tolower (*s++)) * 16777619u;
+  return h;
+}
+
+/* the slot label is in, or would go in */
+static uint32_t
+label_slot (program *prog, labels *l, const char *label)
+{
+  uint32_t i = hash_label (label) & l->mask;
+  while (l->slot[i]
+         && strcasecmp (prog->sym[l->slot[i] - 1]->label, label) != 0)
+    i = (i + 1) & l->mask;
+  return i;
+}
+
+static int
+compare_labels (const void *a, const void *b)
+{
+  return strcasecmp (*(const char *const *)a, *(const char *const *)b);
+}
+
+static labels *
+index_labels (program *prog)
+{
+  uint32_t n = 0, size = 16;
+  for (uint32_t a = 0; a < MEMORY_MAX; a++)
+    n += IS_LABEL (prog, a);
+  while (size < 2 * n)
+    size <<= 1;
+
+  labels *l = calloc (1, sizeof (labels) + size * sizeof (uint32_t));
+  if (!l || !(l->sorted = malloc ((n ? n : 1) * sizeof (char *))))
+    {
+      free (l);
+      return 0;
+    }
+  l->mask = size - 1;
+  // images loaded later shadow those before, and any outside them come
+  // last; otherwise the first of any duplicates wins
+  for (int32_t s = prog->nsegs - 1; s >= -1; s--)
+    {
+      uint32_t first = s < 0 ? 0 : prog->segs[s].orig;
+      uint32_t end = s < 0 ? MEMORY_MAX : first + prog->segs[s].len;
+      for (uint32_t a = first; a < end; a++)
+        if (IS_LABEL (prog, a))
+          {
+            uint32_t i = label_slot (prog, l, prog->sym[a]->label);
+            if (!l->slot[i])
+              {
+                l->slot[i] = a + 1;
+                l->sorted[l->nsorted++] = prog->sym[a]->label;
+              }
+          }
+    }
+  qsort (l->sorted, l->nsorted, sizeof (char *), compare_labels);
+  return l;
+}
+
+static labels *
+get_labels (program *prog)
+{
+  if (!prog->labels && !(prog->labels = index_labels (prog)))
+    fprintf (stderr, "error: out of memory indexing labels\n");
+  return prog->labels;
+}
+
+/* where label is, or with IMAGE:LABEL, where it is in the segment named
+ * IMAGE (even if another shadows it); non-zero if it's nowhere */
+uint16_t
+find_label (program *prog, const char *label, uint16_t *addr)
+{
+  const char *colon = strchr (label, ':');
+  if (colon)
+    {
+      size_t n = colon - label;
+      for (uint32_t s = 0; s < prog->nsegs; s++)
+        {
+          segment *seg = prog->segs + s;
+          if (strlen (seg->name) != n || strncasecmp (seg->name, label, n))
+            continue;
+          for (uint32_t a = seg->orig; a < (uint32_t)seg->orig + seg->len;
+               a++)
+            if (IS_LABEL (prog, a)
+                && strcasecmp (prog->sym[a]->label, colon + 1) == 0)
+              {
+                *addr = a;
+                return 0;
+              }
+        }
+      return 1;
+    }
+
+  if (!get_labels (prog))
+    return 1;
+
+  uint32_t i = label_slot (prog, prog->labels, label);
+  if (!prog->labels->slot[i])
+    return 1;
+  *addr = prog->labels->slot[i] - 1;
+  return 0;
+}
+
+/* the labels starting with prefix (ignoring case), in order: how many,
+ * with the first of them at *first */
+uint32_t
+match_labels (program *prog, const char *prefix, const char *const **first)
+{
+  labels *l = get_labels (prog);
+  if (!l)
+    return 0;
+
+  // the first that isn't before prefix, and the first after those with it
+  size_t len = strlen (prefix);
+  uint32_t lo = 0, hi = l->nsorted;
+  while (lo < hi)
+    {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (strncasecmp (l->sorted[mid], prefix, len) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  uint32_t end = lo, top = l->nsorted;
+  while (end < top)
+    {
+      uint32_t mid = end + (top - end) / 2;
+      if (strncasecmp (l->sorted[mid], prefix, len) == 0)
+        end = mid + 1;
+      else
+        top = mid;
+    }
+
+  *first = l->sorted + lo;
+  return end - lo;
+}
+
+/* forget the index, once the symbols have changed */
+void
+drop_labels (program *prog)
+{
+  if (prog->labels)
+    free (prog->labels->sorted);
+  free (prog->labels);
+  prog->labels = 0;
+}
+
 static const char *opnames[16][2] = {
   { "BR", "br" },   { "ADD", "add" }, { "LD", "ld" },   { "ST", "st" },
   { "JSR", "jsr" }, { "AND", "and" }, { "LDR", "ldr" }, { "STR", "str" },
@@ -406,7 +692,8 @@ disassemble_addr (char *dest, int flags, uint16_t addr, program *prog)
 void
 free_symbols (program *prog)
 {
-  for (int i = prog->orig; i < prog->orig + prog->len; i++)
+  drop_labels (prog);
+  for (int i = 0; i < MEMORY_MAX; i++) // symbols can be for any image
     {
       if (prog->sym[i])
         {
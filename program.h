@@ -1,9 +1,13 @@
 #pragma once
 
+#include <signal.h> // for sig_atomic_t
 #include <stdint.h> // for uint16_t
 #include <stdio.h>  // for FILE *
 
 #define MEMORY_MAX (1 << 16)
+#define PAGE_BITS 8                       // memory is tracked in pages...
+#define PAGE_WORDS (1 << PAGE_BITS)       // ...of 256 words
+#define PAGES (MEMORY_MAX >> PAGE_BITS)
 #define SWAP16(x) ((x << 8) | (x >> 8))
 #define SIGN_EXTEND(x, bits)                                                  \
   ((((x) >> ((bits)-1)) & 1) ? ((x) | (0xFFFF << (bits))) : (x))
@@ -21,6 +25,9 @@ enum
   R_R7,
   R_PC, /* program counter */
   R_COND,
+  R_PSR,       /* privilege and priority (the condition codes are R_COND) */
+  R_SAVED_SSP, /* supervisor stack pointer, while in user mode */
+  R_SAVED_USP, /* user stack pointer, while in supervisor mode */
   R_COUNT
 };
 
@@ -35,7 +42,7 @@ enum
   OP_AND,    /* bitwise and */
   OP_LDR,    /* load register */
   OP_STR,    /* store register */
-  OP_RTI,    /* unused */
+  OP_RTI,    /* return from interrupt */
   OP_NOT,    /* bitwise not */
   OP_LDI,    /* load indirect */
   OP_STI,    /* store indirect */
@@ -53,13 +60,48 @@ enum
   FL_NEG = 1 << 2, /* N */
 };
 
-/* keyboard codes */
+/* memory mapped registers (see device.c) */
 enum
 {
-  MR_KBSR = 0xFE00, /* keyboard status */
-  MR_KBDR = 0xFE02  /* keyboard data */
+  MR_DEVICES = 0xFE00, /* devices can be mapped from here up */
+  MR_KBSR = 0xFE00,    /* keyboard status */
+  MR_KBDR = 0xFE02,    /* keyboard data */
+  MR_DSR = 0xFE04,     /* display status */
+  MR_DDR = 0xFE06,     /* display data */
+  MR_TMR = 0xFE08,     /* timer status */
+  MR_TMI = 0xFE0A,     /* timer interval (milliseconds, 0 = stopped) */
+  MR_PSR = 0xFFFC,     /* processor status */
+  MR_MCR = 0xFFFE      /* machine control (clear bit 15 to stop) */
 };
 
+/* device status bits */
+enum
+{
+  DS_READY = 1 << 15, /* KBSR: a key is waiting; DSR: always; TMR: the
+                         timer expired */
+  DS_IE = 1 << 14     /* interrupt enable */
+};
+
+/* processor status bits (privilege and priority; condition codes aside) */
+enum
+{
+  PSR_USER = 1 << 15,
+  PSR_PRIORITY = 0x0700
+};
+
+/* interrupt and exception vectors (offsets into the table at x0100) */
+enum
+{
+  IVT_BASE = 0x0100,
+  EX_PRIVILEGE = 0x00, /* RTI in user mode */
+  EX_ILLEGAL = 0x01,   /* reserved opcode */
+  INT_KEYBOARD = 0x80, /* priority 4 */
+  INT_TIMER = 0x81     /* priority 4 */
+};
+
+#define PL_DEVICE 4        // priority of device interrupts
+#define SSP_START 0x3000   // supervisor stack, growing down from x2FFF
+
 /* trap codes */
 enum
 {
@@ -71,6 +113,8 @@ enum
   TRAP_HALT = 0x25   /* halt the program */
 };
 
+#define TRAP_VECTORS 0x100 // the trap vector table, from x0000
+
 /* output formatting flags */
 #define FMT_OBJECT (0 << 0) // print assembled object code
 #define FMT_ADDR (1 << 0)   // include instruction addresses
@@ -94,15 +138,365 @@ typedef struct symbol
   char *label;
 } symbol;
 
-typedef struct program
+/* a node in the profiler's call tree */
+typedef struct frame
+{
+  uint16_t addr;                   /* subroutine entry point */
+  uint32_t parent, child, sibling; /* indices into profile.frames */
+  uint64_t self; /* instructions retired in this frame (not callees) */
+} frame;
+
+/* execution profile, allocated only when profiling is requested */
+typedef struct profile
+{
+  uint64_t exec[MEMORY_MAX];  /* executions per address */
+  uint64_t taken[MEMORY_MAX]; /* taken branches per address */
+  uint64_t calls[MEMORY_MAX]; /* JSR/JSRR calls per target address */
+  frame *frames;              /* call tree; frames[0] is a synthetic root */
+  uint32_t nframes, maxframes, cur;
+  uint64_t mark; /* instruction count at the last call/return */
+} profile;
+
+/* one retired instruction: what ran and what it wrote (see trace.c) */
+typedef struct trace_record
+{
+  uint16_t pc, word;    /* address and instruction */
+  uint16_t addr, value; /* register number or memory address, and value */
+} trace_record;
+
+/* the VM appends records at cur; the rest belongs to the writer thread */
+typedef struct trace
+{
+  trace_record *cur, *end;
+  struct trace_ring *ring;
+} trace;
+
+/* where keyboard input comes from (see io.c) */
+typedef struct input
+{
+  FILE *record;  /* log consumed input here, if non-null */
+  FILE *replay;  /* read input from this log instead of the terminal */
+  FILE *from;    /* ...or straight from this stream */
+  uint64_t next; /* instruction count of the next replayed character */
+  int ch;        /* ...and the character itself */
+} input;
+
+/* per-page flags */
+enum
+{
+  PG_DIRTY = 1 << 0, /* written since the last capture_image/load_image */
+  PG_DEVICE = 1 << 1, /* has device registers in it */
+  PG_BREAK = 1 << 2,  /* has breakpoints in it */
+  PG_WATCH = 1 << 3   /* has watched words in it */
+};
+
+/* a page shared between images, copied rather than modified */
+typedef struct vmpage
+{
+  uint32_t refs;
+  uint16_t words[PAGE_WORDS];
+} vmpage;
+
+/* a copy-on-write image of a machine's state (see fork.c); pages that are
+ * all zero are left null */
+typedef struct vmimage
+{
+  vmpage *page[PAGES];
+  uint16_t reg[R_COUNT];
+  uint64_t icount;
+} vmimage;
+
+/* how control flow recovery classified a word (see cfg.c) */
+enum
+{
+  W_CODE = 1 << 0,   /* reachable as an instruction */
+  W_DATA = 1 << 1,   /* in the image, but not code */
+  W_LEADER = 1 << 2, /* starts a basic block */
+  W_ENTRY = 1 << 3   /* the entry point or a JSR target */
+};
+
+/* basic block flags */
+enum
+{
+  CB_CALL = 1 << 0,     /* ends in JSR/JSRR */
+  CB_INDIRECT = 1 << 1, /* ends in JMP/JSRR */
+  CB_RETURN = 1 << 2,   /* ...that's a RET */
+  CB_HEADER = 1 << 3    /* heads a loop */
+};
+
+#define CFG_NONE UINT32_MAX
+
+typedef struct cfg_block
+{
+  uint16_t start, end; /* first and last instruction */
+  uint32_t succ[2];    /* fall-through and branch successors */
+  uint32_t call;       /* JSR target */
+  uint32_t idom;       /* immediate dominator */
+  uint32_t loop;       /* header of the innermost loop we're in */
+  uint32_t depth;      /* loop nesting depth */
+  uint8_t flags;       /* CB_* */
+} cfg_block;
+
+/* the control flow graph of an image; blocks are in address order and
+ * refer to each other by index (CFG_NONE for none) */
+typedef struct cfg
+{
+  uint8_t kind[MEMORY_MAX];      /* W_* */
+  uint32_t block_of[MEMORY_MAX]; /* the block containing each code word */
+  cfg_block *blocks;
+  uint32_t nblocks;
+} cfg;
+
+/* subroutines recognized as ones we can run natively (see intrinsic.c) */
+typedef struct intrinsics
+{
+  uint8_t at[MEMORY_MAX]; /* 1 + index into found[] of the routine here */
+  struct
+  {
+    uint16_t addr;    /* entry point */
+    uint8_t routine;  /* which one it is */
+    uint64_t hits;    /* calls run natively */
+    uint64_t retired; /* ...and the instructions they stood in for */
+  } found[255];
+  uint32_t nfound;
+} intrinsics;
+
+/* why a debugged machine last stopped */
+enum
+{
+  STOP_NONE = 0, /* it hasn't been run */
+  STOP_HALT,     /* it halted (or its clock was stopped) */
+  STOP_ERROR,    /* it couldn't go on */
+  STOP_BREAK,    /* it's at a breakpoint */
+  STOP_STEP,     /* it ran the instructions it was asked to */
+  STOP_FINISH,   /* the subroutine it was in returned */
+  STOP_WATCH,    /* an instruction touched a watched word */
+  STOP_START,    /* it went back as far as its history goes */
+  STOP_INTERRUPT /* it was interrupted (see interrupt_debug()) */
+};
+
+/* what a watchpoint stops on */
+enum
+{
+  WATCH_READ = 1 << 0,
+  WATCH_WRITE = 1 << 1,
+  WATCH_ACCESS = WATCH_READ | WATCH_WRITE
+};
+
+/* a range of memory to stop on loads and/or stores to */
+typedef struct watchpoint
+{
+  uint16_t first, last;
+  uint8_t kind; /* WATCH_* */
+} watchpoint;
+
+/* a breakpoint condition, compiled (see compile_cond() in debug.c) to
+ * postfix code for a little stack machine: operands are pushed, and
+ * operators pop theirs and push the result */
+enum
+{
+  COND_END = 0, /* the end of it (so an empty one always holds) */
+  COND_CONST,   /* push the next word */
+  COND_REG,     /* push the register the next word names (R_PSR with the
+                   condition codes) */
+  COND_MEM,     /* replace an address with the word there */
+  COND_EQ,      /* comparisons, signed */
+  COND_NE,
+  COND_LT,
+  COND_LE,
+  COND_GT,
+  COND_GE,
+  COND_AND,
+  COND_OR
+};
+
+#define COND_MAX 64 // words of compiled condition
+
+/* a breakpoint's condition and counts (its address also has a bit in
+ * debug.breaks) */
+typedef struct breakpoint
+{
+  uint16_t addr;
+  uint32_t hits;   /* times it's been reached with its condition true */
+  uint32_t ignore; /* hits to go on past before it stops again */
+  char *cond;      /* the condition as it was given, or null */
+  uint16_t code[COND_MAX];
+} breakpoint;
+
+#define WATCH_MAX 16
+#define MARKS_MAX 256 // checkpoints kept for running backwards
+
+/* a key the machine consumed, and the instruction that consumed it */
+typedef struct keypress
+{
+  uint64_t icount;
+  int ch;
+} keypress;
+
+/* a time the timer expired: the instruction count, and whether it was
+ * between instructions (servicing devices) or during that one */
+typedef struct expiry
+{
+  uint64_t icount;
+  int between;
+} expiry;
+
+/* a debugger's hold on a machine, allocated only once one's wanted (see
+ * debug.c) */
+typedef struct debug
+{
+  uint8_t breaks[MEMORY_MAX / 8]; /* a bit per address with a breakpoint */
+  breakpoint *bps; /* ...and the breakpoints themselves */
+  uint32_t nbps, maxbps;
+  uint64_t from;  /* icount it was resumed at: a breakpoint there is passed */
+  uint32_t depth; /* if non-zero, returns to go before it stops */
+  int stop;       /* why it last stopped (STOP_*) */
+  watchpoint watches[WATCH_MAX];
+  uint32_t nwatches;
+  struct
+  {
+    uint16_t addr, old, val; /* the word, and its value before and after */
+    uint8_t kind;            /* WATCH_READ or WATCH_WRITE */
+  } hit;                     /* the access that stopped it on a watchpoint */
+
+  /* the run's history: checkpoints, and every key it's consumed and time
+   * the timer's expired (which happen again from here, by instruction
+   * count, while it re-runs its past) */
+  vmimage *marks[MARKS_MAX];
+  uint32_t nmarks;
+  keypress *keys;
+  uint32_t nkeys, maxkeys, nextkey;
+  expiry *expiries;
+  uint32_t nexpiries, maxexpiries, nextexpiry;
+  int replaying; /* re-running the past: hits are noted, not stopped on */
+  uint64_t before; /* ...those at an icount before this, that is */
+  uint64_t seen;   /* the last hit noted... */
+  int seen_stop;   /* ...and what it was (STOP_BREAK/STOP_WATCH) */
+} debug;
+
+struct program;
+
+/* what a device does when it's waited on */
+enum
+{
+  DW_NEVER = 0, /* it can't interrupt */
+  DW_NOW,       /* it's interrupting already */
+  DW_LATER      /* it can, on input from fd and/or at a deadline */
+};
+
+/* a memory mapped device: a range of registers in xFE00-xFFFF, and hooks
+ * for them (see device.c). Registers with no read/write hook are plain
+ * memory. */
+typedef struct device
+{
+  const char *name;
+  uint16_t first, last;     /* the registers it answers for */
+  uint8_t vector, priority; /* the interrupt it raises, if any */
+  uint16_t (*read) (struct program *prog, struct device *dev,
+                    uint16_t address);
+  void (*write) (struct program *prog, struct device *dev, uint16_t address,
+                 uint16_t val);
+  /* when a device has signalled: non-zero if it's requesting its
+   * interrupt */
+  int (*poll) (struct program *prog, struct device *dev);
+  /* DW_*, filling in fd (or leaving it -1) and deadline (host ns, or 0) */
+  int (*wait) (struct program *prog, struct device *dev, int *fd,
+               uint64_t *deadline);
+  uint64_t due; /* device state: host time (ns) of its next event */
+} device;
+
+#define BUS_MAX 16
+
+typedef struct bus
+{
+  device devices[BUS_MAX];
+  uint8_t at[MEMORY_MAX - MR_DEVICES]; /* 1 + index of each register's */
+  uint32_t ndevices;
+} bus;
+
+#define SEGMENTS_MAX 16
+
+/* what's true of a segment */
+enum
+{
+  SEG_OS = 1 << 0,    /* it's an OS image, not a program to start */
+  SEG_RELOAD = 1 << 1 /* (for add_segment()) it replaces one loaded from
+                         the same path, as interactive mode's load does */
+};
+
+/* an image loaded into memory, named for its file (without directories or
+ * extension, and numbered if another image has that name already); the
+ * name qualifies the labels in it (see find_label()) */
+typedef struct segment
 {
   uint16_t orig, len;
+  uint8_t flags; /* SEG_* */
+  char name[32];
+  char *path; /* the file it came from */
+} segment;
+
+typedef struct program
+{
+  uint16_t orig, len; /* the image loaded last */
+  segment segs[SEGMENTS_MAX]; /* every image loaded (see load_segment()) */
+  uint32_t nsegs;
+  uint32_t entry; /* where runs start, plus one; 0 for the default (see
+                     entry_point()) */
   uint16_t mem[MEMORY_MAX];
   uint16_t reg[R_COUNT];
+  uint64_t icount; /* instructions retired by the current run */
+  uint64_t limit;  /* if non-zero, stop once icount reaches this */
+  uint64_t due;    /* service devices once icount reaches this, whatever
+                      the time (for replayed input); UINT64_MAX if never */
+  profile *prof;   /* non-null if we're profiling */
+  trace *trace;    /* non-null if we're tracing */
+  input *input;    /* non-null if we're recording or replaying input */
+  intrinsics *natives; /* non-null if we're running intrinsics natively */
+  debug *debug;         /* non-null if we're debugging */
+  uint8_t pages[PAGES]; /* per-page flags (PG_*) */
+  vmimage *image;       /* the image mem was last captured to/loaded from */
+  struct bus *bus;      /* memory mapped devices */
+  uint16_t *os; /* the trap vector table as an OS image left it, or null */
   symbol *sym[MEMORY_MAX];
   symbol *ref[MEMORY_MAX];
+  struct labels *labels; /* sym indexed by label, built when it's wanted */
 } program;
 
+static inline void
+update_flags (uint16_t reg[], uint16_t r)
+{
+  if (reg[r] == 0)
+    {
+      reg[R_COND] = FL_ZRO;
+    }
+  else if (reg[r] >> 15) /* a 1 in the left-most bit indicates negative */
+    {
+      reg[R_COND] = FL_NEG;
+    }
+  else
+    {
+      reg[R_COND] = FL_POS;
+    }
+}
+
+static inline void
+mem_write (program *prog, uint16_t address, uint16_t val)
+{
+  prog->mem[address] = val;
+  prog->pages[address >> PAGE_BITS] |= PG_DIRTY;
+}
+
+/* flag the pages holding len words from first as written */
+static inline void
+mark_dirty (program *prog, uint16_t first, uint32_t len)
+{
+  if (len == 0)
+    return;
+  for (uint32_t page = first >> PAGE_BITS;
+       page <= ((first + len - 1) >> PAGE_BITS) && page < PAGES; page++)
+    prog->pages[page] |= PG_DIRTY;
+}
+
 /* for assembly */
 uint16_t assemble_program (program *prog, FILE *in);
 uint16_t resolve_symbols (program *prog);
@@ -114,12 +508,112 @@ uint16_t attach_symbols (program *prog);
 
 /* execution (execute.c) */
 uint16_t execute_program (program *prog);
+uint16_t entry_point (program *prog);
+void start_program (program *prog);
+uint16_t resume_program (program *prog);
+uint16_t enter_handler (program *prog, uint16_t vector, uint16_t priority);
+
+/* native intrinsics (intrinsic.c) */
+intrinsics *find_intrinsics (program *prog);
+uint64_t call_intrinsic (program *prog);
+uint16_t dump_intrinsics (FILE *out, program *prog);
+
+/* control flow graphs (cfg.c) */
+cfg *build_cfg (program *prog, uint16_t entry);
+uint16_t dump_cfg (FILE *out, cfg *g, program *prog);
+uint16_t dump_cfg_dot (FILE *out, cfg *g, program *prog);
+void free_cfg (cfg *g);
+
+/* copy-on-write images (fork.c) */
+vmimage *capture_image (program *prog);
+vmimage *clone_image (vmimage *img);
+uint16_t load_image (program *prog, vmimage *img);
+uint16_t reset_program (program *prog, vmimage *pristine);
+void free_image (vmimage *img);
+
+/* breakpoints, stepping and running backwards (debug.c) */
+debug *attach_debug (program *prog);
+int is_break (program *prog, uint16_t addr);
+uint16_t set_break (program *prog, uint16_t addr, int on);
+breakpoint *find_break (program *prog, uint16_t addr);
+const char *set_cond (program *prog, uint16_t addr, const char *cond);
+uint16_t set_watch (program *prog, uint16_t first, uint16_t last, int kind);
+uint16_t clear_watch (program *prog, uint16_t first, uint16_t last);
+uint16_t lookup_addr (program *prog, const char *s, uint16_t *addr);
+int debug_start (program *prog);
+int debug_run (program *prog);
+int debug_continue (program *prog);
+int debug_step (program *prog, uint64_t n, int over);
+int debug_finish (program *prog);
+int debug_reverse_step (program *prog, uint64_t n);
+int debug_reverse_continue (program *prog);
+int interrupt_debug (void);
+void free_debug (debug *dbg);
+
+/* a GDB remote protocol stub (gdb.c) */
+int serve_gdb (program *prog, const char *where);
+
+/* snapshots (snapshot.c) */
+uint16_t save_snapshot (FILE *out, program *prog);
+uint16_t restore_snapshot (program *prog, FILE *in);
+
+/* memory mapped devices and interrupts (device.c) */
+extern volatile sig_atomic_t device_signal; /* a device wants attention */
+extern volatile sig_atomic_t stop_signal;   /* stop at the next chance */
+uint16_t attach_device (program *prog, const device *dev);
+uint16_t device_read (program *prog, uint16_t address);
+void device_write (program *prog, uint16_t address, uint16_t val);
+uint16_t start_devices (program *prog);
+uint16_t service_devices (program *prog);
+void wait_for_device (program *prog);
+void free_devices (program *prog);
+
+/* keyboard input, recorded/replayed, and buffered output (io.c) */
+input *open_input (FILE *record, FILE *replay);
+void seek_input (input *in, uint64_t icount);
+int key_ready (program *prog);
+uint64_t key_due (program *prog);
+uint16_t read_key (program *prog);
+int native_trap (program *prog, uint16_t vector);
+uint16_t execute_trap (program *prog, uint16_t vector);
+void set_flush (unsigned every);
+void set_output (FILE *out);
+void put_char (uint16_t c);
+void flush_output (int force);
+void close_input (input *in);
+
+/* profiling (profile.c) */
+profile *alloc_profile ();
+void profile_call (profile *prof, uint16_t target, uint64_t icount);
+void profile_return (profile *prof, uint64_t icount);
+uint16_t dump_profile (FILE *out, program *prog);
+uint16_t dump_stacks (FILE *out, program *prog);
+void free_profile (profile *prof);
+
+/* execution traces (trace.c) */
+trace *open_trace (FILE *out);
+void next_trace_chunk (trace *tr);
+uint16_t close_trace (trace *tr);
+size_t pack_trace (uint8_t *dest, const trace_record *src, size_t n);
+size_t unpack_trace (trace_record *dest, const uint8_t *src, size_t n,
+                     size_t len);
+uint16_t read_trace_header (FILE *in);
+int read_trace_chunk (FILE *in, trace_record **records, size_t *n);
 
 /* input/output */
 uint16_t load_program (program *prog, FILE *in);
+uint16_t load_segment (program *prog, FILE *in, const char *path, int flags);
+uint16_t add_segment (program *prog, uint16_t orig, uint16_t len,
+                      const char *path, int flags);
+uint16_t load_os (program *prog, FILE *in, const char *path);
+void free_segments (program *prog);
 uint16_t load_symbols (program *prog, FILE *in);
 uint16_t print_program (FILE *out, int flags, program *prog);
 uint16_t dump_symbols (FILE *out, int flags, program *prog);
+uint16_t find_label (program *prog, const char *label, uint16_t *addr);
+uint32_t match_labels (program *prog, const char *prefix,
+                       const char *const **first);
+void drop_labels (program *prog);
 
 /* memory management */
 void free_symbols (program *prog);
@@ -0,0 +1,195 @@
+#include "program.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix only */
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A snapshot is everything needed to pick a run back up where it stopped:
+ *
+ *   "LC3S" version(2) 0 0 0
+ *   icount(u64le) reg[R_COUNT](u16le) orig(u16le) len(u16le)
+ *   page bitmap (32 bytes, bit n set if page n follows)
+ *   pages (256 u16le words each, in address order)
+ *   nsyms(u32le) { addr(u16le) flags(u16le) length(u16le) label... }
+ *
+ * Memory is stored sparsely, in 256-word pages, skipping pages that are all
+ * zero; most programs touch a handful of pages so a snapshot is typically a
+ * few KiB. Device registers live in memory, so they come along for free. */
+
+#define SNAPSHOT_VERSION 2
+#define HEADER_SIZE (8 + 8 + 2 * R_COUNT + 4 + PAGES / 8)
+
+static const uint8_t snapshot_magic[8]
+    = { 'L', 'C', '3', 'S', SNAPSHOT_VERSION };
+
+#define PUT16(p, v) (*(p)++ = (v) & 0xFF, *(p)++ = (v) >> 8)
+#define GET16(p) ((p) += 2, (uint16_t)((p)[-2] | ((p)[-1] << 8)))
+
+static int
+page_used (const uint16_t *page)
+{
+  for (int i = 0; i < PAGE_WORDS; i++)
+    if (page[i])
+      return 1;
+  return 0;
+}
+
+uint16_t
+save_snapshot (FILE *out, program *prog)
+{
+  size_t size = HEADER_SIZE + sizeof (prog->mem) + 4;
+  for (int addr = 0; addr < MEMORY_MAX; addr++)
+    if (prog->sym[addr])
+      size += 6 + strlen (prog->sym[addr]->label);
+
+  uint8_t *buf = malloc (size), *p = buf;
+  if (!buf)
+    {
+      fprintf (stderr, "error: out of memory writing snapshot\n");
+      return 1;
+    }
+
+  memcpy (p, snapshot_magic, sizeof (snapshot_magic));
+  p += sizeof (snapshot_magic);
+  for (int i = 0; i < 8; i++)
+    *p++ = prog->icount >> (8 * i);
+  for (int r = 0; r < R_COUNT; r++)
+    PUT16 (p, prog->reg[r]);
+  PUT16 (p, prog->orig);
+  PUT16 (p, prog->len);
+
+  uint8_t *bitmap = p;
+  memset (bitmap, 0, PAGES / 8);
+  p += PAGES / 8;
+  for (int page = 0; page < PAGES; page++)
+    {
+      const uint16_t *words = prog->mem + (page << PAGE_BITS);
+      if (!page_used (words))
+        continue;
+      bitmap[page / 8] |= 1 << (page % 8);
+      for (int i = 0; i < PAGE_WORDS; i++)
+        PUT16 (p, words[i]);
+    }
+
+  uint8_t *nsyms = p;
+  uint32_t n = 0;
+  p += 4;
+  for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+      symbol *sym = prog->sym[addr];
+      if (!sym)
+        continue;
+      uint16_t len = strlen (sym->label);
+      PUT16 (p, addr);
+      PUT16 (p, sym->flags);
+      PUT16 (p, len);
+      memcpy (p, sym->label, len);
+      p += len;
+      n++;
+    }
+  for (int i = 0; i < 4; i++)
+    nsyms[i] = n >> (8 * i);
+
+  uint16_t rc = 0;
+  if (fwrite (buf, p - buf, 1, out) != 1 || fflush (out) != 0)
+    {
+      fprintf (stderr, "error writing snapshot: %s\n", strerror (errno));
+      rc = 1;
+    }
+
+  free (buf);
+  return rc;
+}
+
+uint16_t
+restore_snapshot (program *prog, FILE *in)
+{
+  struct stat st;
+  if (fstat (fileno (in), &st) != 0)
+    {
+      fprintf (stderr, "error reading snapshot: %s\n", strerror (errno));
+      return 1;
+    }
+  if (st.st_size < HEADER_SIZE + 4)
+    {
+      fprintf (stderr, "error: not an lc3 snapshot (or an unknown version)\n");
+      return 1;
+    }
+
+  const uint8_t *base
+      = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fileno (in), 0);
+  if (base == MAP_FAILED)
+    {
+      fprintf (stderr, "error reading snapshot: %s\n", strerror (errno));
+      return 1;
+    }
+
+  const uint8_t *p = base, *end = base + st.st_size;
+  uint16_t rc = 1;
+  if (memcmp (p, snapshot_magic, sizeof (snapshot_magic)) != 0)
+    {
+      fprintf (stderr, "error: not an lc3 snapshot (or an unknown version)\n");
+      goto done;
+    }
+  p += sizeof (snapshot_magic);
+
+  uint64_t icount = 0;
+  for (int i = 0; i < 8; i++)
+    icount |= (uint64_t)*p++ << (8 * i);
+  prog->icount = icount;
+  for (int r = 0; r < R_COUNT; r++)
+    prog->reg[r] = GET16 (p);
+  prog->orig = GET16 (p);
+  prog->len = GET16 (p);
+
+  const uint8_t *bitmap = p;
+  p += PAGES / 8;
+  for (int page = 0; page < PAGES; page++)
+    {
+      uint16_t *words = prog->mem + (page << PAGE_BITS);
+      if (!(bitmap[page / 8] & (1 << (page % 8))))
+        {
+          memset (words, 0, PAGE_WORDS * sizeof (uint16_t));
+          continue;
+        }
+      if (end - p < 2 * PAGE_WORDS + 4)
+        goto truncated;
+      for (int i = 0; i < PAGE_WORDS; i++)
+        words[i] = GET16 (p);
+    }
+
+  uint32_t nsyms = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  p += 4;
+  while (nsyms-- > 0)
+    {
+      if (end - p < 6)
+        goto truncated;
+      uint16_t addr = GET16 (p), flags = GET16 (p), len = GET16 (p);
+      if (end - p < len)
+        goto truncated;
+
+      if (prog->sym[addr])
+        free (prog->sym[addr]->label);
+      else if (!(prog->sym[addr] = calloc (1, sizeof (symbol))))
+        {
+          fprintf (stderr, "error: out of memory reading snapshot\n");
+          goto done;
+        }
+      prog->sym[addr]->flags = flags;
+      prog->sym[addr]->label = strndup ((const char *)p, len);
+      p += len;
+    }
+  drop_labels (prog);
+
+  rc = 0;
+  goto done;
+
+truncated:
+  fprintf (stderr, "error: truncated snapshot\n");
+done:
+  munmap ((void *)base, st.st_size);
+  return rc;
+}
@@ -0,0 +1,140 @@
+; exercises subroutine calls, computed jumps and memory access: sums a
+; table through a function pointer, prints the digits of the result, then
+; walks a jump table
+
+.orig x3000
+
+  lea r0, BANNER
+  puts
+
+  ; sum the table via a function pointer
+  ld r5, SUMPTR
+  jsrr r5
+  jsr PRINTNUM
+  ld r0, NEWLINE
+  out
+
+  ; dispatch each entry of CASES through a jump table
+  lea r4, CASES
+NEXTCASE
+  ldr r1, r4, #0
+  brn DONE
+  lea r2, JUMPS
+  add r2, r2, r1
+  ldr r2, r2, #0
+  jmp r2
+BACK
+  add r4, r4, #1
+  br NEXTCASE
+
+DONE
+  ldi r0, PACKEDPTR
+  lea r0, PACKED
+  putsp
+  ld r0, NEWLINE
+  out
+  halt
+
+CASEA
+  lea r0, SAYA
+  puts
+  br BACK
+CASEB
+  lea r0, SAYB
+  puts
+  br BACK
+CASEC
+  not r3, r1
+  add r3, r3, #1
+  sti r3, SCRATCHPTR
+  lea r0, SAYC
+  puts
+  br BACK
+
+; r0 = sum of TABLE
+SUM
+  and r0, r0, #0
+  lea r1, TABLE
+  ld r2, COUNT
+SUMLOOP
+  ldr r3, r1, #0
+  add r0, r0, r3
+  add r1, r1, #1
+  add r2, r2, #-1
+  brp SUMLOOP
+  ret
+
+; print r0 (0-999) in decimal
+PRINTNUM
+  st r7, SAVE7
+  and r1, r1, #0
+HUNDREDS
+  ld r2, MINUS100
+  add r2, r0, r2
+  brn TENS0
+  add r0, r2, #0
+  add r1, r1, #1
+  br HUNDREDS
+TENS0
+  st r0, SAVE0
+  jsr DIGIT
+  ld r0, SAVE0
+  and r1, r1, #0
+TENS
+  add r2, r0, #-10
+  brn ONES
+  add r0, r2, #0
+  add r1, r1, #1
+  br TENS
+ONES
+  st r0, SAVE0
+  jsr DIGIT
+  ld r1, SAVE0
+  jsr DIGIT
+  ld r7, SAVE7
+  ret
+
+; print the digit in r1
+DIGIT
+  st r7, SAVE7B
+  ld r0, ZERO
+  add r0, r0, r1
+  out
+  ld r7, SAVE7B
+  ret
+
+SUMPTR .fill SUM
+PACKEDPTR .fill PACKED
+SCRATCHPTR .fill SCRATCH
+NEWLINE .fill x000A
+MINUS100 .fill #-100
+ZERO .fill x0030
+COUNT .fill #6
+SAVE0 .fill #0
+SAVE7 .fill #0
+SAVE7B .fill #0
+SCRATCH .fill #0
+TABLE .fill #17
+  .fill #42
+  .fill #99
+  .fill #3
+  .fill #120
+  .fill #64
+CASES .fill #1
+  .fill #0
+  .fill #2
+  .fill #1
+  .fill #-1
+JUMPS .fill CASEA
+  .fill CASEB
+  .fill CASEC
+BANNER .stringz "sum: "
+SAYA .stringz "a"
+SAYB .stringz "b"
+SAYC .stringz "c"
+PACKED .fill x6F64
+  .fill x656E
+  .fill x0021
+  .fill #0
+
+.end
@@ -0,0 +1,24 @@
+; counts to N*M in a word of memory, for long enough to be checkpointed
+; a good few times on the way
+
+.orig x3000
+
+  and r3, r3, #0
+  ld r1, N
+OUTER
+  ld r2, M
+INNER
+  add r3, r3, #1
+  st r3, COUNT
+  add r2, r2, #-1
+  brp INNER
+  add r1, r1, #-1
+  brp OUTER
+DONE
+  halt
+
+N .fill #1000
+M .fill #30000
+COUNT .fill #0
+
+.end
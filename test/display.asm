@@ -0,0 +1,23 @@
+; writes a string a character at a time through the display registers,
+; polling DSR before each one
+
+.orig x3000
+
+  lea r1, MESSAGE
+NEXT
+  ldr r2, r1, #0
+  brz DONE
+POLL
+  ldi r0, DSR
+  brzp POLL
+  sti r2, DDR
+  add r1, r1, #1
+  br NEXT
+DONE
+  halt
+
+DSR .fill xFE04
+DDR .fill xFE06
+MESSAGE .stringz "polled, not trapped\n"
+
+.end
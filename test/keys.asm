@@ -0,0 +1,41 @@
+; echo keystrokes back until a 'q', alternating between polling the
+; keyboard status register and GETC; each polled key is followed by a
+; letter that encodes how many times we polled before it arrived
+
+.orig x3000
+
+LOOP
+  and r1, r1, #0
+POLL
+  add r1, r1, #1
+  ldi r0, KBSR
+  brzp POLL
+  ldi r0, KBDR
+  out
+  ld r2, MASK
+  and r0, r1, r2
+  ld r2, LETTER
+  add r0, r0, r2
+  out
+  ldi r0, KBDR
+  ld r2, QUIT
+  add r2, r0, r2
+  brz DONE
+  getc
+  out
+  ld r2, QUIT
+  add r2, r0, r2
+  brnp LOOP
+DONE
+  ld r0, NEWLINE
+  out
+  halt
+
+KBSR .fill xFE00
+KBDR .fill xFE02
+MASK .fill x000F
+LETTER .fill x0041
+QUIT .fill xFF8F
+NEWLINE .fill x000A
+
+.end
@@ -0,0 +1,286 @@
+; calls the multiply, divide, modulo and random number routines that ship
+; with 2048 and rogue over a table of arguments (including the corner cases
+; each one handles specially), saving every result, flag and the stack
+; after each call
+
+.orig x3000
+
+  ld r6, STACK
+
+  ; called directly once each, so they can be found without symbols
+  and r0, r0, #0
+  add r0, r0, #6
+  and r1, r1, #0
+  add r1, r1, #7
+  jsr MULT
+  jsr SAVE
+  jsr MOD_DIV
+  jsr SAVE
+  jsr MODULO
+  jsr SAVE
+  jsr RAND
+  jsr SAVE
+
+  ; then again through a pointer for each case
+NEXTCASE
+  ld r4, CASEPTR
+  ldr r2, r4, #0
+  brz DONE
+  ldr r0, r4, #1
+  ldr r1, r4, #2
+  add r4, r4, #3
+  st r4, CASEPTR
+  jsrr r2
+  jsr SAVE
+  br NEXTCASE
+
+DONE
+  lea r0, FINISHED
+  puts
+  halt
+
+; store r0-r6 and the condition codes (1 = p, 2 = z, 4 = n) at OUTPTR
+SAVE
+  st r2, SAVE_R2
+  st r3, SAVE_R3
+  and r3, r3, #0  ; can't touch the flags yet
+  brp SAVE_P
+  brz SAVE_Z
+  add r3, r3, #2
+SAVE_Z
+  add r3, r3, #1
+SAVE_P
+  add r3, r3, #1
+  ld r2, OUTPTR
+  str r0, r2, #0
+  str r1, r2, #1
+  str r4, r2, #4
+  str r5, r2, #5
+  str r6, r2, #6
+  str r3, r2, #7
+  ld r3, SAVE_R2
+  str r3, r2, #2
+  ld r3, SAVE_R3
+  str r3, r2, #3
+  add r2, r2, #8
+  st r2, OUTPTR
+  ld r2, SAVE_R2
+  ld r3, SAVE_R3
+  ret
+
+SAVE_R2 .fill #0
+SAVE_R3 .fill #0
+STACK .fill x4000
+OUTPTR .fill x5000
+CASEPTR .fill CASES
+FINISHED .stringz "done\n"
+
+; routine, r0, r1
+CASES
+  .fill MULT
+  .fill #0
+  .fill #5
+  .fill MULT
+  .fill #7
+  .fill #0
+  .fill MULT
+  .fill #300
+  .fill #300
+  .fill MULT
+  .fill x8003     ; the top bit of r0 is never tested
+  .fill #5
+  .fill MULT
+  .fill #-2
+  .fill #3
+  .fill MOD_DIV
+  .fill #17
+  .fill #5
+  .fill MOD_DIV
+  .fill #20
+  .fill #5
+  .fill MOD_DIV
+  .fill #3
+  .fill #7
+  .fill MOD_DIV
+  .fill #0
+  .fill #3
+  .fill MOD_DIV
+  .fill #5
+  .fill #-1
+  .fill MOD_DIV
+  .fill #32767
+  .fill #1
+  .fill MODULO
+  .fill #17
+  .fill #5
+  .fill MODULO
+  .fill #20
+  .fill #5
+  .fill MODULO
+  .fill #3
+  .fill #7
+  .fill MODULO
+  .fill #9
+  .fill #0
+  .fill MODULO
+  .fill #-5
+  .fill #3
+  .fill MODULO
+  .fill #5
+  .fill #-3
+  .fill MODULO
+  .fill #30000
+  .fill #7
+  .fill RAND
+  .fill #0
+  .fill #0
+  .fill RAND
+  .fill #0
+  .fill #0
+  .fill #0
+
+;--------------------------------------------------------------------------
+; from 2048.asm
+;--------------------------------------------------------------------------
+
+MOD_DIV
+      STR   R1, R6, #-1       ; save registers
+      STR   R2, R6, #-2
+      STR   R3, R6, #-3
+      ADD   R6, R6, #-3
+
+      NOT   R2, R1
+      ADD   R2, R2, #1
+      BRz   MOD_DIV_EX        ; halt if dividing by zero
+
+      AND   R1, R1, #0        ; clear R1 (quotient)
+
+MOD_DIV_LOOP
+      ADD   R1, R1, #1
+      ADD   R0, R0, R2        ; R0 -= R1
+      BRp MOD_DIV_LOOP        ; R0 - R1 > 0, so keep looping
+      BRz MOD_DIV_END         ; R0 = 0, so we finished exactly
+
+                              ; R0 < 0, so we subtracted an extra one
+      LDR   R2, R6, #2        ; add it back in
+      ADD   R1, R1, #-1
+      ADD   R0, R0, R2
+
+MOD_DIV_END
+      LDR   R3, R6, #0
+      LDR   R2, R6, #1
+      ADD   R6, R6, #3
+      RET
+
+MOD_DIV_EX
+      HALT
+
+MULT
+      ADD   R0, R0, #0
+      BRz   MULT_ZERO   ; return 0 if R0 = 0
+      ADD   R1, R1, #0
+      BRz   MULT_ZERO   ; return 0 if R1 = 0
+
+      STR   R1, R6, #-1 ; save registers
+      STR   R2, R6, #-2 ; save registers
+      STR   R3, R6, #-3
+      STR   R4, R6, #-4
+      ADD   R6, R6, #-4
+
+      AND   R2, R2, #0  ; clear R2 (product)
+      ADD   R3, R2, #1  ; set R3 = 1 (bit tester)
+
+MULT_LOOP               ; for each bit in R0
+      AND   R4, R0, R3        ; R4 = bit test(R0, R3)
+      BRnz  #1                ; only execute next line if bit is set
+      ADD   R2, R2, R1              ; product = product + R1
+      ADD   R1, R1, R1        ; R1 << 1
+      ADD   R3, R3, R3        ; R3 << 1
+      BRp   MULT_LOOP
+
+      ADD   R0, R2, #0  ; move product to R0
+
+MULT_END
+      LDR   R4, R6, #0  ; restore registers
+      LDR   R3, R6, #1
+      LDR   R2, R6, #2
+      LDR   R1, R6, #3
+      ADD   R6, R6, #4
+      RET
+
+MULT_ZERO
+      AND   R0, R0, #0
+      RET
+
+;--------------------------------------------------------------------------
+; from rogue.asm
+;--------------------------------------------------------------------------
+
+; R0 = rand
+RAND
+    ; push onto stack
+    STR R1, R6, #-1
+    STR R2, R6, #-2
+    STR R3, R6, #-3
+    STR R4, R6, #-4
+    STR R5, R6, #-5
+    STR R7, R6, #-6
+    ADD R6, R6, #-6
+    ; seed = (a * seed + c) % m
+    LD  R1, SEED_A
+    LD  R2, SEED
+    AND R0, R0, x0
+RAND_MULTIPLY     ; a * seed
+    ADD R0, R0, R2
+    ADD R1, R1, #-1
+    BRp RAND_MULTIPLY
+    LD  R1, SEED_C
+    ADD R0, R0, R1 ; + C
+    LD  R1, SEED_M
+    AND R0, R0, R1 ; % m
+    ST  R0, SEED
+    ; pop from stack
+    LDR R7, R6, #0
+    LDR R5, R6, #1
+    LDR R4, R6, #2
+    LDR R3, R6, #3
+    LDR R2, R6, #4
+    LDR R1, R6, #5
+    ADD R6, R6, #6
+    RET
+
+SEED   .FILL xAC34 ; made up number
+SEED_A .FILL #15245 ; made up
+SEED_C .FILL #131 ; smaller incrementer
+SEED_M .FILL x7FFF ; masks to last bit (prevents negative)
+
+; R0 = (R0 % R1)
+MODULO
+    ; push onto stack
+    STR R2, R6, #-1
+    STR R3, R6, #-2
+    STR R4, R6, #-3
+    STR R5, R6, #-4
+    STR R7, R6, #-5
+    ADD R6, R6, #-5
+    ; R1 = -q
+    NOT R1, R1  ; 2's complement of
+    ADD R1, R1, #1
+    BRz MODULO_DONE ; if q is 0
+    ADD R2, R0, R1  ; look ahead if x - q < 0
+    BRn MODULO_DONE
+MODULO_LOOP
+    ADD R0, R0, R1 ; x -= q
+    ADD R2, R0, R1 ; look ahead
+    BRzp MODULO_LOOP
+MODULO_DONE
+    ; pop from stack
+    LDR R7, R6, #0
+    LDR R5, R6, #1
+    LDR R4, R6, #2
+    LDR R3, R6, #3
+    LDR R2, R6, #4
+    ADD R6, R6, #5
+    RET
+
+.end
@@ -0,0 +1,84 @@
+; echoes keys from a keyboard interrupt handler while the main program
+; idles, then on 'q' hands over to the timer, counts down three ticks and
+; stops the clock
+
+.orig x3000
+
+  ld r6, USP
+  lea r0, KBISR       ; install the handlers
+  sti r0, KBVEC
+  lea r0, TMISR
+  sti r0, TMVEC
+  ld r0, IE           ; and turn the keyboard on
+  sti r0, KBSR
+IDLE
+  br IDLE
+
+KBISR
+  str r0, r6, #-1
+  str r1, r6, #-2
+  add r6, r6, #-2
+  ldi r0, PSR         ; supervisor mode, priority 4?
+  ld r1, PSRMASK
+  and r0, r0, r1
+  ld r1, NEGPL4
+  add r0, r0, r1
+  brz KBKEY
+  ld r0, BANG
+  out
+KBKEY
+  ldi r0, KBDR
+  out
+  ld r1, NEGQ
+  add r1, r0, r1
+  brnp KBDONE
+  sti r1, KBSR        ; keyboard off, timer on
+  ld r0, INTERVAL
+  sti r0, TMI
+  ld r0, IE
+  sti r0, TMR
+KBDONE
+  ldr r1, r6, #0
+  ldr r0, r6, #1
+  add r6, r6, #2
+  rti
+
+TMISR
+  str r0, r6, #-1
+  add r6, r6, #-1
+  ldi r0, TMR         ; acknowledge
+  ld r0, DOT
+  out
+  ld r0, TICKS
+  add r0, r0, #-1
+  st r0, TICKS
+  brp TMDONE
+  ld r0, NEWLINE
+  out
+  and r0, r0, #0
+  sti r0, MCR
+TMDONE
+  ldr r0, r6, #0
+  add r6, r6, #1
+  rti
+
+USP .fill x4000
+KBVEC .fill x0180
+TMVEC .fill x0181
+KBSR .fill xFE00
+KBDR .fill xFE02
+TMR .fill xFE08
+TMI .fill xFE0A
+PSR .fill xFFFC
+MCR .fill xFFFE
+IE .fill x4000
+PSRMASK .fill x8700
+NEGPL4 .fill xFC00
+NEGQ .fill xFF8F
+INTERVAL .fill #20
+TICKS .fill #3
+BANG .fill x0021
+DOT .fill x002E
+NEWLINE .fill x000A
+
+.end
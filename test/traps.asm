@@ -0,0 +1,93 @@
+; installs trap routines of its own over the OS image's: an OUT that
+; upper-cases letters, a new TRAP x26, and a HALT that says goodbye first;
+; the OS image's PUTS, PUTSP and IN print through whichever OUT is installed
+
+.orig x3000
+
+  ld r1, OUT_VEC
+  ldr r2, r1, #0
+  st r2, OLD_OUT
+  lea r2, SHOUT
+  str r2, r1, #0
+
+  ld r1, NEW_VEC
+  lea r2, TRAPPED
+  str r2, r1, #0
+
+  ld r1, HALT_VEC
+  ldr r2, r1, #0
+  st r2, OLD_HALT
+  lea r2, GOODBYE
+  str r2, r1, #0
+
+  lea r0, WORDS
+  puts
+  lea r0, PACKED
+  putsp
+  in
+  trap x26
+
+  ; put OUT back, so everything's native again
+  ld r1, OUT_VEC
+  ld r2, OLD_OUT
+  str r2, r1, #0
+  lea r0, QUIET
+  puts
+  halt
+
+; OUT, upper-casing letters
+SHOUT
+  st r0, SHOUT_R0
+  st r1, SHOUT_R1
+  st r7, SHOUT_R7
+  ld r1, MINUS_A
+  add r1, r0, r1
+  brn SHOUT_OUT
+  ld r1, MINUS_Z1
+  add r1, r0, r1
+  brzp SHOUT_OUT
+  add r0, r0, #-16
+  add r0, r0, #-16
+SHOUT_OUT
+  ld r1, OLD_OUT
+  jsrr r1
+  ld r0, SHOUT_R0
+  ld r1, SHOUT_R1
+  ld r7, SHOUT_R7
+  ret
+
+TRAPPED
+  st r7, TRAPPED_R7
+  lea r0, TRAPPED_MSG
+  puts
+  ld r7, TRAPPED_R7
+  ret
+
+GOODBYE
+  lea r0, BYE
+  puts
+  ld r1, OLD_HALT
+  jmp r1
+
+OUT_VEC .fill x21
+NEW_VEC .fill x26
+HALT_VEC .fill x25
+OLD_OUT .fill #0
+OLD_HALT .fill #0
+SHOUT_R0 .fill #0
+SHOUT_R1 .fill #0
+SHOUT_R7 .fill #0
+TRAPPED_R7 .fill #0
+MINUS_A .fill #-97
+MINUS_Z1 .fill #-123
+
+WORDS .stringz "hello, "
+PACKED
+  .fill x6261 ; "ab"
+  .fill x0063 ; "c"
+  .fill #0
+TRAPPED_MSG .stringz " trapped"
+QUIET .stringz " quiet"
+BYE .stringz " bye"
+
+.end
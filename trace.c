@@ -0,0 +1,344 @@
+#include "program.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A trace file is a short header followed by independently-packed chunks:
+ *
+ *   "LC3T" version(1) 0 0 0
+ *   nrecords(u32le) nbytes(u32le) packed records...
+ *   ...
+ *
+ * Each packed record is a flag byte followed by only those fields that
+ * differ from what we predicted: the pc after the previous record, and the
+ * word/addr/value last seen at the same pc. Values that moved by a small
+ * amount (loop counters, pointers) are stored as a one byte delta. */
+
+#define TRACE_VERSION 1
+#define TRACE_CHUNK (1 << 16) // records per chunk
+#define TRACE_CHUNKS 64       // chunks in the ring (32MiB of records)
+#define TRACE_PACKED_MAX 9    // worst case bytes per packed record
+
+enum
+{
+  TF_PC = 1 << 0,     /* pc follows */
+  TF_WORD = 1 << 1,   /* word follows */
+  TF_ADDR = 1 << 2,   /* addr follows */
+  TF_VALUE = 1 << 3,  /* value follows */
+  TF_DELTA = 1 << 4   /* ...as a signed byte delta */
+};
+
+static const uint8_t trace_magic[8] = { 'L', 'C', '3', 'T', TRACE_VERSION };
+
+struct trace_ring
+{
+  trace_record *records;     /* TRACE_CHUNKS chunks of TRACE_CHUNK records */
+  size_t fill[TRACE_CHUNKS]; /* records in each handed-off chunk */
+  unsigned head, tail;       /* chunk the VM is filling / the writer is on */
+  int done, error;
+  FILE *out;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t more, room;
+};
+
+/* per-pc predictions, reset at the start of every chunk */
+typedef struct predictor
+{
+  uint16_t pc;
+  uint16_t word[MEMORY_MAX], addr[MEMORY_MAX], value[MEMORY_MAX];
+} predictor;
+
+#define PUT16(p, v) (*(p)++ = (v) & 0xFF, *(p)++ = (v) >> 8)
+#define GET16(p) ((p) += 2, (uint16_t)((p)[-2] | ((p)[-1] << 8)))
+
+static void
+put32 (uint8_t *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+    p[i] = v >> (8 * i);
+}
+
+static uint32_t
+get32 (const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+size_t
+pack_trace (uint8_t *dest, const trace_record *src, size_t n)
+{
+  predictor *pr = calloc (1, sizeof (predictor));
+  if (!pr)
+    return 0;
+
+  uint8_t *p = dest;
+  for (const trace_record *r = src; r < src + n; r++)
+    {
+      uint8_t *flags = p++;
+      int16_t delta = r->value - pr->value[r->pc];
+
+      *flags = 0;
+      if (r->pc != pr->pc)
+        {
+          *flags |= TF_PC;
+          PUT16 (p, r->pc);
+        }
+      if (r->word != pr->word[r->pc])
+        {
+          *flags |= TF_WORD;
+          PUT16 (p, r->word);
+        }
+      if (r->addr != pr->addr[r->pc])
+        {
+          *flags |= TF_ADDR;
+          PUT16 (p, r->addr);
+        }
+      if (delta >= -128 && delta <= 127 && delta)
+        {
+          *flags |= TF_VALUE | TF_DELTA;
+          *p++ = (uint8_t)delta;
+        }
+      else if (delta)
+        {
+          *flags |= TF_VALUE;
+          PUT16 (p, r->value);
+        }
+
+      pr->word[r->pc] = r->word;
+      pr->addr[r->pc] = r->addr;
+      pr->value[r->pc] = r->value;
+      pr->pc = r->pc + 1;
+    }
+
+  free (pr);
+  return p - dest;
+}
+
+size_t
+unpack_trace (trace_record *dest, const uint8_t *src, size_t n, size_t len)
+{
+  predictor *pr = calloc (1, sizeof (predictor));
+  if (!pr)
+    return 0;
+
+  const uint8_t *p = src, *end = src + len;
+  for (trace_record *r = dest; r < dest + n; r++)
+    {
+      uint8_t flags = (p < end) ? *p : 0;
+      int need = 1 + ((flags & TF_PC) ? 2 : 0) + ((flags & TF_WORD) ? 2 : 0)
+                 + ((flags & TF_ADDR) ? 2 : 0)
+                 + ((flags & TF_VALUE) ? ((flags & TF_DELTA) ? 1 : 2) : 0);
+      if (end - p < need)
+        {
+          free (pr);
+          return 0;
+        }
+      p++;
+
+      r->pc = (flags & TF_PC) ? GET16 (p) : pr->pc;
+      r->word = (flags & TF_WORD) ? GET16 (p) : pr->word[r->pc];
+      r->addr = (flags & TF_ADDR) ? GET16 (p) : pr->addr[r->pc];
+      if (flags & TF_DELTA)
+        r->value = pr->value[r->pc] + (int8_t)*p++;
+      else
+        r->value = (flags & TF_VALUE) ? GET16 (p) : pr->value[r->pc];
+
+      pr->word[r->pc] = r->word;
+      pr->addr[r->pc] = r->addr;
+      pr->value[r->pc] = r->value;
+      pr->pc = r->pc + 1;
+    }
+
+  free (pr);
+  return p - src;
+}
+
+uint16_t
+read_trace_header (FILE *in)
+{
+  uint8_t magic[sizeof (trace_magic)];
+  if (fread (magic, sizeof (magic), 1, in) != 1
+      || memcmp (magic, trace_magic, sizeof (magic)) != 0)
+    {
+      fprintf (stderr, "error: not an lc3 trace (or an unknown version)\n");
+      return 1;
+    }
+  return 0;
+}
+
+int
+read_trace_chunk (FILE *in, trace_record **records, size_t *n)
+{
+  uint8_t hdr[8];
+  size_t read = fread (hdr, 1, sizeof (hdr), in);
+  if (read == 0 && feof (in))
+    return 0;
+  if (read != sizeof (hdr))
+    {
+      fprintf (stderr, "error: truncated trace chunk\n");
+      return -1;
+    }
+
+  uint32_t count = get32 (hdr), len = get32 (hdr + 4);
+  if (count > TRACE_CHUNK || len > (size_t)count * TRACE_PACKED_MAX)
+    {
+      fprintf (stderr, "error: corrupt trace chunk\n");
+      return -1;
+    }
+
+  uint8_t *packed = malloc (len);
+  *records = realloc (*records, count * sizeof (trace_record));
+  if (!packed || (count && !*records))
+    {
+      fprintf (stderr, "error: out of memory reading trace\n");
+      free (packed);
+      return -1;
+    }
+
+  if (fread (packed, 1, len, in) != len
+      || unpack_trace (*records, packed, count, len) != len)
+    {
+      fprintf (stderr, "error: corrupt trace chunk\n");
+      free (packed);
+      return -1;
+    }
+
+  free (packed);
+  *n = count;
+  return 1;
+}
+
+/* the writer thread: pack and write chunks as the VM hands them off */
+static void *
+drain (void *arg)
+{
+  struct trace_ring *ring = arg;
+  uint8_t *packed = malloc (8 + TRACE_CHUNK * TRACE_PACKED_MAX);
+
+  pthread_mutex_lock (&ring->lock);
+  if (!packed)
+    ring->error = ENOMEM;
+  for (;;)
+    {
+      while (ring->tail == ring->head && !ring->done)
+        pthread_cond_wait (&ring->more, &ring->lock);
+      if (ring->tail == ring->head)
+        break; // done, and everything has been written
+
+      unsigned idx = ring->tail % TRACE_CHUNKS;
+      size_t n = ring->fill[idx];
+      pthread_mutex_unlock (&ring->lock);
+
+      if (n && packed && !ring->error)
+        {
+          size_t len = pack_trace (packed + 8,
+                                   ring->records + idx * TRACE_CHUNK, n);
+          put32 (packed, n);
+          put32 (packed + 4, len);
+          if (!len || fwrite (packed, 1, 8 + len, ring->out) != 8 + len)
+            ring->error = errno ? errno : EIO;
+        }
+
+      pthread_mutex_lock (&ring->lock);
+      ring->tail++;
+      pthread_cond_signal (&ring->room);
+    }
+  pthread_mutex_unlock (&ring->lock);
+
+  free (packed);
+  return 0;
+}
+
+trace *
+open_trace (FILE *out)
+{
+  trace *tr = calloc (1, sizeof (trace));
+  struct trace_ring *ring = calloc (1, sizeof (struct trace_ring));
+  if (!tr || !ring
+      || !(ring->records
+           = malloc (TRACE_CHUNKS * TRACE_CHUNK * sizeof (trace_record))))
+    {
+      fprintf (stderr, "error: couldn't allocate trace buffer\n");
+      goto fail;
+    }
+
+  if (fwrite (trace_magic, sizeof (trace_magic), 1, out) != 1)
+    {
+      fprintf (stderr, "error: couldn't write trace: %s\n", strerror (errno));
+      goto fail;
+    }
+
+  ring->out = out;
+  pthread_mutex_init (&ring->lock, 0);
+  pthread_cond_init (&ring->more, 0);
+  pthread_cond_init (&ring->room, 0);
+  if (pthread_create (&ring->thread, 0, drain, ring) != 0)
+    {
+      fprintf (stderr, "error: couldn't start trace writer\n");
+      goto fail;
+    }
+
+  tr->ring = ring;
+  tr->cur = ring->records;
+  tr->end = tr->cur + TRACE_CHUNK;
+  return tr;
+
+fail:
+  if (ring)
+    free (ring->records);
+  free (ring);
+  free (tr);
+  return 0;
+}
+
+/* hand the current chunk to the writer; wait if the ring is full */
+void
+next_trace_chunk (trace *tr)
+{
+  struct trace_ring *ring = tr->ring;
+  trace_record *base
+      = ring->records + (ring->head % TRACE_CHUNKS) * TRACE_CHUNK;
+
+  pthread_mutex_lock (&ring->lock);
+  ring->fill[ring->head % TRACE_CHUNKS] = tr->cur - base;
+  ring->head++;
+  pthread_cond_signal (&ring->more);
+  while (ring->head - ring->tail >= TRACE_CHUNKS)
+    pthread_cond_wait (&ring->room, &ring->lock);
+  pthread_mutex_unlock (&ring->lock);
+
+  tr->cur = ring->records + (ring->head % TRACE_CHUNKS) * TRACE_CHUNK;
+  tr->end = tr->cur + TRACE_CHUNK;
+}
+
+uint16_t
+close_trace (trace *tr)
+{
+  if (!tr)
+    return 0;
+
+  struct trace_ring *ring = tr->ring;
+  next_trace_chunk (tr);
+
+  pthread_mutex_lock (&ring->lock);
+  ring->done = 1;
+  pthread_cond_signal (&ring->more);
+  pthread_mutex_unlock (&ring->lock);
+  pthread_join (ring->thread, 0);
+
+  int error = ring->error;
+  if (error)
+    fprintf (stderr, "error: couldn't write trace: %s\n", strerror (error));
+
+  pthread_mutex_destroy (&ring->lock);
+  pthread_cond_destroy (&ring->more);
+  pthread_cond_destroy (&ring->room);
+  free (ring->records);
+  free (ring);
+  free (tr);
+
+  return error ? 1 : 0;
+}